@@ -0,0 +1,360 @@
+#include <BernardJIT.h>
+#include <ExecutorPool.h>
+#include <Parser.h>
+#include <ProgramGen.h>
+#include <Scanner.h>
+#include <benchmark/benchmark.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/IRBuilder.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+static void BM_ScannerNextToken(benchmark::State &state) {
+    ProgramGen gen;
+    const std::string src = gen.Program("f", state.range(0), 16);
+    int64_t tokens = 0;
+    for (auto _ : state) {
+        Scanner scanner(src);
+        while (scanner.NextToken().m_type != TokenType::Eof || !scanner.CurToken().m_val.empty()) tokens++;
+    }
+    state.SetBytesProcessed(state.iterations() * src.size());
+    state.SetItemsProcessed(tokens);
+}
+BENCHMARK(BM_ScannerNextToken)->Arg(16)->Arg(256);
+
+static void BM_ParseDeepExpression(benchmark::State &state) {
+    ProgramGen gen;
+    const std::string src = gen.DeepExpression(state.range(0)) + ";";
+    for (auto _ : state) {
+        Scanner scanner(src);
+        scanner.NextToken();
+        benchmark::DoNotOptimize(ParseExpression(scanner));
+    }
+}
+BENCHMARK(BM_ParseDeepExpression)->Arg(16)->Arg(256);
+
+static void BM_ParseWideExpression(benchmark::State &state) {
+    ProgramGen gen;
+    const std::string src = gen.WideExpression(state.range(0)) + ";";
+    for (auto _ : state) {
+        Scanner scanner(src);
+        scanner.NextToken();
+        benchmark::DoNotOptimize(ParseExpression(scanner));
+    }
+}
+BENCHMARK(BM_ParseWideExpression)->Arg(16)->Arg(1024);
+
+static std::unique_ptr<FunctionDefAst> ParseDef(const std::string &src) {
+    Scanner scanner(src);
+    scanner.NextToken();
+    return ParseFunctionDef(scanner);
+}
+
+static void BM_CodeGen(benchmark::State &state) {
+    ProgramGen gen;
+    const std::string src = gen.FunctionDef("f", 4, state.range(0));
+    for (auto _ : state) {
+        state.PauseTiming();
+        InitLLVMOpt();
+        std::unique_ptr<FunctionDefAst> def = ParseDef(src);
+        state.ResumeTiming();
+        benchmark::DoNotOptimize(def->CodeGen(false));
+    }
+}
+BENCHMARK(BM_CodeGen)->Arg(16)->Arg(1024);
+
+static void BM_OptimizePipeline(benchmark::State &state) {
+    ProgramGen gen;
+    const std::string src = gen.FunctionDef("f", 4, state.range(0));
+    for (auto _ : state) {
+        state.PauseTiming();
+        InitLLVMOpt();
+        llvm::Function *func = ParseDef(src)->CodeGen(false);
+        state.ResumeTiming();
+        OptimizeFunction(func);
+    }
+}
+BENCHMARK(BM_OptimizePipeline)->Arg(16)->Arg(1024);
+
+static void BM_DefineThenCall(benchmark::State &state) {
+    ProgramGen gen;
+    InitJIT();
+    int64_t id = 0;
+    for (auto _ : state) {
+        std::string name = "dtc" + std::to_string(id++);
+        Scanner scanner(gen.FunctionDef(name, 2, 8) + " " + gen.FunctionCall(name, 2));
+        RunScript(scanner);
+    }
+}
+BENCHMARK(BM_DefineThenCall)->Unit(benchmark::kMicrosecond);
+
+static void BM_TopLevelExpressions(benchmark::State &state) {
+    ProgramGen gen;
+    InitJIT();
+    const std::string src = gen.WideExpression(8, "") + ";";
+    for (auto _ : state) {
+        Scanner scanner(src);
+        RunScript(scanner);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_TopLevelExpressions)->Unit(benchmark::kMicrosecond);
+
+static void BM_ForLoopKernel(benchmark::State &state) {
+    ProgramGen gen;
+    InitJIT();
+    Scanner defs(gen.LoopKernel("kernel"));
+    RunScript(defs);
+    const std::string call = "kernel(" + std::to_string(state.range(0)) + ");";
+    for (auto _ : state) {
+        Scanner scanner(call);
+        RunScript(scanner);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ForLoopKernel)->Arg(1000)->Arg(1000000)->Unit(benchmark::kMicrosecond);
+
+// range(0) selects fast-math, the accumulator chain is what strict IEEE mode cannot reassociate
+static void BM_ReductionLoop(benchmark::State &state) {
+    InitJIT();
+    SetFastMath(state.range(0));
+    Scanner defs("def reduce(n) var acc = 0 in (for i = 0, i < n in acc = acc + i * 0.5 + i * i) + acc;");
+    RunScript(defs);
+    SetFastMath(false);
+    const std::string call = "reduce(" + std::to_string(state.range(1)) + ");";
+    for (auto _ : state) {
+        Scanner scanner(call);
+        RunScript(scanner);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(1));
+}
+BENCHMARK(BM_ReductionLoop)->ArgsProduct({{0, 1}, {1000000}})->ArgNames({"fast", "n"})->Unit(benchmark::kMicrosecond);
+
+// strong scaling of parallel for, range(0) is the thread count
+static void BM_ParallelFor(benchmark::State &state) {
+    SetParallelism(state.range(0));
+    InitJIT();
+    Scanner defs("def work(n) parallel for i = 0, i < n in (var s = 0 in (for j = 0, j < 64 in s = s + sqrt(i + j)) + s);");
+    RunScript(defs);
+    const std::string call = "work(" + std::to_string(state.range(1)) + ");";
+    for (auto _ : state) {
+        Scanner scanner(call);
+        RunScript(scanner);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(1));
+    SetParallelism(0);
+}
+BENCHMARK(BM_ParallelFor)
+        ->ArgsProduct({benchmark::CreateRange(1, std::max(1u, std::thread::hardware_concurrency()), 2), {1 << 20}})
+        ->ArgNames({"threads", "n"})
+        ->UseRealTime()
+        ->Unit(benchmark::kMillisecond);
+
+// cost of one call into generated code, range(0) = 1 runs it in a bernard_executor child. ping is a
+// bare round trip to bernard_ping, expr compiles and evaluates a top-level expression each time.
+static void BM_CallOverhead(benchmark::State &state) {
+    bool remote = state.range(0);
+    if (remote) {
+        if (!InitRemoteJIT(BERNARD_EXECUTOR_PATH)) {
+            state.SkipWithError("no executor");
+            return;
+        }
+    } else {
+        InitJIT();
+    }
+    Scanner defs("def one() 1;");
+    RunScript(defs);
+    for (auto _ : state) {
+        if (state.range(1)) {
+            Scanner scanner("one();");
+            RunScript(scanner);
+        } else if (remote) {
+            benchmark::DoNotOptimize(GetExecutorPool()->Ping(1));
+        } else {
+            benchmark::DoNotOptimize(bernard_ping(1));
+        }
+    }
+    InitJIT();
+}
+BENCHMARK(BM_CallOverhead)
+        ->ArgsProduct({{0, 1}, {0, 1}})
+        ->ArgNames({"remote", "expr"})
+        ->UseRealTime()
+        ->Unit(benchmark::kMicrosecond);
+
+// latency of the first call into a def in lazy mode, range(0) = 1 lets a speculation thread compile it
+// while its caller runs. The caller is compiled and run once beforehand without reaching the callee.
+static void BM_FirstCall(benchmark::State &state) {
+    SetLazyCompile(true, state.range(0));
+    InitJIT();
+    ProgramGen gen;
+    int64_t id = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        std::string leaf = "leaf" + std::to_string(id), caller = "caller" + std::to_string(id++);
+        Scanner defs(gen.FunctionDef(leaf, 1, 64) + " def " + caller + "(x) if x < 0 then " + leaf +
+                     "(x) else x; " + caller + "(1);");
+        RunScript(defs);
+        GetJIT()->waitForSpeculation();
+        Scanner call(caller + "(-1);");
+        state.ResumeTiming();
+        RunScript(call);
+    }
+    state.counters["hit_rate"] = GetJIT()->getSpeculationStats().hitRate();
+    SetLazyCompile(false);
+}
+BENCHMARK(BM_FirstCall)->Arg(0)->Arg(1)->ArgName("speculate")->Unit(benchmark::kMicrosecond);
+
+// accumulator recursion, deep enough to overflow the stack unless it is turned into a loop
+static void BM_DeepRecursion(benchmark::State &state) {
+    InitJIT();
+    Scanner defs("def sumto(n acc) if n < 1 then acc else sumto(n - 1, acc + n);");
+    RunScript(defs);
+    const std::string call = "sumto(" + std::to_string(state.range(0)) + ", 0);";
+    for (auto _ : state) {
+        Scanner scanner(call);
+        RunScript(scanner);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_DeepRecursion)->Arg(1000)->Arg(10000000)->Unit(benchmark::kMicrosecond);
+
+// doubles every element of a host array, one call per element or one call with the array as a buffer
+static void BM_BufferScale(benchmark::State &state) {
+    InitJIT();
+    Scanner defs("def twice(x) x * 2; def scaleAll(a[]) for i = 0, i < len(a) - 1 in a[i] = a[i] * 2;");
+    RunScript(defs);
+    auto twice = reinterpret_cast<double (*)(double)>(FunctionAddress("twice"));
+    auto scaleAll = reinterpret_cast<double (*)(double *, int64_t)>(FunctionAddress("scaleAll"));
+    std::vector<double> data(state.range(1), 1.0);
+    for (auto _ : state) {
+        if (state.range(0)) {
+            scaleAll(data.data(), data.size());
+        } else {
+            for (double &x : data) x = twice(x);
+        }
+        benchmark::ClobberMemory();
+        std::fill(data.begin(), data.end(), 1.0);
+    }
+    state.SetItemsProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_BufferScale)->ArgsProduct({{0, 1}, {1 << 16}})->ArgNames({"buffer", "n"})->Unit(benchmark::kMicrosecond);
+
+// a library with one def edited between loads, reloaded as a whole or incrementally
+static void BM_ReloadOneEdit(benchmark::State &state) {
+    InitJIT();
+    ProgramGen gen;
+    std::string lib;
+    for (int64_t i = 0; i < state.range(0); i++) lib += gen.FunctionDef("lib" + std::to_string(i), 2, 16) + " ";
+    int64_t edit = 0;
+    for (auto _ : state) {
+        Scanner scanner(lib + "def edited(x) x * " + std::to_string(edit++) + ";");
+        if (state.range(1))
+            ReloadScript(scanner);
+        else
+            RunScript(scanner);
+    }
+}
+BENCHMARK(BM_ReloadOneEdit)
+        ->ArgsProduct({{64}, {0, 1}})
+        ->ArgNames({"defs", "incremental"})
+        ->Unit(benchmark::kMillisecond);
+
+// defs full of repeated subexpressions, compiled with and without hash-consing
+static void BM_HashConsing(benchmark::State &state) {
+    InitJIT();
+    SetHashConsing(state.range(0));
+    std::string script;
+    for (int i = 0; i < 32; i++)
+        script += "def cse" + std::to_string(i) +
+                  "(x y) (x * y + sqrt(x * y)) * (x * y + sqrt(x * y)) - (x * y + sqrt(x * y)) / (x + y); ";
+    for (auto _ : state) {
+        Scanner scanner(script);
+        RunScript(scanner);
+    }
+    SetHashConsing(true);
+}
+BENCHMARK(BM_HashConsing)->Arg(0)->Arg(1)->ArgName("hashcons")->Unit(benchmark::kMillisecond);
+
+// calls cycling through a library of defs, without a quota and with one that holds a few of them
+static void BM_MemoryQuota(benchmark::State &state) {
+    SetMemoryQuota(state.range(0));
+    InitJIT();
+    ProgramGen gen;
+    std::string lib;
+    for (int i = 0; i < 64; i++) lib += gen.FunctionDef("lib" + std::to_string(i), 2, 16) + " ";
+    Scanner defs(lib);
+    RunScript(defs);
+    int64_t next = 0;
+    for (auto _ : state) {
+        Scanner call(gen.FunctionCall("lib" + std::to_string(next++ % 64), 2));
+        RunScript(call);
+    }
+    MemoryUsage usage = GetMemoryUsage();
+    state.counters["code_kb"] = (usage.codeBytes + usage.dataBytes) / 1024.0;
+    state.counters["recompiles"] = usage.recompiles;
+    SetMemoryQuota(0);
+}
+BENCHMARK(BM_MemoryQuota)->Arg(0)->Arg(16 << 10)->ArgName("quota")->Unit(benchmark::kMicrosecond);
+
+// everything but BM_QuietDefine's verbose arm runs in quiet mode
+static bool QuietByDefault() { return !std::getenv("BERNARD_BENCH_VERBOSE"); }
+
+// defining a def with its IR going to stderr, and in quiet mode
+static void BM_QuietDefine(benchmark::State &state) {
+    InitJIT();
+    SetQuiet(state.range(0));
+    ProgramGen gen;
+    int64_t id = 0;
+    for (auto _ : state) {
+        Scanner scanner(gen.FunctionDef("quiet" + std::to_string(id++), 2, 32));
+        RunScript(scanner);
+    }
+    SetQuiet(QuietByDefault());
+}
+BENCHMARK(BM_QuietDefine)->Arg(0)->Arg(1)->ArgName("quiet")->Unit(benchmark::kMicrosecond);
+
+static double HostScale(double x) { return x * 1.5; }
+
+// bitcode defining double hostscale(double x) { return x * 1.5; }
+static std::string ScaleBitcode() {
+    llvm::LLVMContext context;
+    llvm::Module module("helper", context);
+    llvm::IRBuilder<> builder(context);
+    auto *type = llvm::FunctionType::get(builder.getDoubleTy(), {builder.getDoubleTy()}, false);
+    auto *func = llvm::Function::Create(type, llvm::Function::ExternalLinkage, "hostscale", module);
+    builder.SetInsertPoint(llvm::BasicBlock::Create(context, "entry", func));
+    builder.CreateRet(builder.CreateFMul(func->getArg(0), llvm::ConstantFP::get(builder.getDoubleTy(), 1.5)));
+    std::string bitcode;
+    llvm::raw_string_ostream os(bitcode);
+    llvm::WriteBitcodeToFile(module, os);
+    os.flush();
+    return bitcode;
+}
+
+// a loop calling a small host helper, across the boundary or inlined from its bitcode
+static void BM_HostHelper(benchmark::State &state) {
+    InitJIT();
+    RegisterHostFunction("hostscale", reinterpret_cast<void *>(&HostScale), {false},
+                         state.range(0) ? ScaleBitcode() : "");
+    Scanner defs("extern hostscale(x); def scaled(n) var s = 0 in (for i = 0, i < n in s = s + hostscale(i)) + s;");
+    RunScript(defs);
+    auto scaled = reinterpret_cast<double (*)(double)>(FunctionAddress("scaled"));
+    for (auto _ : state) benchmark::DoNotOptimize(scaled(state.range(1)));
+    state.SetItemsProcessed(state.iterations() * state.range(1));
+}
+BENCHMARK(BM_HostHelper)->ArgsProduct({{0, 1}, {1 << 12}})->ArgNames({"inline", "n"})->Unit(benchmark::kMicrosecond);
+
+int main(int argc, char **argv) {
+    // the engine dumps IR to stderr on every definition unless it is quiet
+    SetQuiet(QuietByDefault());
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
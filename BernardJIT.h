@@ -1,23 +1,258 @@
 #pragma once
 
 #include "llvm/ADT/StringRef.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/EPCDynamicLibrarySearchGenerator.h"
+#include "llvm/ExecutionEngine/Orc/EPCGenericRTDyldMemoryManager.h"
+#include "llvm/ExecutionEngine/Orc/EPCIndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/Orc/Shared/ExecutorSymbolDef.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/raw_ostream.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 namespace llvm {
 namespace orc {
 
+/// Runtime switches for the JIT, all off by default.
+struct BernardJITOptions {
+  /// perf jitdump records through LLVM's perf listener (needs LLVM_USE_PERF).
+  bool PerfJITEvents = false;
+  /// Register objects with GDB's JIT interface.
+  bool GDBRegistration = false;
+  /// Append "addr size name" lines to /tmp/perf-<pid>.map.
+  bool PerfMap = false;
+  /// Let the backend fuse multiply-add across statements (FPOpFusion::Fast).
+  /// Functions compiled in fast-math mode carry the contract flag and fuse
+  /// either way.
+  bool FastFPContraction = false;
+  /// Compile a define()d symbol on its first call instead of in define().
+  /// In process only.
+  bool LazyCompile = false;
+  /// With LazyCompile, threads that compile the callees of code that was
+  /// just compiled or started running, ahead of their first call.
+  unsigned SpeculationThreads = 0;
+  /// Bytes of machine code and data the define()d symbols may take, 0 for no
+  /// limit. Past it the symbols used longest ago lose their code and are
+  /// compiled again from bitcode on their next call. In process only.
+  uint64_t MemoryQuota = 0;
+
+  /// Reads BERNARD_PERF_JITDUMP, BERNARD_GDB_JIT, BERNARD_PERF_MAP,
+  /// BERNARD_FP_CONTRACT_FAST, BERNARD_LAZY, BERNARD_SPECULATE (thread
+  /// count) and BERNARD_MEMORY_QUOTA (bytes).
+  static BernardJITOptions fromEnvironment() {
+    auto IsSet = [](const char *Name) {
+      const char *Val = std::getenv(Name);
+      return Val && *Val && std::string(Val) != "0";
+    };
+    BernardJITOptions Opts;
+    Opts.PerfJITEvents = IsSet("BERNARD_PERF_JITDUMP");
+    Opts.GDBRegistration = IsSet("BERNARD_GDB_JIT");
+    Opts.PerfMap = IsSet("BERNARD_PERF_MAP");
+    Opts.FastFPContraction = IsSet("BERNARD_FP_CONTRACT_FAST");
+    Opts.LazyCompile = IsSet("BERNARD_LAZY");
+    if (IsSet("BERNARD_SPECULATE"))
+      Opts.SpeculationThreads = std::atoi(std::getenv("BERNARD_SPECULATE"));
+    if (IsSet("BERNARD_MEMORY_QUOTA"))
+      Opts.MemoryQuota = std::strtoull(std::getenv("BERNARD_MEMORY_QUOTA"),
+                                       nullptr, 10);
+    return Opts;
+  }
+};
+
+/// Lazy compilation counters, see BernardJIT::getSpeculationStats.
+struct SpeculationStats {
+  /// First calls of lazily compiled definitions.
+  uint64_t FirstCalls = 0;
+  /// First calls that found their code already compiled by speculation.
+  uint64_t Hits = 0;
+  /// Definitions the speculation threads compiled.
+  uint64_t SpeculativeCompiles = 0;
+
+  double hitRate() const { return FirstCalls ? double(Hits) / FirstCalls : 0; }
+};
+
+/// Memory held by a JIT, see BernardJIT::getMemoryUsage. The byte counts
+/// cover objects loaded in process.
+struct JITMemoryUsage {
+  /// Sections of the objects loaded now, and the object files themselves.
+  uint64_t CodeBytes = 0;
+  uint64_t DataBytes = 0;
+  uint64_t ObjectBytes = 0;
+  /// Bitcode kept to compile evicted definitions again.
+  uint64_t BitcodeBytes = 0;
+  /// Definitions whose IR waits for a first call in lazy mode, and the ones
+  /// evicted since their last call.
+  size_t PendingDefinitions = 0;
+  size_t EvictedDefinitions = 0;
+  uint64_t Evictions = 0;
+  uint64_t Recompiles = 0;
+};
+
+/// Section and object bytes of the objects loaded in process, shared by the
+/// memory managers of a JIT.
+struct LoadedBytes {
+  std::atomic<uint64_t> Code{0};
+  std::atomic<uint64_t> Data{0};
+  std::atomic<uint64_t> Object{0};
+};
+
+/// SectionMemoryManager that adds what it allocates to LoadedBytes and takes
+/// it off again once its object is removed.
+class CountingMemoryManager : public SectionMemoryManager {
+public:
+  explicit CountingMemoryManager(std::shared_ptr<LoadedBytes> Loaded)
+      : Loaded(std::move(Loaded)) {}
+
+  ~CountingMemoryManager() override {
+    Loaded->Code -= Code;
+    Loaded->Data -= Data;
+    Loaded->Object -= Object;
+  }
+
+  uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID,
+                               StringRef SectionName) override {
+    Code += Size;
+    Loaded->Code += Size;
+    return SectionMemoryManager::allocateCodeSection(Size, Alignment,
+                                                     SectionID, SectionName);
+  }
+
+  uint8_t *allocateDataSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID, StringRef SectionName,
+                               bool IsReadOnly) override {
+    Data += Size;
+    Loaded->Data += Size;
+    return SectionMemoryManager::allocateDataSection(
+        Size, Alignment, SectionID, SectionName, IsReadOnly);
+  }
+
+  using SectionMemoryManager::notifyObjectLoaded;
+  void notifyObjectLoaded(RuntimeDyld &, const object::ObjectFile &Obj) override {
+    Object += Obj.getData().size();
+    Loaded->Object += Obj.getData().size();
+  }
+
+private:
+  std::shared_ptr<LoadedBytes> Loaded;
+  uint64_t Code = 0;
+  uint64_t Data = 0;
+  uint64_t Object = 0;
+};
+
+/// Defines the symbols of a module kept as bitcode, and parses and compiles
+/// it through \p Layer once one of them is looked up.
+class BitcodeMaterializationUnit : public MaterializationUnit {
+public:
+  BitcodeMaterializationUnit(IRLayer &Layer, SymbolFlagsMap Flags,
+                             std::shared_ptr<SmallVector<char, 0>> Bitcode)
+      : MaterializationUnit(Interface(std::move(Flags), nullptr)),
+        Layer(Layer), Bitcode(std::move(Bitcode)) {}
+
+  StringRef getName() const override { return "BitcodeMaterializationUnit"; }
+
+  void materialize(std::unique_ptr<MaterializationResponsibility> R) override {
+    auto Ctx = std::make_unique<LLVMContext>();
+    auto M = parseBitcodeFile(
+        MemoryBufferRef(StringRef(Bitcode->data(), Bitcode->size()),
+                        "evicted"),
+        *Ctx);
+    if (!M) {
+      R->getExecutionSession().reportError(M.takeError());
+      R->failMaterialization();
+      return;
+    }
+    Layer.emit(std::move(R), ThreadSafeModule(std::move(*M), std::move(Ctx)));
+  }
+
+private:
+  void discard(const JITDylib &, const SymbolStringPtr &) override {}
+
+  IRLayer &Layer;
+  std::shared_ptr<SmallVector<char, 0>> Bitcode;
+};
+
+/// Writes the perf map format understood by perf report / perf annotate.
+class PerfMapListener : public JITEventListener {
+public:
+  PerfMapListener()
+      : Path("/tmp/perf-" + std::to_string(sys::Process::getProcessId()) +
+             ".map") {}
+
+  Error open() {
+    std::error_code EC;
+    Out = std::make_unique<raw_fd_ostream>(Path, EC, sys::fs::OF_Append);
+    if (EC)
+      return createFileError(Path, EC);
+    return Error::success();
+  }
+
+  void notifyObjectLoaded(ObjectKey, const object::ObjectFile &Obj,
+                          const RuntimeDyld::LoadedObjectInfo &L) override {
+    object::OwningBinary<object::ObjectFile> DebugObjOwner =
+        L.getObjectForDebug(Obj);
+    if (!DebugObjOwner.getBinary())
+      return;
+    const object::ObjectFile &DebugObj = *DebugObjOwner.getBinary();
+
+    std::lock_guard<std::mutex> Lock(Mutex);
+    for (const auto &P : object::computeSymbolSizes(DebugObj)) {
+      object::SymbolRef Sym = P.first;
+      Expected<object::SymbolRef::Type> Type = Sym.getType();
+      if (!Type) {
+        consumeError(Type.takeError());
+        continue;
+      }
+      if (*Type != object::SymbolRef::ST_Function)
+        continue;
+      Expected<StringRef> Name = Sym.getName();
+      if (!Name) {
+        consumeError(Name.takeError());
+        continue;
+      }
+      Expected<uint64_t> Addr = Sym.getAddress();
+      if (!Addr) {
+        consumeError(Addr.takeError());
+        continue;
+      }
+      *Out << format_hex_no_prefix(*Addr, 1) << " "
+           << format_hex_no_prefix(P.second, 1) << " " << *Name << "\n";
+    }
+    Out->flush();
+  }
+
+private:
+  std::string Path;
+  std::unique_ptr<raw_fd_ostream> Out;
+  std::mutex Mutex;
+};
+
 class BernardJIT {
 private:
   std::unique_ptr<ExecutionSession> ES;
@@ -25,50 +260,140 @@ private:
   DataLayout DL;
   MangleAndInterner Mangle;
 
+  // declared before ObjectLayer so it outlives the layer's reference to it
+  std::unique_ptr<PerfMapListener> PerfMap;
+
+  bool InProcess;
+  // define() compiles on first call, LCTM also exists for eviction alone
+  bool Lazy;
+  uint64_t MemoryQuota;
+  std::shared_ptr<LoadedBytes> Loaded = std::make_shared<LoadedBytes>();
+  // only set for an out of process executor, Stubs are allocated through it
+  std::unique_ptr<EPCIndirectionUtils> EPCIU;
+  std::unique_ptr<IndirectStubsManager> Stubs;
+  // lazy mode or a memory quota, owns the trampolines new and evicted stubs
+  // point at until their next call
+  std::unique_ptr<LazyCallThroughManager> LCTM;
+
   RTDyldObjectLinkingLayer ObjectLayer;
   IRCompileLayer CompileLayer;
 
   JITDylib &MainJD;
 
+  // Code of the live version of every define()d symbol, and replaced
+  // versions waiting for the calls in flight to drain.
+  std::mutex DefsMutex;
+  StringMap<ResourceTrackerSP> Defs;
+  std::vector<ResourceTrackerSP> Retired;
+  std::atomic<unsigned> ActiveCalls{0};
+  // Held shared by every call in flight. Code is only freed while it is held
+  // exclusively, taken with try_lock under DefsMutex so that nothing waits
+  // for the calls to drain: the last one to leave frees what is left.
+  std::shared_mutex CallsMutex;
+
+  // Guarded by DefsMutex too. Impl of the live version behind every stub,
+  // call sites per caller and callee as recorded by the front end, and the
+  // impls compiled so far in lazy mode, mapped to whether they were called.
+  StringMap<std::string> ImplOf;
+  StringMap<StringMap<unsigned>> CallGraph;
+  StringMap<bool> Compiled;
+  SpeculationStats SpecStats;
+
+  // Guarded by DefsMutex too. With a memory quota, the bitcode and symbols of
+  // every define()d module by stub, the use clock stamp of every stub, and
+  // the stubs that were evicted and not called since.
+  struct Recompilable {
+    std::shared_ptr<SmallVector<char, 0>> Bitcode;
+    SymbolFlagsMap Flags;
+  };
+  StringMap<Recompilable> Kept;
+  StringMap<uint64_t> LastUse;
+  StringMap<bool> Evicted;
+  uint64_t UseClock = 0;
+  uint64_t BitcodeBytes = 0;
+  uint64_t Evictions = 0;
+  uint64_t Recompiles = 0;
+
+  // stubs whose live impl the speculation threads should compile
+  std::deque<std::string> SpecQueue;
+  StringMap<bool> SpecQueued;
+  unsigned SpecBusy = 0;
+  bool SpecStop = false;
+  std::condition_variable SpecReady;
+  std::condition_variable SpecIdle;
+  std::vector<std::thread> SpecThreads;
+
 public:
   BernardJIT(std::unique_ptr<ExecutionSession> ES,
-                  JITTargetMachineBuilder JTMB, DataLayout DL)
+                  JITTargetMachineBuilder JTMB, DataLayout DL,
+                  const BernardJITOptions &Opts = BernardJITOptions(),
+                  bool InProcess = true)
       : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
-        ObjectLayer(*this->ES,
-                    []() { return std::make_unique<SectionMemoryManager>(); }),
+        InProcess(InProcess), Lazy(InProcess && Opts.LazyCompile),
+        MemoryQuota(InProcess ? Opts.MemoryQuota : 0),
+        ObjectLayer(*this->ES, makeMemoryManagerFactory()),
         CompileLayer(*this->ES, ObjectLayer,
                      std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
         MainJD(this->ES->createBareJITDylib("<main>")) {
-    MainJD.addGenerator(
-        cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
-            DL.getGlobalPrefix())));
-    if (JTMB.getTargetTriple().isOSBinFormatCOFF()) {
+    ExecutorProcessControl &EPC = this->ES->getExecutorProcessControl();
+    if (InProcess) {
+      Stubs = createLocalIndirectStubsManagerBuilder(EPC.getTargetTriple())();
+      MainJD.addGenerator(
+          cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
+              this->DL.getGlobalPrefix())));
+      if (Lazy || MemoryQuota)
+        LCTM = cantFail(createLocalLazyCallThroughManager(
+            EPC.getTargetTriple(), *this->ES,
+            ExecutorAddr::fromPtr(&lazyCompileFailed)));
+      if (Lazy)
+        for (unsigned I = 0; I < Opts.SpeculationThreads; ++I)
+          SpecThreads.emplace_back([this] { speculate(); });
+    } else {
+      // stubs and their pointers live in the executor's memory
+      EPCIU = cantFail(EPCIndirectionUtils::Create(EPC));
+      Stubs = EPCIU->createIndirectStubsManager();
+      MainJD.addGenerator(cantFail(
+          EPCDynamicLibrarySearchGenerator::GetForTargetProcess(*this->ES)));
+    }
+    if (EPC.getTargetTriple().isOSBinFormatCOFF()) {
       ObjectLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
       ObjectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
     }
+    // the listeners read object addresses as host addresses
+    if (InProcess)
+      registerListeners(Opts);
   }
 
   ~BernardJIT() {
+    {
+      std::lock_guard<std::mutex> Lock(DefsMutex);
+      SpecStop = true;
+    }
+    SpecReady.notify_all();
+    for (auto &T : SpecThreads)
+      T.join();
+    Stubs.reset();
+    if (EPCIU)
+      if (auto Err = EPCIU->cleanup())
+        ES->reportError(std::move(Err));
     if (auto Err = ES->endSession())
       ES->reportError(std::move(Err));
   }
 
-  static Expected<std::unique_ptr<BernardJIT>> Create() {
+  static Expected<std::unique_ptr<BernardJIT>>
+  Create(const BernardJITOptions &Opts = BernardJITOptions()) {
     auto EPC = SelfExecutorProcessControl::Create();
     if (!EPC)
       return EPC.takeError();
+    return Create(std::move(*EPC), Opts, true);
+  }
 
-    auto ES = std::make_unique<ExecutionSession>(std::move(*EPC));
-
-    JITTargetMachineBuilder JTMB(
-        ES->getExecutorProcessControl().getTargetTriple());
-
-    auto DL = JTMB.getDefaultDataLayoutForTarget();
-    if (!DL)
-      return DL.takeError();
-
-    return std::make_unique<BernardJIT>(std::move(ES), std::move(JTMB),
-                                             std::move(*DL));
+  /// JIT whose code is loaded into and run by the process behind \p EPC,
+  /// typically a bernard_executor child reached through SimpleRemoteEPC.
+  static Expected<std::unique_ptr<BernardJIT>>
+  CreateRemote(std::unique_ptr<ExecutorProcessControl> EPC,
+               const BernardJITOptions &Opts = BernardJITOptions()) {
+    return Create(std::move(EPC), Opts, false);
   }
 
   const DataLayout &getDataLayout() const { return DL; }
@@ -84,6 +409,416 @@ public:
   Expected<ExecutorSymbolDef> lookup(StringRef Name) {
     return ES->lookup({&MainJD}, Mangle(Name.str()));
   }
+
+  bool isInProcess() const { return InProcess; }
+
+  /// Runs int32_t Fn(int32_t) at \p Addr in the executor.
+  Expected<int32_t> runAsIntFunction(ExecutorAddr Addr, int Arg) {
+    return ES->getExecutorProcessControl().runAsIntFunction(Addr, Arg);
+  }
+
+  /// Makes the host function at \p Addr callable from JIT code as \p Name.
+  Error defineHostSymbol(StringRef Name, void *Addr) {
+    return defineHostSymbols({{Name.str(), Addr}});
+  }
+
+  /// Defines every host function in \p Symbols, name and address, as an
+  /// absolute symbol of the main JITDylib. Lookups find them without going
+  /// through the process symbol search, so they need not be exported.
+  Error defineHostSymbols(ArrayRef<std::pair<std::string, void *>> Symbols) {
+    SymbolMap Map;
+    for (auto &Sym : Symbols)
+      Map[Mangle(Sym.first)] = ExecutorSymbolDef(
+          ExecutorAddr::fromPtr(Sym.second),
+          JITSymbolFlags::Exported | JITSymbolFlags::Callable);
+    return MainJD.define(absoluteSymbols(std::move(Map)));
+  }
+
+  /// Compiles TSM under a tracker of its own and points the indirect stub
+  /// \p Name at \p ImplName from it, creating the stub on first use. Code
+  /// calling Name always goes through the stub, so the previous definition
+  /// becomes unreachable here and is freed once no call is in flight.
+  ///
+  /// In lazy mode the stub first points at a trampoline: the first call
+  /// compiles ImplName, unless speculation already did, and repoints the
+  /// stub at it.
+  ///
+  /// With a memory quota the module is also kept as bitcode, and once the
+  /// code of the define()d symbols exceeds the quota the ones used longest
+  /// ago are evicted: their code is freed and their stub points at a
+  /// trampoline again, which compiles them from the bitcode.
+  Error define(StringRef Name, ThreadSafeModule TSM, StringRef ImplName) {
+    Recompilable Keep;
+    if (MemoryQuota)
+      Keep = keep(TSM);
+    auto RT = MainJD.createResourceTracker();
+    if (auto Err = addModule(std::move(TSM), RT))
+      return Err;
+    ExecutorAddr Target;
+    if (Lazy) {
+      auto Trampoline = callThrough(Name, ImplName);
+      if (!Trampoline)
+        return joinErrors(Trampoline.takeError(), RT->remove());
+      Target = *Trampoline;
+    } else {
+      auto Impl = lookup(ImplName);
+      if (!Impl)
+        return joinErrors(Impl.takeError(), RT->remove());
+      Target = Impl->getAddress();
+    }
+
+    std::lock_guard<std::mutex> Lock(DefsMutex);
+    ResourceTrackerSP &Current = Defs[Name];
+    if (Current) {
+      // a single pointer-sized store, callers see either version whole
+      if (auto Err = Stubs->updatePointer(Name, Target))
+        return joinErrors(std::move(Err), RT->remove());
+      Retired.push_back(std::move(Current));
+      Compiled.erase(ImplOf[Name]);
+    } else {
+      if (auto Err = Stubs->createStub(Name, Target,
+                                       JITSymbolFlags::Exported |
+                                           JITSymbolFlags::Callable))
+        return joinErrors(std::move(Err), RT->remove());
+      if (auto Err = MainJD.define(absoluteSymbols(
+              {{Mangle(Name.str()), Stubs->findStub(Name, true)}})))
+        return joinErrors(std::move(Err), RT->remove());
+    }
+    Current = std::move(RT);
+    ImplOf[Name] = ImplName.str();
+    Evicted.erase(Name);
+    LastUse[Name] = ++UseClock;
+    if (MemoryQuota) {
+      auto &Old = Kept[Name];
+      BitcodeBytes += Keep.Bitcode->size();
+      if (Old.Bitcode)
+        BitcodeBytes -= Old.Bitcode->size();
+      Old = std::move(Keep);
+    }
+    if (auto Err = reclaimRetired())
+      return Err;
+    return enforceQuota();
+  }
+
+  /// Call graph as the front end generates calls, \p Caller and \p Callee
+  /// are stub names. Speculation follows the most frequent edges first.
+  void recordCall(StringRef Caller, StringRef Callee) {
+    std::lock_guard<std::mutex> Lock(DefsMutex);
+    ++CallGraph[Caller][Callee];
+  }
+
+  /// Forgets the calls of \p Caller, before it is generated again.
+  void resetCalls(StringRef Caller) {
+    std::lock_guard<std::mutex> Lock(DefsMutex);
+    CallGraph.erase(Caller);
+  }
+
+  /// Hands the callees of \p Caller that are not compiled yet to the
+  /// speculation threads. The JIT does this itself whenever a definition is
+  /// compiled, the front end for code it is about to run.
+  void speculateCallees(StringRef Caller) {
+    std::lock_guard<std::mutex> Lock(DefsMutex);
+    queueCallees(Caller);
+  }
+
+  /// Marks \p Caller and everything it calls, directly or not, as used now.
+  /// Eviction drops the code used longest ago first, the front end calls
+  /// this for code it is about to run.
+  void noteUse(StringRef Caller) {
+    std::lock_guard<std::mutex> Lock(DefsMutex);
+    ++UseClock;
+    std::vector<StringRef> Work = {Caller};
+    while (!Work.empty()) {
+      StringRef Name = Work.back();
+      Work.pop_back();
+      uint64_t &Stamp = LastUse[Name];
+      if (Stamp == UseClock)
+        continue;
+      Stamp = UseClock;
+      auto Edges = CallGraph.find(Name);
+      if (Edges != CallGraph.end())
+        for (auto &Edge : Edges->second)
+          Work.push_back(Edge.first());
+    }
+  }
+
+  JITMemoryUsage getMemoryUsage() {
+    std::lock_guard<std::mutex> Lock(DefsMutex);
+    JITMemoryUsage Usage;
+    Usage.CodeBytes = Loaded->Code;
+    Usage.DataBytes = Loaded->Data;
+    Usage.ObjectBytes = Loaded->Object;
+    Usage.BitcodeBytes = BitcodeBytes;
+    Usage.EvictedDefinitions = Evicted.size();
+    if (Lazy)
+      for (auto &Def : ImplOf)
+        if (!Compiled.count(Def.second) && !Evicted.count(Def.first()))
+          ++Usage.PendingDefinitions;
+    Usage.Evictions = Evictions;
+    Usage.Recompiles = Recompiles;
+    return Usage;
+  }
+
+  /// Blocks until the speculation threads have nothing left to do.
+  void waitForSpeculation() {
+    std::unique_lock<std::mutex> Lock(DefsMutex);
+    SpecIdle.wait(Lock, [&] { return SpecQueue.empty() && SpecBusy == 0; });
+  }
+
+  SpeculationStats getSpeculationStats() {
+    std::lock_guard<std::mutex> Lock(DefsMutex);
+    return SpecStats;
+  }
+
+  /// Brackets a call into JIT code. Replaced and evicted definitions are
+  /// only freed while no call is in flight.
+  void enterCall() {
+    CallsMutex.lock_shared();
+    ++ActiveCalls;
+  }
+  Error exitCall() {
+    unsigned Left = --ActiveCalls;
+    CallsMutex.unlock_shared();
+    if (Left != 0)
+      return Error::success();
+    std::lock_guard<std::mutex> Lock(DefsMutex);
+    if (auto Err = reclaimRetired())
+      return Err;
+    return enforceQuota();
+  }
+
+  size_t getDefinitionCount() {
+    std::lock_guard<std::mutex> Lock(DefsMutex);
+    return Defs.size();
+  }
+  size_t getRetiredCount() {
+    std::lock_guard<std::mutex> Lock(DefsMutex);
+    return Retired.size();
+  }
+
+private:
+  // jumped to by a trampoline whose target failed to compile, the session
+  // has reported the error by then
+  static void lazyCompileFailed() {
+    errs() << "BernardJIT: lazy compilation failed\n";
+    abort();
+  }
+
+  Error notifyFirstCall(StringRef Name, StringRef Impl, ExecutorAddr Addr) {
+    std::lock_guard<std::mutex> Lock(DefsMutex);
+    if (Evicted.erase(Name))
+      ++Recompiles;
+    else
+      ++SpecStats.FirstCalls;
+    // calls into a replaced version leave the successor's stub alone
+    auto Live = ImplOf.find(Name);
+    if (Live == ImplOf.end() || Live->second != Impl)
+      return Error::success();
+    LastUse[Name] = ++UseClock;
+    auto Known = Compiled.try_emplace(Impl, true);
+    if (!Known.second) {
+      if (!Known.first->second)
+        ++SpecStats.Hits;
+      Known.first->second = true;
+    }
+    if (auto Err = Stubs->updatePointer(Name, Addr))
+      return Err;
+    queueCallees(Name);
+    return Error::success();
+  }
+
+  // stub target that compiles Impl on the next call and repoints Name at it
+  Expected<ExecutorAddr> callThrough(StringRef Name, StringRef Impl) {
+    return LCTM->getCallThroughTrampoline(
+        MainJD, Mangle(Impl.str()),
+        [this, Name = Name.str(), Impl = Impl.str()](ExecutorAddr Addr) {
+          return notifyFirstCall(Name, Impl, Addr);
+        });
+  }
+
+  // bitcode of the module and the symbols it defines, before it is compiled
+  Recompilable keep(ThreadSafeModule &TSM) {
+    Recompilable Keep;
+    Keep.Bitcode = std::make_shared<SmallVector<char, 0>>();
+    TSM.withModuleDo([&](Module &M) {
+      raw_svector_ostream OS(*Keep.Bitcode);
+      WriteBitcodeToFile(M, OS);
+      for (auto &GV : M.global_values())
+        if (!GV.isDeclaration() && !GV.hasLocalLinkage())
+          Keep.Flags[Mangle(GV.getName())] = JITSymbolFlags::fromGlobalValue(GV);
+    });
+    return Keep;
+  }
+
+  // DefsMutex held. Evicts the compiled definitions used longest ago until
+  // their code fits the quota, while no call is in flight.
+  Error enforceQuota() {
+    if (!MemoryQuota)
+      return Error::success();
+    std::unique_lock<std::shared_mutex> NoCalls(CallsMutex, std::try_to_lock);
+    if (!NoCalls.owns_lock())
+      return Error::success();
+    std::vector<std::pair<uint64_t, StringRef>> Candidates;
+    for (auto &Def : Defs) {
+      StringRef Name = Def.first();
+      if (!Evicted.count(Name) && (!Lazy || Compiled.count(ImplOf[Name])))
+        Candidates.push_back({LastUse[Name], Name});
+    }
+    llvm::sort(Candidates);
+    for (auto &Candidate : Candidates) {
+      if (Loaded->Code + Loaded->Data <= MemoryQuota)
+        break;
+      if (auto Err = evict(Candidate.second))
+        return Err;
+    }
+    return Error::success();
+  }
+
+  // DefsMutex and CallsMutex held. The stub leaves the code before it is
+  // freed, the trampoline only resolves Impl on its first call.
+  Error evict(StringRef Name) {
+    std::string Impl = ImplOf[Name];
+    const Recompilable &Keep = Kept[Name];
+    auto Trampoline = callThrough(Name, Impl);
+    if (!Trampoline)
+      return Trampoline.takeError();
+    if (auto Err = Stubs->updatePointer(Name, *Trampoline))
+      return Err;
+    ResourceTrackerSP &Current = Defs[Name];
+    if (auto Err = Current->remove())
+      return Err;
+    Current = MainJD.createResourceTracker();
+    if (auto Err = MainJD.define(std::make_unique<BitcodeMaterializationUnit>(
+                                     CompileLayer, Keep.Flags, Keep.Bitcode),
+                                 Current))
+      return Err;
+    Compiled.erase(Impl);
+    Evicted[Name] = true;
+    ++Evictions;
+    return Error::success();
+  }
+
+  // DefsMutex held
+  void queueCallees(StringRef Caller) {
+    auto Edges = CallGraph.find(Caller);
+    if (SpecThreads.empty() || Edges == CallGraph.end())
+      return;
+    std::vector<std::pair<unsigned, StringRef>> Callees;
+    for (auto &Edge : Edges->second)
+      Callees.push_back({Edge.second, Edge.first()});
+    llvm::stable_sort(Callees, [](const auto &A, const auto &B) {
+      return A.first > B.first;
+    });
+    for (auto &Callee : Callees) {
+      auto Impl = ImplOf.find(Callee.second);
+      if (Impl == ImplOf.end() || Compiled.count(Impl->second) ||
+          !SpecQueued.try_emplace(Callee.second, true).second)
+        continue;
+      SpecQueue.push_back(Callee.second.str());
+    }
+    SpecReady.notify_all();
+  }
+
+  void speculate() {
+    std::unique_lock<std::mutex> Lock(DefsMutex);
+    while (true) {
+      if (SpecQueue.empty() && SpecBusy == 0)
+        SpecIdle.notify_all();
+      SpecReady.wait(Lock, [&] { return SpecStop || !SpecQueue.empty(); });
+      if (SpecStop)
+        return;
+      std::string Name = std::move(SpecQueue.front());
+      SpecQueue.pop_front();
+      SpecQueued.erase(Name);
+      auto Live = ImplOf.find(Name);
+      if (Live == ImplOf.end() || Compiled.count(Live->second))
+        continue;
+      std::string Impl = Live->second;
+
+      ++SpecBusy;
+      Lock.unlock();
+      auto Sym = lookup(Impl);
+      Lock.lock();
+      --SpecBusy;
+      if (!Sym) {
+        // replaced and freed while it compiled
+        consumeError(Sym.takeError());
+        continue;
+      }
+      Live = ImplOf.find(Name);
+      if (Live != ImplOf.end() && Live->second == Impl &&
+          Compiled.try_emplace(Impl, false).second) {
+        ++SpecStats.SpeculativeCompiles;
+        queueCallees(Name);
+      }
+    }
+  }
+
+  static Expected<std::unique_ptr<BernardJIT>>
+  Create(std::unique_ptr<ExecutorProcessControl> EPC,
+         const BernardJITOptions &Opts, bool InProcess) {
+    auto ES = std::make_unique<ExecutionSession>(std::move(EPC));
+
+    JITTargetMachineBuilder JTMB(
+        ES->getExecutorProcessControl().getTargetTriple());
+    if (Opts.FastFPContraction)
+      JTMB.getOptions().AllowFPOpFusion = FPOpFusion::Fast;
+
+    auto DL = JTMB.getDefaultDataLayoutForTarget();
+    if (!DL)
+      return DL.takeError();
+
+    return std::make_unique<BernardJIT>(std::move(ES), std::move(JTMB),
+                                        std::move(*DL), Opts, InProcess);
+  }
+
+  RTDyldObjectLinkingLayer::GetMemoryManagerFunction
+  makeMemoryManagerFactory() {
+    if (InProcess)
+      return [Loaded = Loaded]() {
+        return std::make_unique<CountingMemoryManager>(Loaded);
+      };
+    // only reads the bootstrap symbols the executor sent at connection time
+    return [&EPC = ES->getExecutorProcessControl()]()
+               -> std::unique_ptr<RuntimeDyld::MemoryManager> {
+      return cantFail(
+          EPCGenericRTDyldMemoryManager::CreateWithDefaultBootstrapSymbols(
+              EPC));
+    };
+  }
+
+  // DefsMutex held
+  Error reclaimRetired() {
+    std::unique_lock<std::shared_mutex> NoCalls(CallsMutex, std::try_to_lock);
+    if (!NoCalls.owns_lock())
+      return Error::success();
+    Error Err = Error::success();
+    for (auto &RT : Retired)
+      Err = joinErrors(std::move(Err), RT->remove());
+    Retired.clear();
+    return Err;
+  }
+
+  void registerListeners(const BernardJITOptions &Opts) {
+    if (Opts.PerfJITEvents) {
+      if (JITEventListener *L = JITEventListener::createPerfJITEventListener())
+        ObjectLayer.registerJITEventListener(*L);
+      else
+        errs() << "perf jitdump support is not built into this LLVM\n";
+    }
+    if (Opts.GDBRegistration)
+      ObjectLayer.registerJITEventListener(
+          *JITEventListener::createGDBRegistrationListener());
+    if (Opts.PerfMap) {
+      auto L = std::make_unique<PerfMapListener>();
+      if (auto Err = L->open()) {
+        ES->reportError(std::move(Err));
+        return;
+      }
+      PerfMap = std::move(L);
+      ObjectLayer.registerJITEventListener(*PerfMap);
+    }
+  }
 };
 
 } // end namespace orc
@@ -0,0 +1,52 @@
+#include <Capture.h>
+
+void CaptureRing::Configure(const std::string &filter, size_t capacity) {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_patterns.clear();
+    size_t start = 0;
+    while (start <= filter.size()) {
+        size_t end = filter.find(',', start);
+        if (end == std::string::npos) end = filter.size();
+        std::string pattern = filter.substr(start, end - start);
+        while (!pattern.empty() && pattern.front() == ' ') pattern.erase(0, 1);
+        while (!pattern.empty() && pattern.back() == ' ') pattern.pop_back();
+        if (!pattern.empty()) m_patterns.push_back(pattern);
+        start = end + 1;
+    }
+    m_capacity = capacity;
+    while (m_functions.size() > m_capacity) m_functions.pop_front();
+}
+
+bool CaptureRing::Matches(const std::string &name) const {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (!m_capacity) return false;
+    for (auto &pattern : m_patterns) {
+        if (pattern.back() == '*') {
+            if (name.compare(0, pattern.size() - 1, pattern, 0, pattern.size() - 1) == 0) return true;
+        } else if (name == pattern) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void CaptureRing::Add(CapturedFunction function) {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (!m_capacity) return;
+    function.sequence = m_sequence++;
+    if (m_functions.size() == m_capacity) m_functions.pop_front();
+    m_functions.push_back(std::move(function));
+}
+
+std::vector<CapturedFunction> CaptureRing::Find(const std::string &name) const {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    std::vector<CapturedFunction> found;
+    for (auto &function : m_functions)
+        if (name.empty() || function.name == name) found.push_back(function);
+    return found;
+}
+
+size_t CaptureRing::Size() const {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_functions.size();
+}
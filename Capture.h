@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct CapturedFunction {
+    std::string name;
+    // bitcode of a module defining only this function, before and after optimization
+    std::string bitcode;
+    std::string optimizedBitcode;
+    // order of capture, counting every function captured so far
+    uint64_t sequence = 0;
+};
+
+// The last compilations of the functions a filter selects, kept as bitcode so that nothing is
+// formatted until someone asks. The filter is a comma separated list of names, a name ending in *
+// matches every name starting with what comes before it. An empty filter or a capacity of 0 turns
+// capturing off.
+class CaptureRing {
+public:
+    void Configure(const std::string &filter, size_t capacity);
+
+    bool Matches(const std::string &name) const;
+
+    // drops the oldest capture once there are capacity of them
+    void Add(CapturedFunction function);
+
+    // captures of name, of every function when it is empty, oldest first
+    std::vector<CapturedFunction> Find(const std::string &name) const;
+
+    size_t Size() const;
+
+private:
+    mutable std::mutex m_mutex;
+    std::vector<std::string> m_patterns;
+    size_t m_capacity = 0;
+    uint64_t m_sequence = 0;
+    std::deque<CapturedFunction> m_functions;
+};
@@ -0,0 +1,48 @@
+#include <gtest/gtest.h>
+#include <Capture.h>
+
+CapturedFunction Captured(const std::string &name) {
+    CapturedFunction function;
+    function.name = name;
+    function.bitcode = name + " ir";
+    return function;
+}
+
+TEST(CaptureRing, filter) {
+    CaptureRing ring;
+    EXPECT_FALSE(ring.Matches("f"));
+    ring.Configure("f, kernel*", 8);
+    EXPECT_TRUE(ring.Matches("f"));
+    EXPECT_FALSE(ring.Matches("fg"));
+    EXPECT_TRUE(ring.Matches("kernel"));
+    EXPECT_TRUE(ring.Matches("kernel.chunk0"));
+    EXPECT_FALSE(ring.Matches("__anon_expr__"));
+    ring.Configure("*", 8);
+    EXPECT_TRUE(ring.Matches("__anon_expr__"));
+    ring.Configure("*", 0);
+    EXPECT_FALSE(ring.Matches("f"));
+}
+
+TEST(CaptureRing, keepsTheLast) {
+    CaptureRing ring;
+    ring.Configure("*", 3);
+    for (int i = 0; i < 5; i++) ring.Add(Captured(i % 2 ? "odd" : "even"));
+    EXPECT_EQ(ring.Size(), 3);
+    std::vector<CapturedFunction> all = ring.Find("");
+    ASSERT_EQ(all.size(), 3);
+    EXPECT_EQ(all[0].sequence, 2);
+    EXPECT_EQ(all[2].sequence, 4);
+    std::vector<CapturedFunction> odd = ring.Find("odd");
+    ASSERT_EQ(odd.size(), 1);
+    EXPECT_EQ(odd[0].bitcode, "odd ir");
+
+    // a smaller ring drops the oldest
+    ring.Configure("*", 1);
+    ASSERT_EQ(ring.Find("").size(), 1);
+    EXPECT_EQ(ring.Find("")[0].sequence, 4);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,68 @@
+#include <Parser.h>
+#include <Scanner.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+// bernardc: ahead-of-time driver, script in, object file or shared library (plus C header) out.
+//   bernardc [-shared] [-H header.h] [-e entry] -o out script
+// -shared links the object and the runtime library with the system C compiler driver (CC, default
+// cc). BERNARD_RUNTIME overrides where the runtime library is.
+
+static int Usage() {
+    fprintf(stderr, "usage: bernardc [-shared] [-H header.h] [-e entry] -o output script\n");
+    return 2;
+}
+
+int main(int argc, char **argv) {
+    std::string output, header, script, entry = "bernard_main";
+    bool shared = false;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-shared"))
+            shared = true;
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+            output = argv[++i];
+        else if (!strcmp(argv[i], "-H") && i + 1 < argc)
+            header = argv[++i];
+        else if (!strcmp(argv[i], "-e") && i + 1 < argc)
+            entry = argv[++i];
+        else if (argv[i][0] != '-' && script.empty())
+            script = argv[i];
+        else
+            return Usage();
+    }
+    if (output.empty() || script.empty()) return Usage();
+
+    std::ifstream in(script);
+    if (!in) {
+        fprintf(stderr, "bernardc: can't read %s\n", script.c_str());
+        return 1;
+    }
+    std::stringstream src;
+    src << in.rdbuf();
+
+    // the codegen dumps IR to stderr as it goes, that is noise for a compiler
+    if (!std::getenv("BERNARD_VERBOSE")) SetQuiet(true);
+
+    std::string object = shared ? output + ".o" : output;
+    Scanner scanner(src.str());
+    if (!CompileScript(scanner, object, header, entry)) return 1;
+    if (!shared) return 0;
+
+    const char *cc = std::getenv("CC");
+    const char *runtime = std::getenv("BERNARD_RUNTIME");
+    // putchard and parallel for live in the runtime, the library must not depend on the host for them
+    std::string link = std::string(cc ? cc : "cc") + " -shared -o '" + output + "' '" + object + "' '" +
+                       (runtime ? runtime : BERNARD_RUNTIME_LIB) + "' -lstdc++ -lpthread -lm";
+    int status = std::system(link.c_str());
+    std::remove(object.c_str());
+    if (status != 0) {
+        printf("link failed: %s\n", link.c_str());
+        return 1;
+    }
+    return 0;
+}
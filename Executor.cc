@@ -0,0 +1,36 @@
+#include <llvm/ExecutionEngine/Orc/Shared/SimpleRemoteEPCUtils.h>
+#include <llvm/ExecutionEngine/Orc/TargetProcess/SimpleExecutorMemoryManager.h>
+#include <llvm/ExecutionEngine/Orc/TargetProcess/SimpleRemoteEPCServer.h>
+#include <llvm/Support/DynamicLibrary.h>
+#include <llvm/Support/Error.h>
+
+#include <cstdio>
+#include <cstdlib>
+
+// bernard_executor: runs JIT'd code for an engine started with InitRemoteJIT. The engine compiles,
+// this process only allocates memory for the objects, resolves symbols in itself and calls
+// functions. It is spawned with the two pipe ends to talk over: bernard_executor <in-fd> <out-fd>
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: bernard_executor <in-fd> <out-fd>\n");
+        return 2;
+    }
+    int inFD = std::atoi(argv[1]);
+    int outFD = std::atoi(argv[2]);
+
+    // generated code resolves Runtime.h and libm against this process, it is linked with exports on
+    llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+
+    llvm::ExitOnError err("bernard_executor: ");
+    auto server = err(llvm::orc::SimpleRemoteEPCServer::Create<llvm::orc::FDSimpleRemoteEPCTransport>(
+            [](llvm::orc::SimpleRemoteEPCServer::Setup &setup) -> llvm::Error {
+                setup.setDispatcher(std::make_unique<llvm::orc::SimpleRemoteEPCServer::ThreadDispatcher>());
+                setup.bootstrapSymbols() = llvm::orc::SimpleRemoteEPCServer::defaultBootstrapSymbols();
+                setup.services().push_back(std::make_unique<llvm::orc::rt_bootstrap::SimpleExecutorMemoryManager>());
+                return llvm::Error::success();
+            },
+            inFD, outFD));
+    err(server->waitForDisconnect());
+    return 0;
+}
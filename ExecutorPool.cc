@@ -0,0 +1,310 @@
+#include <ExecutorPool.h>
+#include <Stats.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/ExecutionEngine/Orc/SimpleRemoteEPC.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+// leaves a dead child unreaped, its pid can't be reused until Restart collects it
+bool Alive(pid_t pid) {
+    if (pid <= 0) return false;
+    siginfo_t info;
+    info.si_pid = 0;
+    return waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid == 0;
+}
+
+llvm::Error ErrnoError(const char *what) {
+    return llvm::createStringError(std::error_code(errno, std::generic_category()), "%s: %s", what,
+                                   std::strerror(errno));
+}
+
+// Renames entry to `renamed` and adds int32_t wrapper(int32_t part): part 0 runs it and returns the
+// low half of the result, part 1 returns the high half. runAsIntFunction is the only call the
+// executor protocol offers that returns a value.
+void EmitResultHalves(llvm::Module &module, const std::string &entry, const std::string &renamed,
+                      const std::string &wrapper) {
+    llvm::LLVMContext &context = module.getContext();
+    llvm::IRBuilder<> builder(context);
+    llvm::Function *func = module.getFunction(entry);
+    func->setName(renamed);
+
+    auto *result = new llvm::GlobalVariable(module, builder.getDoubleTy(), false, llvm::GlobalValue::InternalLinkage,
+                                            llvm::ConstantFP::get(builder.getDoubleTy(), 0.0), renamed + ".result");
+    llvm::Function *halves =
+            llvm::Function::Create(llvm::FunctionType::get(builder.getInt32Ty(), {builder.getInt32Ty()}, false),
+                                   llvm::Function::ExternalLinkage, wrapper, &module);
+    llvm::BasicBlock *entryBlock = llvm::BasicBlock::Create(context, "entry", halves);
+    llvm::BasicBlock *runBlock = llvm::BasicBlock::Create(context, "run", halves);
+    llvm::BasicBlock *highBlock = llvm::BasicBlock::Create(context, "high", halves);
+
+    builder.SetInsertPoint(entryBlock);
+    builder.CreateCondBr(builder.CreateICmpEQ(halves->getArg(0), builder.getInt32(0)), runBlock, highBlock);
+
+    builder.SetInsertPoint(runBlock);
+    llvm::Value *val = builder.CreateCall(func);
+    builder.CreateStore(val, result);
+    builder.CreateRet(builder.CreateTrunc(builder.CreateBitCast(val, builder.getInt64Ty()), builder.getInt32Ty()));
+
+    builder.SetInsertPoint(highBlock);
+    llvm::Value *bits = builder.CreateBitCast(builder.CreateLoad(builder.getDoubleTy(), result), builder.getInt64Ty());
+    builder.CreateRet(builder.CreateTrunc(builder.CreateLShr(bits, 32), builder.getInt32Ty()));
+}
+
+}
+
+ExecutorPool::ExecutorPool(const std::string &executorPath, size_t executors, std::chrono::milliseconds timeout)
+        : m_path(executorPath), m_timeout(timeout), m_executors(std::max<size_t>(executors, 1)) {}
+
+ExecutorPool::~ExecutorPool() {
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_stop = true;
+    }
+    m_stopWatchdog.notify_all();
+    if (m_watchdog.joinable()) m_watchdog.join();
+    for (auto &executor : m_executors) {
+        // ends the session, the executor has nothing left to do after that
+        executor.jit.reset();
+        if (executor.pid > 0) {
+            kill(executor.pid, SIGKILL);
+            waitpid(executor.pid, nullptr, 0);
+        }
+    }
+}
+
+llvm::Error ExecutorPool::Start() {
+    // a write to the pipe of a dead executor has to fail instead of killing the engine
+    std::signal(SIGPIPE, SIG_IGN);
+    for (auto &executor : m_executors)
+        if (llvm::Error spawned = Spawn(executor)) return spawned;
+    if (m_timeout.count()) m_watchdog = std::thread(&ExecutorPool::Watchdog, this);
+    return llvm::Error::success();
+}
+
+llvm::Error ExecutorPool::Spawn(Executor &executor) {
+    int toChild[2], fromChild[2];
+    if (pipe2(toChild, O_CLOEXEC)) return ErrnoError("pipe");
+    if (pipe2(fromChild, O_CLOEXEC)) {
+        close(toChild[0]);
+        close(toChild[1]);
+        return ErrnoError("pipe");
+    }
+    // nothing that allocates may run between fork and exec
+    std::string inFD = std::to_string(toChild[0]), outFD = std::to_string(fromChild[1]);
+    pid_t pid = fork();
+    if (pid == 0) {
+        // the executor's own pipe ends are the only descriptors it inherits
+        fcntl(toChild[0], F_SETFD, 0);
+        fcntl(fromChild[1], F_SETFD, 0);
+        execl(m_path.c_str(), m_path.c_str(), inFD.c_str(), outFD.c_str(), static_cast<char *>(nullptr));
+        _exit(127);
+    }
+    close(toChild[0]);
+    close(fromChild[1]);
+    if (pid < 0) {
+        close(toChild[1]);
+        close(fromChild[0]);
+        return ErrnoError("fork");
+    }
+
+    auto epc = llvm::orc::SimpleRemoteEPC::Create<llvm::orc::FDSimpleRemoteEPCTransport>(
+            std::make_unique<llvm::orc::DynamicThreadPoolTaskDispatcher>(), llvm::orc::SimpleRemoteEPC::Setup(),
+            fromChild[0], toChild[1]);
+    llvm::Expected<std::unique_ptr<llvm::orc::BernardJIT>> jit =
+            epc ? llvm::orc::BernardJIT::CreateRemote(std::move(*epc)) : epc.takeError();
+    if (!jit) {
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+        return jit.takeError();
+    }
+    executor.pid = pid;
+    executor.jit = std::move(*jit);
+    return llvm::Error::success();
+}
+
+llvm::Error ExecutorPool::Load(llvm::orc::BernardJIT &jit, const Definition &def) {
+    auto context = std::make_unique<llvm::LLVMContext>();
+    llvm::MemoryBufferRef buffer(llvm::StringRef(def.bitcode.data(), def.bitcode.size()), def.impl);
+    llvm::Expected<std::unique_ptr<llvm::Module>> module = llvm::parseBitcodeFile(buffer, *context);
+    if (!module) return module.takeError();
+    return jit.define(def.name, llvm::orc::ThreadSafeModule(std::move(*module), std::move(context)), def.impl);
+}
+
+llvm::Error ExecutorPool::Define(const std::string &name, llvm::orc::ThreadSafeModule module,
+                                 const std::string &impl) {
+    BERNARD_TIME_SCOPE("remote.define");
+    Definition def{name, impl, {}};
+    module.withModuleDo([&](llvm::Module &m) {
+        llvm::raw_svector_ostream os(def.bitcode);
+        llvm::WriteBitcodeToFile(m, os);
+    });
+
+    std::lock_guard<std::recursive_mutex> defs(m_defsMutex);
+    std::vector<std::pair<size_t, std::shared_ptr<llvm::orc::BernardJIT>>> dead;
+    bool accepted = false;
+    llvm::Error rejected = llvm::Error::success();
+    for (size_t i = 0; i < m_executors.size() && !rejected; i++) {
+        std::shared_ptr<llvm::orc::BernardJIT> jit = Current(i);
+        llvm::Error loaded = Load(*jit, def);
+        if (!loaded) {
+            accepted = true;
+        } else if (!accepted && Alive(m_executors[i].pid)) {
+            // every executor would refuse it the same way
+            rejected = std::move(loaded);
+        } else {
+            llvm::consumeError(std::move(loaded));
+            dead.emplace_back(i, jit);
+        }
+    }
+
+    if (!rejected) {
+        m_defs.erase(std::remove_if(m_defs.begin(), m_defs.end(), [&](const Definition &old) { return old.name == name; }),
+                     m_defs.end());
+        m_defs.push_back(std::move(def));
+    }
+    for (auto &executor : dead) Restart(executor.first, executor.second);
+    return rejected;
+}
+
+llvm::Expected<double> ExecutorPool::Run(llvm::orc::ThreadSafeModule module, const std::string &entry) {
+    BERNARD_TIME_SCOPE("remote.run");
+    std::string id = std::to_string(m_runs++);
+    std::string wrapper = entry + ".halves." + id;
+    module.withModuleDo([&](llvm::Module &m) { EmitResultHalves(m, entry, entry + "." + id, wrapper); });
+
+    Lease lease = Acquire();
+    llvm::orc::ResourceTrackerSP tracker = lease.jit->getMainJITDylib().createResourceTracker();
+    uint64_t bits = 0;
+    llvm::Error ran = lease.jit->addModule(std::move(module), tracker);
+    if (!ran) {
+        llvm::Expected<llvm::orc::ExecutorSymbolDef> sym = lease.jit->lookup(wrapper);
+        if (sym) {
+            lease.jit->enterCall();
+            for (int part = 0; part < 2 && !ran; part++) {
+                llvm::Expected<int32_t> half = lease.jit->runAsIntFunction(sym->getAddress(), part);
+                if (half)
+                    bits |= uint64_t(uint32_t(*half)) << (32 * part);
+                else
+                    ran = half.takeError();
+            }
+            ran = llvm::joinErrors(std::move(ran), lease.jit->exitCall());
+        } else {
+            ran = sym.takeError();
+        }
+    }
+    ran = llvm::joinErrors(std::move(ran), tracker->remove());
+    Release(lease);
+
+    if (ran) {
+        if (!Alive(lease.deadline.second)) Restart(lease.idx, lease.jit);
+        return std::move(ran);
+    }
+    double result;
+    std::memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+llvm::Expected<int32_t> ExecutorPool::Ping(int32_t x) {
+    Lease lease = Acquire();
+    llvm::Expected<llvm::orc::ExecutorSymbolDef> sym = lease.jit->lookup("bernard_ping");
+    llvm::Expected<int32_t> result = sym ? lease.jit->runAsIntFunction(sym->getAddress(), x) : sym.takeError();
+    Release(lease);
+    if (!result && !Alive(lease.deadline.second)) Restart(lease.idx, lease.jit);
+    return result;
+}
+
+void ExecutorPool::Restart(size_t idx, const std::shared_ptr<llvm::orc::BernardJIT> &jit) {
+    std::lock_guard<std::recursive_mutex> defs(m_defsMutex);
+    {
+        // reaped under the lock, so the watchdog never signals the pid once it may be reused
+        std::lock_guard<std::mutex> guard(m_mutex);
+        Executor &executor = m_executors[idx];
+        if (executor.jit != jit) return;
+        if (executor.pid > 0) {
+            kill(executor.pid, SIGKILL);
+            waitpid(executor.pid, nullptr, 0);
+            executor.pid = -1;
+        }
+    }
+
+    Executor fresh;
+    if (llvm::Error spawned = Spawn(fresh)) {
+        fprintf(stderr, "could not restart executor: %s\n", llvm::toString(std::move(spawned)).c_str());
+        return;
+    }
+    // a definition can only be loaded once the stubs it calls exist, retry until nothing changes
+    std::vector<const Definition *> pending;
+    for (auto &def : m_defs) pending.push_back(&def);
+    bool progress = true;
+    while (!pending.empty() && progress) {
+        progress = false;
+        for (auto it = pending.begin(); it != pending.end();) {
+            if (llvm::Error loaded = Load(*fresh.jit, **it)) {
+                llvm::consumeError(std::move(loaded));
+                ++it;
+            } else {
+                it = pending.erase(it);
+                progress = true;
+            }
+        }
+    }
+    for (auto *def : pending) fprintf(stderr, "executor restart dropped %s\n", def->name.c_str());
+
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_executors[idx].pid = fresh.pid;
+        m_executors[idx].jit = std::move(fresh.jit);
+    }
+    m_restarts++;
+    BERNARD_COUNT("remote.restarts", 1);
+}
+
+ExecutorPool::Lease ExecutorPool::Acquire() {
+    auto deadline = m_timeout.count() ? std::chrono::steady_clock::now() + m_timeout
+                                      : std::chrono::steady_clock::time_point::max();
+    std::lock_guard<std::mutex> guard(m_mutex);
+    size_t best = 0;
+    for (size_t i = 1; i < m_executors.size(); i++)
+        if (m_executors[i].inFlight < m_executors[best].inFlight) best = i;
+    Executor &executor = m_executors[best];
+    executor.inFlight++;
+    Lease lease{best, executor.jit, Deadline(deadline, executor.pid)};
+    executor.deadlines.insert(lease.deadline);
+    return lease;
+}
+
+void ExecutorPool::Release(const Lease &lease) {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    Executor &executor = m_executors[lease.idx];
+    executor.inFlight--;
+    executor.deadlines.erase(executor.deadlines.find(lease.deadline));
+}
+
+std::shared_ptr<llvm::orc::BernardJIT> ExecutorPool::Current(size_t idx) {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_executors[idx].jit;
+}
+
+void ExecutorPool::Watchdog() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stop) {
+        m_stopWatchdog.wait_for(lock, std::chrono::milliseconds(10));
+        auto now = std::chrono::steady_clock::now();
+        // a lease may outlive its executor, only the current unreaped process is signalled
+        for (auto &executor : m_executors)
+            for (auto &deadline : executor.deadlines)
+                if (deadline.first < now && deadline.second == executor.pid && executor.pid > 0)
+                    kill(executor.pid, SIGKILL);
+    }
+}
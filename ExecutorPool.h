@@ -0,0 +1,101 @@
+#pragma once
+
+#include <BernardJIT.h>
+#include <llvm/ADT/SmallVector.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+#include <vector>
+
+// Child bernard_executor processes that run JIT'd code out of the engine's address space, each
+// driven by its own BernardJIT over SimpleRemoteEPC on a pair of pipes. Definitions are loaded
+// into every executor and kept as bitcode, so an executor that dies is replaced by a fresh one
+// with the same definitions. A call goes to the executor with the fewest calls in flight.
+class ExecutorPool {
+public:
+    // timeout 0 lets calls run forever, otherwise a call running longer kills its executor
+    ExecutorPool(const std::string &executorPath, size_t executors, std::chrono::milliseconds timeout);
+
+    ~ExecutorPool();
+
+    // spawns the executors
+    llvm::Error Start();
+
+    // points the stub `name` at `impl` from module in every executor
+    llvm::Error Define(const std::string &name, llvm::orc::ThreadSafeModule module, const std::string &impl);
+
+    // runs double entry() from module on one executor and unloads the module again
+    llvm::Expected<double> Run(llvm::orc::ThreadSafeModule module, const std::string &entry);
+
+    // round trip to an executor through bernard_ping, no generated code involved
+    llvm::Expected<int32_t> Ping(int32_t x);
+
+    size_t Size() const { return m_executors.size(); }
+
+    // executors replaced after a crash or a timeout
+    uint64_t Restarts() const { return m_restarts.load(); }
+
+private:
+    // deadline of a call and the executor process it runs in
+    using Deadline = std::pair<std::chrono::steady_clock::time_point, pid_t>;
+
+    struct Executor {
+        // -1 once Restart reaped it and until a new one is spawned
+        pid_t pid = -1;
+        std::shared_ptr<llvm::orc::BernardJIT> jit;
+        unsigned inFlight = 0;
+        std::multiset<Deadline> deadlines;
+    };
+
+    struct Lease {
+        size_t idx;
+        std::shared_ptr<llvm::orc::BernardJIT> jit;
+        Deadline deadline;
+    };
+
+    struct Definition {
+        std::string name;
+        std::string impl;
+        llvm::SmallVector<char, 0> bitcode;
+    };
+
+    llvm::Error Spawn(Executor &executor);
+
+    llvm::Error Load(llvm::orc::BernardJIT &jit, const Definition &def);
+
+    // replaces executor idx unless that already happened since jit was leased
+    void Restart(size_t idx, const std::shared_ptr<llvm::orc::BernardJIT> &jit);
+
+    // picks the least busy executor and counts a call on it
+    Lease Acquire();
+
+    void Release(const Lease &lease);
+
+    std::shared_ptr<llvm::orc::BernardJIT> Current(size_t idx);
+
+    void Watchdog();
+
+    std::string m_path;
+    std::chrono::milliseconds m_timeout;
+
+    // guards the executor table
+    std::mutex m_mutex;
+    std::vector<Executor> m_executors;
+    // serializes loading definitions, Restart replays them while holding it
+    std::recursive_mutex m_defsMutex;
+    // in definition order, a redefinition moves to the back
+    std::vector<Definition> m_defs;
+    std::atomic<uint64_t> m_restarts{0};
+    std::atomic<uint64_t> m_runs{0};
+
+    std::thread m_watchdog;
+    std::condition_variable m_stopWatchdog;
+    bool m_stop = false;
+};
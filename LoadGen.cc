@@ -0,0 +1,144 @@
+#include <Server.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// bernard_loadgen: drives a bernard_server and reports latency percentiles and throughput.
+//   bernard_loadgen [-s socket | -p port] [-c connections] [-d depth] [-n requests] [-D def] [-e expr]
+// Every connection keeps depth requests in flight, -D is evaluated once before the run.
+
+using Clock = std::chrono::steady_clock;
+
+static int Usage() {
+    fprintf(stderr, "usage: bernard_loadgen [-s socket | -p port] [-c connections] [-d depth] [-n requests] "
+                    "[-D def] [-e expr]\n");
+    return 2;
+}
+
+static bool WriteAll(int fd, const std::string &data) {
+    for (size_t sent = 0; sent < data.size();) {
+        ssize_t n = write(fd, data.data() + sent, data.size() - sent);
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+// runs count requests on fd, latencies in microseconds
+static void Drive(int fd, int64_t count, int64_t depth, const std::string &expr, std::vector<double> *latencies,
+                  int64_t *errors) {
+    std::vector<Clock::time_point> sent(count);
+    int64_t next = 0, done = 0;
+    std::string buffer;
+    char chunk[65536];
+    while (done < count) {
+        // top the pipeline up with one write
+        std::string out;
+        Clock::time_point now = Clock::now();
+        for (; next < count && next - done < depth; next++) {
+            sent[next] = now;
+            out += std::to_string(next) + " " + expr + "\n";
+        }
+        if (!out.empty() && !WriteAll(fd, out)) break;
+
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n <= 0) break;
+        now = Clock::now();
+        buffer.append(chunk, n);
+        size_t start = 0, end;
+        while ((end = buffer.find('\n', start)) != std::string::npos) {
+            int64_t id = std::strtoll(buffer.c_str() + start, nullptr, 10);
+            size_t status = buffer.find(' ', start);
+            if (status == std::string::npos || status > end || buffer.compare(status + 1, 2, "ok") != 0) ++*errors;
+            if (id >= 0 && id < count)
+                latencies->push_back(std::chrono::duration<double, std::micro>(now - sent[id]).count());
+            done++;
+            start = end + 1;
+        }
+        buffer.erase(0, start);
+    }
+    *errors += count - done;
+}
+
+static double Percentile(const std::vector<double> &sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t idx = std::min(sorted.size() - 1, size_t(p / 100 * sorted.size()));
+    return sorted[idx];
+}
+
+int main(int argc, char **argv) {
+    std::string socketPath, def, expr = "1 + 2";
+    int port = 0;
+    int64_t connections = 4, depth = 16, requests = 100000;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-s") && i + 1 < argc)
+            socketPath = argv[++i];
+        else if (!strcmp(argv[i], "-p") && i + 1 < argc)
+            port = std::atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-c") && i + 1 < argc)
+            connections = std::max(1ll, std::atoll(argv[++i]));
+        else if (!strcmp(argv[i], "-d") && i + 1 < argc)
+            depth = std::max(1ll, std::atoll(argv[++i]));
+        else if (!strcmp(argv[i], "-n") && i + 1 < argc)
+            requests = std::atoll(argv[++i]);
+        else if (!strcmp(argv[i], "-D") && i + 1 < argc)
+            def = argv[++i];
+        else if (!strcmp(argv[i], "-e") && i + 1 < argc)
+            expr = argv[++i];
+        else
+            return Usage();
+    }
+    if (socketPath.empty() && !port) return Usage();
+
+    std::vector<int> fds;
+    for (int64_t i = 0; i < connections; i++) {
+        int fd = ServerConnect(socketPath, port);
+        if (fd < 0) {
+            perror("connect");
+            return 1;
+        }
+        fds.push_back(fd);
+    }
+    if (!def.empty()) {
+        std::vector<double> ignored;
+        int64_t failed = 0;
+        Drive(fds[0], 1, 1, def, &ignored, &failed);
+        if (failed) {
+            fprintf(stderr, "setup failed: %s\n", def.c_str());
+            return 1;
+        }
+    }
+
+    std::vector<std::vector<double>> latencies(connections);
+    std::vector<int64_t> errors(connections);
+    std::vector<std::thread> threads;
+    Clock::time_point start = Clock::now();
+    for (int64_t i = 0; i < connections; i++) {
+        int64_t count = requests / connections + (i < requests % connections);
+        threads.emplace_back(Drive, fds[i], count, depth, expr, &latencies[i], &errors[i]);
+    }
+    for (auto &thread : threads) thread.join();
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    for (int fd : fds) close(fd);
+
+    std::vector<double> all;
+    int64_t failed = 0;
+    for (int64_t i = 0; i < connections; i++) {
+        all.insert(all.end(), latencies[i].begin(), latencies[i].end());
+        failed += errors[i];
+    }
+    std::sort(all.begin(), all.end());
+    printf("requests     %zu (%lld errors)\n", all.size(), (long long)failed);
+    printf("throughput   %.0f req/s\n", all.size() / seconds);
+    printf("latency p50  %.1f us\n", Percentile(all, 50));
+    printf("latency p99  %.1f us\n", Percentile(all, 99));
+    printf("latency p999 %.1f us\n", Percentile(all, 99.9));
+    return failed ? 1 : 0;
+}
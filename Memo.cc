@@ -0,0 +1,94 @@
+#include <Memo.h>
+
+#include <cstring>
+
+namespace {
+
+uint64_t Bits(double val) {
+    uint64_t bits;
+    std::memcpy(&bits, &val, sizeof(bits));
+    return bits;
+}
+
+uint64_t Mix(uint64_t hash, uint64_t word) {
+    // splitmix64 finalizer over the running hash
+    hash ^= word + 0x9E3779B97F4A7C15ULL + (hash << 6) + (hash >> 2);
+    hash ^= hash >> 30;
+    hash *= 0xBF58476D1CE4E5B9ULL;
+    hash ^= hash >> 27;
+    hash *= 0x94D049BB133111EBULL;
+    return hash ^ (hash >> 31);
+}
+
+}
+
+MemoCache::MemoCache(unsigned arity, size_t capacity)
+        : m_arity(arity), m_slotWords(arity + 2), m_hits(0), m_misses(0), m_evictions(0) {
+    size_t slots = 1;
+    while (slots < capacity) slots <<= 1;
+    m_mask = slots - 1;
+    m_words.reset(new std::atomic<uint64_t>[slots * m_slotWords]);
+    Clear();
+}
+
+std::atomic<uint64_t> *MemoCache::Slot(const double *args) {
+    uint64_t hash = m_arity;
+    for (unsigned i = 0; i < m_arity; i++) hash = Mix(hash, Bits(args[i]));
+    return &m_words[(hash & m_mask) * m_slotWords];
+}
+
+bool MemoCache::Lookup(const double *args, double *result) {
+    std::atomic<uint64_t> *slot = Slot(args);
+    uint64_t seq = slot[0].load(std::memory_order_acquire);
+    // zero is an empty slot, odd is a write in progress
+    bool hit = seq != 0 && !(seq & 1);
+    for (unsigned i = 0; hit && i < m_arity; i++) hit = slot[2 + i].load(std::memory_order_relaxed) == Bits(args[i]);
+    uint64_t resBits = slot[1].load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (hit && slot[0].load(std::memory_order_relaxed) == seq) {
+        std::memcpy(result, &resBits, sizeof(*result));
+        m_hits.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    m_misses.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+void MemoCache::Store(const double *args, double result) {
+    std::atomic<uint64_t> *slot = Slot(args);
+    uint64_t seq = slot[0].load(std::memory_order_relaxed);
+    if ((seq & 1) || !slot[0].compare_exchange_strong(seq, seq + 1, std::memory_order_acquire)) return;
+    std::atomic_thread_fence(std::memory_order_release);
+
+    if (seq != 0) {
+        for (unsigned i = 0; i < m_arity; i++) {
+            if (slot[2 + i].load(std::memory_order_relaxed) != Bits(args[i])) {
+                m_evictions.fetch_add(1, std::memory_order_relaxed);
+                break;
+            }
+        }
+    }
+    slot[1].store(Bits(result), std::memory_order_relaxed);
+    for (unsigned i = 0; i < m_arity; i++) slot[2 + i].store(Bits(args[i]), std::memory_order_relaxed);
+    slot[0].store(seq + 2, std::memory_order_release);
+}
+
+void MemoCache::Clear() {
+    for (size_t i = 0; i < (m_mask + 1) * m_slotWords; i++) m_words[i].store(0, std::memory_order_relaxed);
+    m_hits.store(0, std::memory_order_relaxed);
+    m_misses.store(0, std::memory_order_relaxed);
+    m_evictions.store(0, std::memory_order_relaxed);
+}
+
+MemoStats MemoCache::Stats() const {
+    return MemoStats{m_hits.load(std::memory_order_relaxed), m_misses.load(std::memory_order_relaxed),
+                     m_evictions.load(std::memory_order_relaxed), m_mask + 1};
+}
+
+extern "C" int bernard_memo_lookup(MemoCache *cache, const double *args, double *result) {
+    return cache->Lookup(args, result);
+}
+
+extern "C" void bernard_memo_store(MemoCache *cache, const double *args, double result) {
+    cache->Store(args, result);
+}
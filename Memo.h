@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+struct MemoStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t capacity;
+};
+
+// Fixed size, direct mapped cache from the bit patterns of a call's arguments to its result.
+// Lookup and Store never block: every slot is guarded by a sequence number, a reader that
+// races with a writer sees an odd or changed sequence and reports a miss, a writer that
+// finds the slot being written gives up.
+class MemoCache {
+public:
+    // capacity is rounded up to a power of two
+    MemoCache(unsigned arity, size_t capacity);
+
+    bool Lookup(const double *args, double *result);
+
+    void Store(const double *args, double result);
+
+    void Clear();
+
+    MemoStats Stats() const;
+
+    unsigned Arity() const { return m_arity; }
+
+private:
+    // per slot: sequence, result, then one word per argument
+    std::atomic<uint64_t> *Slot(const double *args);
+
+    unsigned m_arity;
+    size_t m_mask;
+    size_t m_slotWords;
+    std::unique_ptr<std::atomic<uint64_t>[]> m_words;
+    std::atomic<uint64_t> m_hits;
+    std::atomic<uint64_t> m_misses;
+    std::atomic<uint64_t> m_evictions;
+};
+
+// called from JIT'd wrappers, the cache pointer is baked into the generated code
+extern "C" int bernard_memo_lookup(MemoCache *cache, const double *args, double *result);
+extern "C" void bernard_memo_store(MemoCache *cache, const double *args, double result);
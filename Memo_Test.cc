@@ -0,0 +1,60 @@
+#include <gtest/gtest.h>
+#include <Memo.h>
+
+#include <thread>
+#include <vector>
+
+TEST(Memo, hitAndMiss) {
+    MemoCache cache(2, 16);
+    double args[2] = {1.0, 2.0};
+    double result = 0;
+
+    EXPECT_FALSE(cache.Lookup(args, &result));
+    cache.Store(args, 3.0);
+    EXPECT_TRUE(cache.Lookup(args, &result));
+    EXPECT_EQ(result, 3.0);
+
+    // -0.0 and 0.0 are different keys, the cache compares bits
+    double zero[2] = {0.0, 2.0};
+    double negZero[2] = {-0.0, 2.0};
+    cache.Store(zero, 1.0);
+    EXPECT_FALSE(cache.Lookup(negZero, &result));
+
+    MemoStats stats = cache.Stats();
+    EXPECT_EQ(stats.hits, 1);
+    EXPECT_EQ(stats.misses, 2);
+    EXPECT_EQ(stats.capacity, 16);
+}
+
+TEST(Memo, eviction) {
+    MemoCache cache(1, 1);
+    double a = 1.0, b = 2.0, result;
+    cache.Store(&a, 10.0);
+    cache.Store(&b, 20.0);
+    EXPECT_EQ(cache.Stats().evictions, 1);
+    EXPECT_FALSE(cache.Lookup(&a, &result));
+    EXPECT_TRUE(cache.Lookup(&b, &result));
+    EXPECT_EQ(result, 20.0);
+}
+
+TEST(Memo, concurrent) {
+    MemoCache cache(1, 64);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&cache]() {
+            for (int i = 0; i < 100000; i++) {
+                double arg = i % 256, result;
+                if (cache.Lookup(&arg, &result))
+                    ASSERT_EQ(result, arg * 2);
+                else
+                    cache.Store(&arg, arg * 2);
+            }
+        });
+    }
+    for (auto &thread : threads) thread.join();
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -1,26 +1,61 @@
 #include <BernardJIT.h>
+#include <Capture.h>
+#include <ExecutorPool.h>
 #include <Parser.h>
 #include <Scanner.h>
+#include <Stats.h>
+#include <llvm/ADT/Hashing.h>
 #include <llvm/Analysis/CGSCCPassManager.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
 #include <llvm/Analysis/LoopAnalysisManager.h>
 #include <llvm/IR/Constants.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Intrinsics.h>
 #include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/PassManager.h>
+#include <llvm/Linker/Linker.h>
 #include <llvm/Passes/PassBuilder.h>
 #include <llvm/Passes/StandardInstrumentations.h>
+#include <llvm/Support/DynamicLibrary.h>
 #include <llvm/Support/Error.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Analysis/TargetLibraryInfo.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/TargetParser/Host.h>
 #include <llvm/Transforms/InstCombine/InstCombine.h>
 #include <llvm/Transforms/Scalar/GVN.h>
+#include <llvm/Transforms/Scalar/IndVarSimplify.h>
+#include <llvm/Transforms/Scalar/LICM.h>
+#include <llvm/Transforms/Scalar/LoopPassManager.h>
+#include <llvm/Transforms/Scalar/LoopRotation.h>
+#include <llvm/Transforms/Scalar/LoopUnrollPass.h>
 #include <llvm/Transforms/Scalar/Reassociate.h>
+#include <llvm/Transforms/Scalar/SROA.h>
 #include <llvm/Transforms/Scalar/SimplifyCFG.h>
+#include <llvm/Transforms/Scalar/TailRecursionElimination.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/Mem2Reg.h>
+#include <llvm/Transforms/Vectorize/LoopVectorize.h>
 #include <llvm/Support/TargetSelect.h>
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <map>
+#include <optional>
+#include <set>
+#include <unordered_map>
+#include <vector>
 
 int Precedence(const char &tok) {
-    if (tok == gPlus || tok == gSub)
+    if (tok == '=')
+        return 2;
+    else if (tok == gPlus || tok == gSub)
         return 8;
     else if (tok == gMultiply || tok == gDiv)
         return 10;
@@ -30,18 +65,18 @@ int Precedence(const char &tok) {
         return -1;
 }
 
-#define DLLEXPORT
-extern "C" DLLEXPORT double putchard(double X) {
-    fputc((char)X, stderr);
-    return 0;
-}
+// set while RunScript reports errors to its caller, receives the first message its thread logs
+thread_local std::string *g_LogSink = nullptr;
 
-void Log(const std::string &msg) { std::cout << msg << std::endl; }
+void Log(const std::string &msg) {
+    if (g_LogSink && g_LogSink->empty()) *g_LogSink = msg;
+    std::cout << msg << std::endl;
+}
 
 std::unique_ptr<llvm::LLVMContext> g_Context;
 std::unique_ptr<llvm::IRBuilder<>> g_Builder;
 std::unique_ptr<llvm::Module> g_Module;
-std::map<std::string, llvm::Value *> g_NameValues;
+std::map<std::string, llvm::AllocaInst *> g_NameValues;
 std::unique_ptr<llvm::FunctionPassManager> g_FuncPassM;
 std::unique_ptr<llvm::LoopAnalysisManager> g_LoopAnalyM;
 std::unique_ptr<llvm::FunctionAnalysisManager> g_FuncAnalyM;
@@ -51,11 +86,143 @@ std::unique_ptr<llvm::PassInstrumentationCallbacks> g_PassInstruCbM;
 std::unique_ptr<llvm::StandardInstrumentations> g_StandardInstru;
 std::map<std::string, std::unique_ptr<FunctionDeclAst>> g_FunctionDecls;
 std::unique_ptr<llvm::orc::BernardJIT> g_JIT;
+// set by InitRemoteJIT, defs and top-level expressions then run in the executors instead of g_JIT
+std::unique_ptr<ExecutorPool> g_Executors;
+double g_LastResult = 0;
+bool g_LazyCompile = false;
+unsigned g_SpeculationThreads = 0;
+size_t g_MemoryQuota = 0;
+// no IR or results on stderr, see SetQuiet
+bool g_Quiet = false;
+CaptureRing g_Capture;
+// host functions from RegisterHostFunction, defined in every JIT InitJIT creates
+struct HostFunction {
+    void *address;
+    std::vector<bool> buffers;
+    std::string bitcode;
+    // part of the runtime, bernard_executor exports it as well
+    bool runtime = false;
+};
+std::map<std::string, HostFunction> g_HostFunctions;
+uint64_t g_Batches = 0;
+// relaxed FP semantics, per session with per function overrides
+bool g_FastMath = false;
+std::map<std::string, bool> g_FunctionFastMath;
+// names given a body by `def`, they shadow the math builtins
+std::set<std::string> g_UserDefinedFunctions;
+llvm::TargetLibraryInfoImpl::VectorLibrary g_VectorLibrary = llvm::TargetLibraryInfoImpl::NoLibrary;
+// defs whose last definition was pure, see FunctionDefAst::IsPure
+std::set<std::string> g_PureFunctions;
+bool g_Memoize = false;
+size_t g_MemoCacheEntries = 4096;
+// generated code holds raw cache pointers, so caches of replaced definitions are never freed
+std::vector<std::unique_ptr<MemoCache>> g_MemoCacheStore;
+std::map<std::string, MemoCache *> g_MemoCaches;
+// bodies of the current definitions, kept for specialization
+std::map<std::string, std::unique_ptr<FunctionDefAst>> g_FunctionDefs;
+// bumped on every definition, the JIT symbol of version N of `name` is name.vN
+std::map<std::string, unsigned> g_DefVersions;
+// hash-consed subexpressions of the current compilation unit by structure, see SharedNode
+bool g_HashCons = true;
+std::unordered_map<std::string, SharedNode> g_Interned;
+size_t g_NextInternId = 0;
+SharingStats g_SharingStats;
+// value computed for a shared subexpression, reusable while in block and nothing was (re)bound since
+struct SharedValue {
+    llvm::Value *value;
+    llvm::BasicBlock *block;
+    uint64_t epoch;
+};
+std::unordered_map<size_t, SharedValue> g_SharedValues;
+// bumped whenever a variable is assigned or a name bound to another slot
+uint64_t g_BindingEpoch = 0;
+// buffers from BindBuffer: name -> data, length
+std::map<std::string, std::pair<double *, size_t>> g_HostBuffers;
+// fingerprint each def was last compiled from, see DefFingerprint
+std::map<std::string, uint64_t> g_DefFingerprints;
+// call graph between defs by name, from the bodies they were last compiled from
+std::map<std::string, std::set<std::string>> g_Callees;
+std::map<std::string, std::set<std::string>> g_Callers;
+std::string g_CurrentFunction;
+// set while CompileScript runs, nothing it generates may reach the live JIT's call graph or profile
+bool g_AheadOfTime = false;
+bool g_Specialize = false;
+size_t g_SpecializeMaxInstructions = 512;
+size_t g_SpecializeBudget = 65536;
+unsigned g_SpecializeDepth = 0;
+// argument tuple key -> clone stub, empty when the clone was over budget
+std::map<std::string, std::string> g_Specializations;
+// clone stub -> what it was specialized from, to rebuild it when the callee is redefined
+struct SpecializedClone {
+    std::string callee;
+    std::vector<std::unique_ptr<NumberNode>> bound;
+};
+std::map<std::string, SpecializedClone> g_SpecializedClones;
+// host target, lets the loop vectorizer and unroller use real cost models
+// Profile of the body being generated: with counters set every profiled branch bumps its counters
+// (a placeholder global, pointed at the real array once their number is known), with weights set
+// the branches get them as metadata. next is the next free counter.
+struct ProfileSite {
+    llvm::GlobalVariable *counters = nullptr;
+    const std::vector<uint64_t> *weights = nullptr;
+    size_t next = 0;
+};
+ProfileSite g_Profile;
+ProfileData g_ProfileData;
+bool g_ProfileInstrument = false;
+uint64_t g_ProfileWarmup = 0;
+
+std::unique_ptr<llvm::TargetMachine> g_TargetMachine;
 llvm::ExitOnError err;
 
+#ifdef BERNARD_STATS
+// pass instrumentation only sees names, keep a stack so nested adaptors are timed correctly.
+std::vector<std::chrono::steady_clock::time_point> g_PassStartTimes;
+// the only callbacks the pipeline runs, timing passes must not change what gets printed
+std::unique_ptr<llvm::PassInstrumentationCallbacks> g_PassTimers;
+
+void RecordPassTime(llvm::StringRef pass) {
+    if (g_PassStartTimes.empty()) return;
+    auto elapsed = std::chrono::steady_clock::now() - g_PassStartTimes.back();
+    g_PassStartTimes.pop_back();
+    StatsRegistry::Instance().GetHistogram("pass." + pass.str()).Record(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+}
+
+void RegisterPassTimers(llvm::PassInstrumentationCallbacks &callbacks) {
+    callbacks.registerBeforeNonSkippedPassCallback(
+            [](llvm::StringRef, llvm::Any) { g_PassStartTimes.push_back(std::chrono::steady_clock::now()); });
+    callbacks.registerAfterPassCallback(
+            [](llvm::StringRef pass, llvm::Any, const llvm::PreservedAnalyses &) { RecordPassTime(pass); });
+    callbacks.registerAfterPassInvalidatedCallback(
+            [](llvm::StringRef pass, const llvm::PreservedAnalyses &) { RecordPassTime(pass); });
+}
+#endif
+
+std::unique_ptr<llvm::Module> CreateModule(const std::string &name, llvm::LLVMContext &context) {
+    auto module = std::make_unique<llvm::Module>(name, context);
+    if (g_TargetMachine) {
+        module->setDataLayout(g_TargetMachine->createDataLayout());
+        module->setTargetTriple(g_TargetMachine->getTargetTriple().str());
+    }
+    return module;
+}
+
 void InitLLVMOpt() {
+    BERNARD_TIME_SCOPE("stage.init_opt");
+    // users before what they use: the context deletes the modules it still owns, the module must
+    // already be gone by then or it is destroyed twice
+    g_FuncPassM.reset();
+    // an outer manager's proxy clears the inner manager when it goes
+    g_ModuleAnaM.reset();
+    g_CGSCCM.reset();
+    g_FuncAnalyM.reset();
+    g_LoopAnalyM.reset();
+    g_StandardInstru.reset();
+    g_Builder.reset();
+    g_Module.reset();
     g_Context = std::make_unique<llvm::LLVMContext>();
-    g_Module = std::make_unique<llvm::Module>("bernard jit", *g_Context);
+    g_Module = CreateModule("bernard jit", *g_Context);
     g_Builder = std::make_unique<llvm::IRBuilder<>>(*g_Context);
 
     g_FuncPassM = std::make_unique<llvm::FunctionPassManager>();
@@ -67,16 +234,46 @@ void InitLLVMOpt() {
     g_StandardInstru = std::make_unique<llvm::StandardInstrumentations>(*g_Context, true);
 
     g_StandardInstru->registerCallbacks(*g_PassInstruCbM, g_ModuleAnaM.get());
+#ifdef BERNARD_STATS
+    g_PassTimers = std::make_unique<llvm::PassInstrumentationCallbacks>();
+    RegisterPassTimers(*g_PassTimers);
+#endif
 
     // add pass
+    // locals live in entry block allocas, promote them before anything else
+    g_FuncPassM->addPass(llvm::PromotePass());
+    g_FuncPassM->addPass(llvm::SROAPass(llvm::SROAOptions::ModifyCFG));
     g_FuncPassM->addPass(llvm::InstCombinePass());
     g_FuncPassM->addPass(llvm::ReassociatePass());
     g_FuncPassM->addPass(llvm::GVNPass());
     g_FuncPassM->addPass(llvm::SimplifyCFGPass());
+    // self recursion becomes a loop here, early enough for the loop passes below to see it
+    g_FuncPassM->addPass(llvm::TailCallElimPass());
+
+    llvm::LoopPassManager loopPM;
+    loopPM.addPass(llvm::LoopRotatePass());
+    loopPM.addPass(llvm::LICMPass(llvm::LICMOptions()));
+    loopPM.addPass(llvm::IndVarSimplifyPass());
+    g_FuncPassM->addPass(llvm::createFunctionToLoopPassAdaptor(std::move(loopPM), true));
+    g_FuncPassM->addPass(llvm::LoopVectorizePass());
+    g_FuncPassM->addPass(llvm::LoopUnrollPass());
+    g_FuncPassM->addPass(llvm::InstCombinePass());
+    g_FuncPassM->addPass(llvm::SimplifyCFGPass());
+
+    // registered ahead of the PassBuilder defaults so the vectorizer sees the vector math mappings
+    llvm::TargetLibraryInfoImpl tlii(llvm::Triple(g_Module->getTargetTriple()));
+    tlii.addVectorizableFunctionsFromVecLib(g_VectorLibrary, llvm::Triple(g_Module->getTargetTriple()));
+    g_FuncAnalyM->registerPass([tlii] { return llvm::TargetLibraryAnalysis(tlii); });
 
-    llvm::PassBuilder pb;
+#ifdef BERNARD_STATS
+    llvm::PassBuilder pb(g_TargetMachine.get(), llvm::PipelineTuningOptions(), std::nullopt, g_PassTimers.get());
+#else
+    llvm::PassBuilder pb(g_TargetMachine.get());
+#endif
     pb.registerModuleAnalyses(*g_ModuleAnaM);
+    pb.registerCGSCCAnalyses(*g_CGSCCM);
     pb.registerFunctionAnalyses(*g_FuncAnalyM);
+    pb.registerLoopAnalyses(*g_LoopAnalyM);
     pb.crossRegisterProxies(*g_LoopAnalyM, *g_FuncAnalyM, *g_CGSCCM, *g_ModuleAnaM);
 }
 
@@ -95,29 +292,508 @@ llvm::Function *getFunction(const std::string &name) {
   return nullptr;
 }
 
-llvm::Value *NumberNode::CodeGen() { return llvm::ConstantFP::get(*g_Context, llvm::APFloat(m_number)); }
+// mutable locals are stack slots in the entry block, mem2reg turns them into SSA values
+llvm::AllocaInst *CreateEntryBlockAlloca(llvm::Function *func, const std::string &name, llvm::Type *type) {
+    llvm::IRBuilder<> builder(&func->getEntryBlock(), func->getEntryBlock().begin());
+    return builder.CreateAlloca(type, nullptr, name);
+}
+
+struct MathBuiltin {
+    llvm::Intrinsic::ID id;
+    unsigned arity;
+};
+
+// lowered straight to intrinsics so the optimizer can fold, inline and vectorize them
+const std::map<std::string, MathBuiltin> gMathBuiltins = {
+    {"sqrt", {llvm::Intrinsic::sqrt, 1}},
+    {"sin", {llvm::Intrinsic::sin, 1}},
+    {"cos", {llvm::Intrinsic::cos, 1}},
+    {"exp", {llvm::Intrinsic::exp, 1}},
+    {"exp2", {llvm::Intrinsic::exp2, 1}},
+    {"log", {llvm::Intrinsic::log, 1}},
+    {"log2", {llvm::Intrinsic::log2, 1}},
+    {"log10", {llvm::Intrinsic::log10, 1}},
+    {"fabs", {llvm::Intrinsic::fabs, 1}},
+    {"abs", {llvm::Intrinsic::fabs, 1}},
+    {"floor", {llvm::Intrinsic::floor, 1}},
+    {"ceil", {llvm::Intrinsic::ceil, 1}},
+    {"trunc", {llvm::Intrinsic::trunc, 1}},
+    {"round", {llvm::Intrinsic::round, 1}},
+    {"pow", {llvm::Intrinsic::pow, 2}},
+    {"min", {llvm::Intrinsic::minnum, 2}},
+    {"max", {llvm::Intrinsic::maxnum, 2}},
+    {"copysign", {llvm::Intrinsic::copysign, 2}},
+    {"fma", {llvm::Intrinsic::fma, 3}},
+};
+
+const MathBuiltin *FindMathBuiltin(const std::string &name) {
+    if (g_UserDefinedFunctions.count(name)) return nullptr;
+    auto it = gMathBuiltins.find(name);
+    return it != gMathBuiltins.end() ? &it->second : nullptr;
+}
+
+struct VectorMathLibrary {
+    llvm::TargetLibraryInfoImpl::VectorLibrary library;
+    // shared object defining the vector variants, the JIT resolves them by process symbol search
+    const char *file;
+    // only has mappings for this architecture
+    llvm::Triple::ArchType arch;
+};
+
+const std::map<std::string, VectorMathLibrary> gVectorMathLibraries = {
+    {"libmvec", {llvm::TargetLibraryInfoImpl::LIBMVEC_X86, "libmvec.so.1", llvm::Triple::x86_64}},
+    {"svml", {llvm::TargetLibraryInfoImpl::SVML, "libsvml.so", llvm::Triple::x86_64}},
+    {"sleef", {llvm::TargetLibraryInfoImpl::SLEEFGNUABI, "libsleefgnuabi.so.3", llvm::Triple::aarch64}},
+};
+
+bool SetVectorMathLibrary(const std::string &name) {
+    if (name == "none") {
+        g_VectorLibrary = llvm::TargetLibraryInfoImpl::NoLibrary;
+        return true;
+    }
+    auto it = gVectorMathLibraries.find(name);
+    if (it == gVectorMathLibraries.end()) {
+        Log("unknown vector math library " + name);
+        return false;
+    }
+    const VectorMathLibrary &vecLib = it->second;
+    llvm::Triple host(llvm::sys::getProcessTriple());
+    if (host.getArch() != vecLib.arch) {
+        Log(name + " has no vector variants for " + host.getArchName().str());
+        return false;
+    }
+    // a vectorized loop calling a variant nobody defines would fail to link in the JIT
+    if (llvm::sys::DynamicLibrary::LoadLibraryPermanently(vecLib.file)) {
+        Log(std::string("can not load ") + vecLib.file);
+        return false;
+    }
+    g_VectorLibrary = vecLib.library;
+    return true;
+}
+
+// Type inference. Function arguments and return values stay double, that is the calling
+// convention every module, extern and the host agree on. Inside a body literals, comparisons,
+// bounded loop counters and locals only ever assigned integers are emitted as i64 / i1. Sums and
+// products may leave any fixed range, they are computed in double as they always were.
+struct VarInfo {
+    ValueKind kind;
+    bool widened;
+};
+
+std::map<std::string, VarInfo *> g_VarKinds;
+
+ValueKind Join(ValueKind lhs, ValueKind rhs) { return std::max(lhs, rhs); }
+
+VarInfo *BindVarKind(const std::string &name, VarInfo *info) {
+    VarInfo *old = g_VarKinds[name];
+    g_VarKinds[name] = info;
+    return old;
+}
+
+void UnbindVarKind(const std::string &name, VarInfo *old) {
+    if (old)
+        g_VarKinds[name] = old;
+    else
+        g_VarKinds.erase(name);
+}
+
+llvm::Type *KindType(ValueKind kind) {
+    switch (kind) {
+        case ValueKind::BOOL:
+            return llvm::Type::getInt1Ty(*g_Context);
+        case ValueKind::INT:
+            return llvm::Type::getInt64Ty(*g_Context);
+        default:
+            return llvm::Type::getDoubleTy(*g_Context);
+    }
+}
+
+llvm::Value *ToBool(llvm::Value *val, const char *name) {
+    llvm::Type *type = val->getType();
+    if (type->isIntegerTy(1)) return val;
+    if (type->isIntegerTy()) return g_Builder->CreateICmpNE(val, llvm::ConstantInt::get(type, 0), name);
+    return g_Builder->CreateFCmpONE(val, llvm::ConstantFP::get(*g_Context, llvm::APFloat(0.0)), name);
+}
+
+void CountEvent(llvm::Value *counter) {
+    llvm::Value *slot = g_Builder->CreateGEP(g_Builder->getInt64Ty(), g_Profile.counters, counter);
+    g_Builder->CreateAtomicRMW(llvm::AtomicRMWInst::Add, slot, g_Builder->getInt64(1), llvm::MaybeAlign(8),
+                               llvm::AtomicOrdering::Monotonic);
+}
+
+// conditional branch that takes part in the profile, see ProfileSite
+llvm::BranchInst *CreateProfiledCondBr(llvm::Value *cond, llvm::BasicBlock *taken, llvm::BasicBlock *notTaken) {
+    size_t counter = g_Profile.next;
+    if (g_Profile.counters || g_Profile.weights) g_Profile.next += 2;
+    if (g_Profile.counters)
+        CountEvent(g_Builder->CreateSelect(cond, g_Builder->getInt64(counter), g_Builder->getInt64(counter + 1)));
+    llvm::BranchInst *br = g_Builder->CreateCondBr(cond, taken, notTaken);
+    const std::vector<uint64_t> *weights = g_Profile.weights;
+    if (weights && counter + 1 < weights->size()) {
+        // branch weights are 32 bit, keep the ratio
+        uint64_t scale = std::max((*weights)[counter], (*weights)[counter + 1]) / UINT32_MAX + 1;
+        br->setMetadata(llvm::LLVMContext::MD_prof,
+                        llvm::MDBuilder(*g_Context).createBranchWeights(uint32_t((*weights)[counter] / scale),
+                                                                        uint32_t((*weights)[counter + 1] / scale)));
+    }
+    return br;
+}
+
+// weights that turned out not to fit the body are worse than none
+void StripProfile(llvm::Module &module) {
+    for (auto &func : module) {
+        func.setMetadata(llvm::LLVMContext::MD_prof, nullptr);
+        for (auto &block : func)
+            if (llvm::Instruction *term = block.getTerminator()) term->setMetadata(llvm::LLVMContext::MD_prof, nullptr);
+    }
+}
+
+llvm::Value *ConvertTo(llvm::Value *val, llvm::Type *type) {
+    llvm::Type *from = val->getType();
+    if (from == type) return val;
+    if (type->isIntegerTy(1)) return ToBool(val, "booltmp");
+    if (type->isDoubleTy())
+        return from->isIntegerTy(1) ? g_Builder->CreateUIToFP(val, type, "booltmp")
+                                    : g_Builder->CreateSIToFP(val, type, "inttmp");
+    if (from->isIntegerTy(1)) return g_Builder->CreateZExt(val, type, "booltmp");
+    return g_Builder->CreateFPToSI(val, type, "fptmp");
+}
+
+llvm::Value *ToDouble(llvm::Value *val) { return ConvertTo(val, llvm::Type::getDoubleTy(*g_Context)); }
+
+ValueKind NumberNode::InferKind() { return m_isInt ? ValueKind::INT : ValueKind::DOUBLE; }
+
+ValueKind VariableNode::InferKind() {
+    auto it = g_VarKinds.find(m_name);
+    return it != g_VarKinds.end() && it->second ? it->second->kind : ValueKind::DOUBLE;
+}
+
+ValueKind BinaryOpNode::InferKind() {
+    if (m_op == '=') {
+        mp_lhs->InferKind();
+        ValueKind kind = mp_rhs->InferKind();
+        VariableNode *dest = dynamic_cast<VariableNode *>(mp_lhs.get());
+        if (dest) {
+            auto it = g_VarKinds.find(dest->Name());
+            if (it != g_VarKinds.end() && it->second && Join(it->second->kind, kind) != it->second->kind) {
+                it->second->kind = Join(it->second->kind, kind);
+                it->second->widened = true;
+            }
+        }
+        return kind;
+    }
+
+    mp_lhs->InferKind();
+    mp_rhs->InferKind();
+    return m_op == gLess ? ValueKind::BOOL : ValueKind::DOUBLE;
+}
+
+// An INT leaf is below 2^53 in magnitude, so a few sums of them stay far from the i64 limits. A
+// counter compared against such a bound and moved by a positive integer step stays below the bound
+// plus the step, whatever the trip count.
+bool IsBoundedInt(ExprNode *node, int depth = 0) {
+    if (auto *shared = dynamic_cast<SharedNode *>(node)) return IsBoundedInt(shared->Node(), depth);
+    if (auto *op = dynamic_cast<BinaryOpNode *>(node))
+        return (op->m_op == gPlus || op->m_op == gSub) && depth < 4 && IsBoundedInt(op->mp_lhs.get(), depth + 1) &&
+               IsBoundedInt(op->mp_rhs.get(), depth + 1);
+    if (dynamic_cast<NumberNode *>(node) || dynamic_cast<VariableNode *>(node) ||
+        dynamic_cast<FunctionCallNode *>(node))
+        return node->InferKind() == ValueKind::INT;
+    return false;
+}
+
+// no step counts as 1
+bool IsPositiveIntStep(ExprNode *step) {
+    if (!step) return true;
+    if (auto *shared = dynamic_cast<SharedNode *>(step)) return IsPositiveIntStep(shared->Node());
+    auto *number = dynamic_cast<NumberNode *>(step);
+    return number && number->m_isInt && number->m_number > 0;
+}
+
+// bound of an end condition var < bound, nullptr for any other condition
+ExprNode *LoopBound(ExprNode *end, const std::string &var) {
+    if (auto *shared = dynamic_cast<SharedNode *>(end)) end = shared->Node();
+    auto *cond = dynamic_cast<BinaryOpNode *>(end);
+    auto *lhs = cond ? dynamic_cast<VariableNode *>(cond->mp_lhs.get()) : nullptr;
+    return lhs && cond->m_op == gLess && lhs->Name() == var ? cond->mp_rhs.get() : nullptr;
+}
+
+ValueKind ConditionNode::InferKind() {
+    m_cond->InferKind();
+    ValueKind thenKind = m_then->InferKind();
+    return Join(thenKind, m_else->InferKind());
+}
+
+void ConditionNode::MarkTailPosition() {
+    m_then->MarkTailPosition();
+    m_else->MarkTailPosition();
+}
+
+void BinaryOpNode::CollectCallees(std::vector<std::string> &callees) const {
+    mp_lhs->CollectCallees(callees);
+    mp_rhs->CollectCallees(callees);
+}
+
+void ConditionNode::CollectCallees(std::vector<std::string> &callees) const {
+    m_cond->CollectCallees(callees);
+    m_then->CollectCallees(callees);
+    m_else->CollectCallees(callees);
+}
+
+void ForLoopNode::CollectCallees(std::vector<std::string> &callees) const {
+    mp_start->CollectCallees(callees);
+    mp_body->CollectCallees(callees);
+    if (mp_step) mp_step->CollectCallees(callees);
+    mp_end->CollectCallees(callees);
+}
+
+void ParallelForNode::CollectCallees(std::vector<std::string> &callees) const {
+    mp_start->CollectCallees(callees);
+    mp_bound->CollectCallees(callees);
+    if (mp_step) mp_step->CollectCallees(callees);
+    mp_body->CollectCallees(callees);
+}
+
+void VarExprNode::CollectCallees(std::vector<std::string> &callees) const {
+    for (auto &var : m_vars)
+        if (var.second) var.second->CollectCallees(callees);
+    mp_body->CollectCallees(callees);
+}
+
+void FunctionCallNode::CollectCallees(std::vector<std::string> &callees) const {
+    for (auto &arg : m_args) arg->CollectCallees(callees);
+    callees.push_back(m_callee);
+}
+
+// an optional subexpression, 0 stands for the missing one
+uint64_t FingerprintOf(const std::unique_ptr<ExprNode> &node) { return node ? node->Fingerprint() : 0; }
+
+uint64_t NumberNode::Fingerprint() const {
+    uint64_t bits;
+    std::memcpy(&bits, &m_number, sizeof(bits));
+    return llvm::hash_combine('n', bits, m_isInt);
+}
+
+uint64_t VariableNode::Fingerprint() const { return llvm::hash_combine('v', m_name); }
+
+uint64_t IndexNode::Fingerprint() const { return llvm::hash_combine('i', m_buffer, mp_index->Fingerprint()); }
+
+uint64_t BinaryOpNode::Fingerprint() const {
+    return llvm::hash_combine('b', m_op, mp_lhs->Fingerprint(), mp_rhs->Fingerprint());
+}
+
+uint64_t ConditionNode::Fingerprint() const {
+    return llvm::hash_combine('c', m_cond->Fingerprint(), m_then->Fingerprint(), m_else->Fingerprint());
+}
+
+uint64_t ForLoopNode::Fingerprint() const {
+    return llvm::hash_combine('f', m_valName, mp_start->Fingerprint(), mp_end->Fingerprint(), FingerprintOf(mp_step),
+                              mp_body->Fingerprint());
+}
+
+uint64_t ParallelForNode::Fingerprint() const {
+    return llvm::hash_combine('p', m_valName, mp_start->Fingerprint(), mp_bound->Fingerprint(),
+                              FingerprintOf(mp_step), mp_body->Fingerprint());
+}
+
+uint64_t VarExprNode::Fingerprint() const {
+    uint64_t hash = llvm::hash_combine('x', mp_body->Fingerprint());
+    for (auto &var : m_vars) hash = llvm::hash_combine(hash, var.first, FingerprintOf(var.second));
+    return hash;
+}
+
+uint64_t FunctionCallNode::Fingerprint() const {
+    uint64_t hash = llvm::hash_combine('k', m_callee);
+    for (auto &arg : m_args) hash = llvm::hash_combine(hash, arg->Fingerprint());
+    return hash;
+}
+
+ValueKind ForLoopNode::InferKind() {
+    VarInfo info{Join(ValueKind::INT, mp_start->InferKind()), false};
+    if (!IsPositiveIntStep(mp_step.get())) info.kind = ValueKind::DOUBLE;
+    VarInfo *old = BindVarKind(m_valName, &info);
+    // rerun until no assignment in the loop widens the variable any further
+    do {
+        info.widened = false;
+        mp_body->InferKind();
+        ValueKind step = mp_step ? mp_step->InferKind() : ValueKind::INT;
+        if (Join(info.kind, step) != info.kind) {
+            info.kind = Join(info.kind, step);
+            info.widened = true;
+        }
+        mp_end->InferKind();
+        // an integer counter has to be bounded, or it could run past what i64 holds
+        ExprNode *bound = LoopBound(mp_end.get(), m_valName);
+        if (info.kind == ValueKind::INT && (!bound || !IsBoundedInt(bound))) {
+            info.kind = ValueKind::DOUBLE;
+            info.widened = true;
+        }
+    } while (info.widened);
+    UnbindVarKind(m_valName, old);
+    m_kind = info.kind;
+    return ValueKind::DOUBLE;
+}
+
+ValueKind ParallelForNode::InferKind() {
+    mp_bound->InferKind();
+    VarInfo info{Join(ValueKind::INT, mp_start->InferKind()), false};
+    if (mp_step) info.kind = Join(info.kind, mp_step->InferKind());
+    // iterations stay below bound + step
+    if (!IsPositiveIntStep(mp_step.get()) || !IsBoundedInt(mp_bound.get())) info.kind = ValueKind::DOUBLE;
+    VarInfo *old = BindVarKind(m_valName, &info);
+    do {
+        info.widened = false;
+        mp_body->InferKind();
+    } while (info.widened);
+    UnbindVarKind(m_valName, old);
+    m_kind = info.kind;
+    return ValueKind::DOUBLE;
+}
+
+ValueKind VarExprNode::InferKind() {
+    std::vector<VarInfo> infos;
+    infos.reserve(m_vars.size());
+    std::vector<VarInfo *> oldBindings;
+    for (auto &var : m_vars) {
+        ValueKind kind = var.second ? var.second->InferKind() : ValueKind::INT;
+        infos.push_back(VarInfo{kind, false});
+        oldBindings.push_back(BindVarKind(var.first, &infos.back()));
+    }
+
+    ValueKind bodyKind;
+    bool widened;
+    do {
+        for (auto &info : infos) info.widened = false;
+        bodyKind = mp_body->InferKind();
+        widened = false;
+        for (auto &info : infos) widened |= info.widened;
+    } while (widened);
+
+    m_kinds.clear();
+    for (size_t i = m_vars.size(); i-- > 0;) UnbindVarKind(m_vars[i].first, oldBindings[i]);
+    for (auto &info : infos) m_kinds.push_back(info.kind);
+    return bodyKind;
+}
+
+ValueKind FunctionCallNode::InferKind() {
+    for (auto &arg : m_args) arg->InferKind();
+    return IsLength() ? ValueKind::INT : ValueKind::DOUBLE;
+}
+
+bool FunctionCallNode::IsLength() const {
+    return m_callee == "len" && m_args.size() == 1 && !g_FunctionDecls.count("len") &&
+           dynamic_cast<const VariableNode *>(m_args[0].get());
+}
+
+// A buffer in scope is a pointer slot under its name and a length slot under name.len, which no
+// variable can be called. false when there is no buffer `name`.
+bool FindBuffer(const std::string &name, llvm::AllocaInst **ptr, llvm::AllocaInst **len) {
+    auto ptrIt = g_NameValues.find(name);
+    auto lenIt = g_NameValues.find(name + ".len");
+    if (ptrIt == g_NameValues.end() || !ptrIt->second || !ptrIt->second->getAllocatedType()->isPointerTy() ||
+        lenIt == g_NameValues.end() || !lenIt->second)
+        return false;
+    *ptr = ptrIt->second;
+    *len = lenIt->second;
+    return true;
+}
+
+ValueKind IndexNode::InferKind() {
+    mp_index->InferKind();
+    return ValueKind::DOUBLE;
+}
+
+llvm::Value *NumberNode::CodeGen() {
+    if (m_isInt) return llvm::ConstantInt::get(llvm::Type::getInt64Ty(*g_Context), static_cast<int64_t>(m_number), true);
+    return llvm::ConstantFP::get(*g_Context, llvm::APFloat(m_number));
+}
 
 llvm::Value *VariableNode::CodeGen() {
-    llvm::Value *pVal = g_NameValues[m_name];
-    if (!pVal) std::cout << "unknown variable " << m_name << std::endl;
-    return pVal;
+    llvm::AllocaInst *pVal = g_NameValues[m_name];
+    if (!pVal) {
+        std::cout << "unknown variable " << m_name << std::endl;
+        return nullptr;
+    }
+    if (pVal->getAllocatedType()->isPointerTy()) {
+        Log("buffer " + m_name + " can only be indexed, passed to a def or measured with len");
+        return nullptr;
+    }
+    return g_Builder->CreateLoad(pVal->getAllocatedType(), pVal, m_name.c_str());
+}
+
+llvm::Value *IndexNode::Address() {
+    llvm::AllocaInst *ptr, *len;
+    if (!FindBuffer(m_buffer, &ptr, &len)) {
+        Log("unknown buffer " + m_buffer);
+        return nullptr;
+    }
+    llvm::Value *index = mp_index->CodeGen();
+    if (!index) return nullptr;
+    llvm::Value *base = g_Builder->CreateLoad(ptr->getAllocatedType(), ptr, m_buffer);
+    return g_Builder->CreateInBoundsGEP(g_Builder->getDoubleTy(), base, ConvertTo(index, g_Builder->getInt64Ty()),
+                                        m_buffer + ".elt");
+}
+
+llvm::Value *IndexNode::CodeGen() {
+    llvm::Value *addr = Address();
+    if (!addr) return nullptr;
+    return g_Builder->CreateAlignedLoad(g_Builder->getDoubleTy(), addr, llvm::MaybeAlign(8), "elttmp");
 }
 
 llvm::Value *BinaryOpNode::CodeGen() {
+    if (m_op == '=') {
+        if (auto *element = dynamic_cast<IndexNode *>(mp_lhs.get())) {
+            llvm::Value *val = mp_rhs->CodeGen();
+            if (!val) return nullptr;
+            llvm::Value *addr = element->Address();
+            if (!addr) return nullptr;
+            g_Builder->CreateAlignedStore(ToDouble(val), addr, llvm::MaybeAlign(8));
+            return val;
+        }
+        VariableNode *dest = dynamic_cast<VariableNode *>(mp_lhs.get());
+        if (!dest) {
+            Log("destination of '=' must be a variable or a buffer element");
+            return nullptr;
+        }
+        llvm::Value *val = mp_rhs->CodeGen();
+        if (!val) return nullptr;
+        llvm::AllocaInst *slot = g_NameValues[dest->Name()];
+        if (!slot) {
+            std::cout << "unknown variable " << dest->Name() << std::endl;
+            return nullptr;
+        }
+        if (slot->getAllocatedType()->isPointerTy()) {
+            Log("buffer " + dest->Name() + " can't be assigned to");
+            return nullptr;
+        }
+        g_Builder->CreateStore(ConvertTo(val, slot->getAllocatedType()), slot);
+        g_BindingEpoch++;
+        return val;
+    }
+
     llvm::Value *left = mp_lhs->CodeGen();
     llvm::Value *right = mp_rhs->CodeGen();
     if (!left || !right) return nullptr;
 
+    // integer operands are exact in double too, only comparing them can't leave their range
+    if (left->getType()->isIntegerTy() && right->getType()->isIntegerTy() && m_op == gLess) {
+        llvm::Type *i64 = llvm::Type::getInt64Ty(*g_Context);
+        return g_Builder->CreateICmpSLT(ConvertTo(left, i64), ConvertTo(right, i64), "cmptmp");
+    }
+
+    left = ToDouble(left);
+    right = ToDouble(right);
     switch (m_op) {
         case gPlus:
             return g_Builder->CreateFAdd(left, right, "addtmp");
         case gSub:
-            return g_Builder->CreateSub(left, right, "subtmp");
+            return g_Builder->CreateFSub(left, right, "subtmp");
         case gMultiply:
-            return g_Builder->CreateMul(left, right, "multmp");
+            return g_Builder->CreateFMul(left, right, "multmp");
+        case gDiv:
+            return g_Builder->CreateFDiv(left, right, "divtmp");
         case gLess:
-            left = g_Builder->CreateFCmpULT(left, right, "cmptmp");
-            return g_Builder->CreateUIToFP(left, llvm::Type::getDoubleTy(*g_Context), "booltmp");
+            return g_Builder->CreateFCmpULT(left, right, "cmptmp");
         default:
             return nullptr;
     }
@@ -127,7 +803,7 @@ llvm::Value* ConditionNode::CodeGen() {
     llvm::Value *cond = m_cond->CodeGen();
     if (!cond) return nullptr;
 
-    cond = g_Builder->CreateFCmpONE(cond, llvm::ConstantFP::get(*g_Context, llvm::APFloat(0.0)), "ifcond");
+    cond = ToBool(cond, "ifcond");
 
     llvm::Function *func = g_Builder->GetInsertBlock()->getParent();
 
@@ -135,7 +811,7 @@ llvm::Value* ConditionNode::CodeGen() {
     llvm::BasicBlock *elseBlock = llvm::BasicBlock::Create(*g_Context, "else");
     llvm::BasicBlock *mergeBlock = llvm::BasicBlock::Create(*g_Context, "ifcont");
 
-    g_Builder->CreateCondBr(cond, thenBlock, elseBlock);
+    CreateProfiledCondBr(cond, thenBlock, elseBlock);
 
     // emit
     g_Builder->SetInsertPoint(thenBlock);
@@ -157,31 +833,43 @@ llvm::Value* ConditionNode::CodeGen() {
     g_Builder->CreateBr(mergeBlock);
     elseBlock = g_Builder->GetInsertBlock();
 
+    // both arms already branch to the merge block, widen them in place to a common type
+    llvm::Type *type = thenValue->getType();
+    if (type != elseValue->getType()) {
+        if (type->isIntegerTy() && elseValue->getType()->isIntegerTy())
+            type = llvm::Type::getInt64Ty(*g_Context);
+        else
+            type = llvm::Type::getDoubleTy(*g_Context);
+        g_Builder->SetInsertPoint(thenBlock->getTerminator());
+        thenValue = ConvertTo(thenValue, type);
+        g_Builder->SetInsertPoint(elseBlock->getTerminator());
+        elseValue = ConvertTo(elseValue, type);
+    }
+
     func->insert(func->end(), mergeBlock);
     g_Builder->SetInsertPoint(mergeBlock);
-    llvm::PHINode *phi = g_Builder->CreatePHI(llvm::Type::getDoubleTy(*g_Context), 2, "iftmp");
+    llvm::PHINode *phi = g_Builder->CreatePHI(type, 2, "iftmp");
     phi->addIncoming(thenValue, thenBlock);
     phi->addIncoming(elseValue, elseBlock);
     return phi;
 }
 
 llvm::Value* ForLoopNode::CodeGen() {
+    llvm::Function *func = g_Builder->GetInsertBlock()->getParent();
+    llvm::AllocaInst *slot = CreateEntryBlockAlloca(func, m_valName, KindType(m_kind));
+
     llvm::Value *start = mp_start->CodeGen();
     if (!start) return nullptr;
+    g_Builder->CreateStore(ConvertTo(start, slot->getAllocatedType()), slot);
 
-    llvm::Function *func = g_Builder->GetInsertBlock()->getParent();
-    llvm::BasicBlock *preheaderBlock = g_Builder->GetInsertBlock();
     llvm::BasicBlock *loopBlock = llvm::BasicBlock::Create(*g_Context, "loop", func);
 
     g_Builder->CreateBr(loopBlock);
 
     g_Builder->SetInsertPoint(loopBlock);
 
-    llvm::PHINode *variable = g_Builder->CreatePHI(llvm::Type::getDoubleTy(*g_Context), 2, m_valName);
-    variable->addIncoming(start, preheaderBlock);
-
-    llvm::Value *oldVal = g_NameValues[m_valName];
-    g_NameValues[m_valName] = variable;
+    llvm::AllocaInst *oldVal = g_NameValues[m_valName];
+    g_NameValues[m_valName] = slot;
 
     // emit the body of loop
     if (!mp_body->CodeGen()) return nullptr;
@@ -193,26 +881,29 @@ llvm::Value* ForLoopNode::CodeGen() {
             Log("fail in step val code gen.");
             return nullptr;
         }
+        stepVal = ConvertTo(stepVal, slot->getAllocatedType());
     } else {
-        stepVal = llvm::ConstantFP::get(*g_Context, llvm::APFloat(1.0));
+        stepVal = llvm::ConstantInt::get(llvm::Type::getInt64Ty(*g_Context), 1);
+        stepVal = ConvertTo(stepVal, slot->getAllocatedType());
     }
 
-    llvm::Value *nextVal = g_Builder->CreateFAdd(variable, stepVal, "nextVal");
-
+    // the end condition sees the value the body ran with, as before
     llvm::Value *endCond = mp_end->CodeGen();
     if (!endCond) return nullptr;
 
-    endCond = g_Builder->CreateFCmpONE(endCond, llvm::ConstantFP::get(*g_Context, llvm::APFloat(0.0)), "loopCond");
+    llvm::Value *curVal = g_Builder->CreateLoad(slot->getAllocatedType(), slot, m_valName.c_str());
+    llvm::Value *nextVal = curVal->getType()->isIntegerTy() ? g_Builder->CreateAdd(curVal, stepVal, "nextVal")
+                                                            : g_Builder->CreateFAdd(curVal, stepVal, "nextVal");
+    g_Builder->CreateStore(nextVal, slot);
+
+    endCond = ToBool(endCond, "loopCond");
 
-    llvm::BasicBlock *loopEndBlock = g_Builder->GetInsertBlock();
     llvm::BasicBlock *afterBlock = llvm::BasicBlock::Create(*g_Context, "afterLoop", func);
 
-    g_Builder->CreateCondBr(endCond, loopEndBlock, afterBlock);
+    CreateProfiledCondBr(endCond, loopBlock, afterBlock);
 
     g_Builder->SetInsertPoint(afterBlock);
 
-    variable->addIncoming(nextVal, loopEndBlock);
-
     if (oldVal)
         g_NameValues[m_valName] = oldVal;
     else
@@ -221,69 +912,845 @@ llvm::Value* ForLoopNode::CodeGen() {
     return llvm::Constant::getNullValue(llvm::Type::getDoubleTy(*g_Context));
 }
 
+// i-th iteration runs with start + i * step, the env holds the captured locals followed by start and step
+llvm::Value *ParallelForNode::CodeGen() {
+    llvm::Function *func = g_Builder->GetInsertBlock()->getParent();
+    llvm::Type *doubleTy = g_Builder->getDoubleTy();
+    llvm::Type *i64Ty = g_Builder->getInt64Ty();
+    llvm::Type *ptrTy = g_Builder->getPtrTy();
+
+    llvm::Value *start = mp_start->CodeGen();
+    if (!start) return nullptr;
+    start = ToDouble(start);
+    llvm::Value *bound = mp_bound->CodeGen();
+    if (!bound) return nullptr;
+    bound = ToDouble(bound);
+    llvm::Value *step = llvm::ConstantFP::get(doubleTy, 1.0);
+    if (mp_step) {
+        step = mp_step->CodeGen();
+        if (!step) return nullptr;
+        step = ToDouble(step);
+    }
+
+    // no iterations unless the step moves towards the bound
+    llvm::Value *trips = g_Builder->CreateUnaryIntrinsic(
+            llvm::Intrinsic::ceil, g_Builder->CreateFDiv(g_Builder->CreateFSub(bound, start), step), nullptr, "trips");
+    llvm::Value *runs = g_Builder->CreateAnd(g_Builder->CreateFCmpOGT(trips, llvm::ConstantFP::get(doubleTy, 0.0)),
+                                             g_Builder->CreateFCmpOGT(step, llvm::ConstantFP::get(doubleTy, 0.0)));
+    llvm::Value *count = g_Builder->CreateSelect(runs, g_Builder->CreateFPToSI(trips, i64Ty),
+                                                 llvm::ConstantInt::get(i64Ty, 0), "count");
+
+    std::vector<std::pair<std::string, llvm::AllocaInst *>> captures;
+    std::vector<llvm::Type *> envFields;
+    for (auto &entry : g_NameValues) {
+        if (entry.first == m_valName || !entry.second) continue;
+        captures.push_back(entry);
+        envFields.push_back(entry.second->getAllocatedType());
+    }
+    envFields.push_back(doubleTy);
+    envFields.push_back(doubleTy);
+    llvm::StructType *envTy = llvm::StructType::get(*g_Context, envFields);
+    llvm::AllocaInst *env = CreateEntryBlockAlloca(func, "env", envTy);
+    for (unsigned i = 0; i < captures.size(); i++) {
+        llvm::AllocaInst *slot = captures[i].second;
+        g_Builder->CreateStore(g_Builder->CreateLoad(slot->getAllocatedType(), slot),
+                               g_Builder->CreateStructGEP(envTy, env, i));
+    }
+    g_Builder->CreateStore(start, g_Builder->CreateStructGEP(envTy, env, captures.size()));
+    g_Builder->CreateStore(step, g_Builder->CreateStructGEP(envTy, env, captures.size() + 1));
+
+    // outline the body as double chunk(env, lo, hi), summing the body over iterations [lo, hi)
+    llvm::FunctionType *chunkTy = llvm::FunctionType::get(doubleTy, {ptrTy, i64Ty, i64Ty}, false);
+    llvm::Function *chunk =
+            llvm::Function::Create(chunkTy, llvm::Function::InternalLinkage, func->getName() + ".parallel", g_Module.get());
+    for (const llvm::Attribute &attr : func->getAttributes().getFnAttrs()) chunk->addFnAttr(attr);
+    llvm::BasicBlock *parentBlock = g_Builder->GetInsertBlock();
+    std::map<std::string, llvm::AllocaInst *> parentNames = g_NameValues;
+
+    g_Builder->SetInsertPoint(llvm::BasicBlock::Create(*g_Context, "entry", chunk));
+    llvm::Value *chunkEnv = chunk->getArg(0);
+    g_NameValues.clear();
+    for (unsigned i = 0; i < captures.size(); i++) {
+        llvm::Type *type = captures[i].second->getAllocatedType();
+        llvm::AllocaInst *slot = CreateEntryBlockAlloca(chunk, captures[i].first, type);
+        g_Builder->CreateStore(g_Builder->CreateLoad(type, g_Builder->CreateStructGEP(envTy, chunkEnv, i)), slot);
+        g_NameValues[captures[i].first] = slot;
+    }
+    llvm::Value *chunkStart =
+            g_Builder->CreateLoad(doubleTy, g_Builder->CreateStructGEP(envTy, chunkEnv, captures.size()), "start");
+    llvm::Value *chunkStep =
+            g_Builder->CreateLoad(doubleTy, g_Builder->CreateStructGEP(envTy, chunkEnv, captures.size() + 1), "step");
+    llvm::AllocaInst *acc = CreateEntryBlockAlloca(chunk, "acc", doubleTy);
+    g_Builder->CreateStore(llvm::ConstantFP::get(doubleTy, 0.0), acc);
+    llvm::AllocaInst *index = CreateEntryBlockAlloca(chunk, "index", i64Ty);
+    g_Builder->CreateStore(chunk->getArg(1), index);
+    llvm::AllocaInst *var = CreateEntryBlockAlloca(chunk, m_valName, KindType(m_kind));
+    g_NameValues[m_valName] = var;
+
+    llvm::BasicBlock *condBlock = llvm::BasicBlock::Create(*g_Context, "cond", chunk);
+    llvm::BasicBlock *bodyBlock = llvm::BasicBlock::Create(*g_Context, "body", chunk);
+    llvm::BasicBlock *exitBlock = llvm::BasicBlock::Create(*g_Context, "exit", chunk);
+    g_Builder->CreateBr(condBlock);
+    g_Builder->SetInsertPoint(condBlock);
+    llvm::Value *cur = g_Builder->CreateLoad(i64Ty, index, "cur");
+    g_Builder->CreateCondBr(g_Builder->CreateICmpSLT(cur, chunk->getArg(2)), bodyBlock, exitBlock);
+
+    g_Builder->SetInsertPoint(bodyBlock);
+    llvm::Value *iter = g_Builder->CreateFAdd(chunkStart, g_Builder->CreateFMul(g_Builder->CreateSIToFP(cur, doubleTy),
+                                                                                 chunkStep));
+    g_Builder->CreateStore(ConvertTo(iter, var->getAllocatedType()), var);
+    llvm::Value *val = mp_body->CodeGen();
+    if (val) {
+        g_Builder->CreateStore(g_Builder->CreateFAdd(g_Builder->CreateLoad(doubleTy, acc), ToDouble(val)), acc);
+        g_Builder->CreateStore(g_Builder->CreateAdd(cur, llvm::ConstantInt::get(i64Ty, 1)), index);
+        g_Builder->CreateBr(condBlock);
+        g_Builder->SetInsertPoint(exitBlock);
+        g_Builder->CreateRet(g_Builder->CreateLoad(doubleTy, acc));
+    }
+
+    g_Builder->SetInsertPoint(parentBlock);
+    g_NameValues = parentNames;
+    if (!val) {
+        chunk->eraseFromParent();
+        return nullptr;
+    }
+    // complete on its own, unlike the function it was outlined from
+    OptimizeFunction(chunk);
+    BERNARD_COUNT("parallel.outlined", 1);
+
+    llvm::FunctionType *runtimeTy = llvm::FunctionType::get(doubleTy, {ptrTy, ptrTy, i64Ty}, false);
+    llvm::FunctionCallee runtime = g_Module->getOrInsertFunction("bernard_parallel_for", runtimeTy);
+    return g_Builder->CreateCall(runtime, {chunk, env, count}, "parallelsum");
+}
+
+llvm::Value *VarExprNode::CodeGen() {
+    llvm::Function *func = g_Builder->GetInsertBlock()->getParent();
+
+    std::vector<llvm::AllocaInst *> oldBindings;
+    for (size_t i = 0; i < m_vars.size(); i++) {
+        auto &var = m_vars[i];
+        llvm::Type *type = KindType(i < m_kinds.size() ? m_kinds[i] : ValueKind::DOUBLE);
+        // evaluate the initializer before the name is in scope, so var a = a in ... sees the outer a
+        llvm::Value *init;
+        if (var.second) {
+            init = var.second->CodeGen();
+            if (!init) return nullptr;
+            init = ConvertTo(init, type);
+        } else {
+            init = llvm::Constant::getNullValue(type);
+        }
+
+        llvm::AllocaInst *slot = CreateEntryBlockAlloca(func, var.first, type);
+        g_Builder->CreateStore(init, slot);
+
+        oldBindings.push_back(g_NameValues[var.first]);
+        g_NameValues[var.first] = slot;
+        g_BindingEpoch++;
+    }
+
+    llvm::Value *bodyVal = mp_body->CodeGen();
+    if (!bodyVal) return nullptr;
+
+    for (size_t i = 0; i < m_vars.size(); i++) {
+        if (oldBindings[i])
+            g_NameValues[m_vars[i].first] = oldBindings[i];
+        else
+            g_NameValues.erase(m_vars[i].first);
+    }
+    g_BindingEpoch++;
+    return bodyVal;
+}
+
+// a scalar param is a double, a buffer a pointer and an i64 length
+void AppendParamTypes(bool buffer, std::vector<llvm::Type *> &types) {
+    if (buffer) {
+        types.push_back(g_Builder->getPtrTy());
+        types.push_back(g_Builder->getInt64Ty());
+    } else {
+        types.push_back(g_Builder->getDoubleTy());
+    }
+}
+
+// Names the arguments of param `name` starting at arg and returns the one after them. Buffers don't
+// overlap and don't escape, which is what lets loops over them vectorize without runtime checks.
+llvm::Argument *NameParam(llvm::Argument *arg, const std::string &name, bool buffer) {
+    arg->setName(name);
+    if (!buffer) return arg + 1;
+    arg->addAttr(llvm::Attribute::NoAlias);
+    arg->addAttr(llvm::Attribute::NoCapture);
+    arg->addAttr(llvm::Attribute::getWithAlignment(*g_Context, llvm::Align(8)));
+    (arg + 1)->setName(name + ".len");
+    return arg + 2;
+}
+
 llvm::Function *FunctionDeclAst::CodeGen() {
-    std::vector<llvm::Type *> Doubles(m_args.size(), llvm::Type::getDoubleTy(*g_Context));
-    llvm::FunctionType *FT = llvm::FunctionType::get(llvm::Type::getDoubleTy(*g_Context), Doubles, false);
+    std::vector<llvm::Type *> types;
+    for (size_t i = 0; i < m_args.size(); i++) AppendParamTypes(m_buffers[i], types);
+    llvm::FunctionType *FT = llvm::FunctionType::get(llvm::Type::getDoubleTy(*g_Context), types, false);
 
     llvm::Function *F = llvm::Function::Create(FT, llvm::Function::ExternalLinkage, m_name, g_Module.get());
-    unsigned Idx = 0;
-    for (auto &Arg : F->args()) Arg.setName(m_args[Idx++]);
+    llvm::Argument *arg = F->arg_begin();
+    for (size_t i = 0; i < m_args.size(); i++) arg = NameParam(arg, m_args[i], m_buffers[i]);
     return F;
 }
 
-llvm::Function *FunctionDefAst::CodeGen() {
-    std::string funcName = m_decl->Name();
-    g_FunctionDecls[funcName] = std::move(m_decl);
-    llvm::Function *func = getFunction(funcName);
-    if (!func) { 
-        printf("get function %s fail\n", funcName.c_str());
+llvm::Constant *HostPointer(const void *ptr) {
+    return llvm::ConstantExpr::getIntToPtr(
+            llvm::ConstantInt::get(llvm::Type::getInt64Ty(*g_Context), reinterpret_cast<uint64_t>(ptr)),
+            llvm::PointerType::getUnqual(*g_Context));
+}
+
+// wrapper(args) = lookup(cache, args) ?: store(cache, args, impl(args))
+void EmitMemoWrapper(llvm::Function *wrapper, llvm::Function *impl, MemoCache *cache) {
+    llvm::IRBuilder<> builder(llvm::BasicBlock::Create(*g_Context, "entry", wrapper));
+    llvm::Type *doubleTy = builder.getDoubleTy();
+    llvm::Type *ptrTy = builder.getPtrTy();
+    llvm::ArrayType *argsTy = llvm::ArrayType::get(doubleTy, wrapper->arg_size());
+
+    llvm::Value *args = builder.CreateAlloca(argsTy, nullptr, "args");
+    llvm::Value *result = builder.CreateAlloca(doubleTy, nullptr, "result");
+    std::vector<llvm::Value *> argVals;
+    for (auto &arg : wrapper->args()) {
+        builder.CreateStore(&arg, builder.CreateConstInBoundsGEP2_32(argsTy, args, 0, arg.getArgNo()));
+        argVals.push_back(&arg);
+    }
+
+    llvm::Value *cachePtr = HostPointer(cache);
+    llvm::FunctionType *lookupTy = llvm::FunctionType::get(builder.getInt32Ty(), {ptrTy, ptrTy, ptrTy}, false);
+    llvm::Value *hit = builder.CreateCall(lookupTy, HostPointer(reinterpret_cast<void *>(&bernard_memo_lookup)),
+                                          {cachePtr, args, result}, "hit");
+
+    llvm::BasicBlock *hitBlock = llvm::BasicBlock::Create(*g_Context, "hit", wrapper);
+    llvm::BasicBlock *missBlock = llvm::BasicBlock::Create(*g_Context, "miss", wrapper);
+    builder.CreateCondBr(builder.CreateICmpNE(hit, builder.getInt32(0)), hitBlock, missBlock);
+
+    builder.SetInsertPoint(hitBlock);
+    builder.CreateRet(builder.CreateLoad(doubleTy, result, "cached"));
+
+    builder.SetInsertPoint(missBlock);
+    llvm::Value *val = builder.CreateCall(impl, argVals, "val");
+    llvm::FunctionType *storeTy = llvm::FunctionType::get(builder.getVoidTy(), {ptrTy, ptrTy, doubleTy}, false);
+    builder.CreateCall(storeTy, HostPointer(reinterpret_cast<void *>(&bernard_memo_store)), {cachePtr, args, val});
+    builder.CreateRet(val);
+}
+
+void SetMemoize(bool enable, size_t cacheEntries) {
+    g_Memoize = enable;
+    g_MemoCacheEntries = cacheEntries;
+}
+
+const MemoCache *GetMemoCache(const std::string &name) {
+    auto it = g_MemoCaches.find(name);
+    return it != g_MemoCaches.end() ? it->second : nullptr;
+}
+
+bool FunctionDefAst::IsPure() const {
+    // the result depends on the buffers' contents, which no cache key covers
+    if (m_decl->HasBuffers()) return false;
+    std::vector<std::string> callees;
+    m_body->CollectCallees(callees);
+    for (auto &callee : callees) {
+        if (callee == m_name || FindMathBuiltin(callee) || g_PureFunctions.count(callee)) continue;
+        return false;
+    }
+    return true;
+}
+
+uint64_t FunctionDefAst::Fingerprint() const {
+    uint64_t hash = llvm::hash_combine(m_name, m_body->Fingerprint());
+    for (size_t i = 0; i < m_decl->Arity(); i++)
+        hash = llvm::hash_combine(hash, m_decl->Args()[i], m_decl->IsBuffer(i));
+    return hash;
+}
+
+llvm::Function *FunctionDefAst::CodeGenSpecialization(const std::string &name,
+                                                      const std::vector<const NumberNode *> &bound) {
+    auto declIt = g_FunctionDecls.find(m_name);
+    if (declIt == g_FunctionDecls.end() || declIt->second->Arity() != bound.size()) return nullptr;
+    const FunctionDeclAst &decl = *declIt->second;
+
+    std::vector<llvm::Type *> argTypes;
+    for (size_t i = 0; i < bound.size(); i++) {
+        if (bound[i] && decl.IsBuffer(i)) return nullptr;
+        if (!bound[i]) AppendParamTypes(decl.IsBuffer(i), argTypes);
+    }
+    llvm::FunctionType *type = llvm::FunctionType::get(llvm::Type::getDoubleTy(*g_Context), argTypes, false);
+    llvm::Function *func = llvm::Function::Create(type, llvm::Function::ExternalLinkage, name, g_Module.get());
+
+    std::vector<std::string> names;
+    std::vector<llvm::Value *> params;
+    llvm::Argument *arg = func->arg_begin();
+    for (size_t i = 0; i < bound.size(); i++) {
+        names.push_back(decl.Args()[i]);
+        if (bound[i]) {
+            params.push_back(llvm::ConstantFP::get(*g_Context, llvm::APFloat(bound[i]->m_number)));
+            continue;
+        }
+        params.push_back(arg);
+        if (decl.IsBuffer(i)) {
+            names.push_back(decl.Args()[i] + ".len");
+            params.push_back(arg + 1);
+        }
+        arg = NameParam(arg, decl.Args()[i], decl.IsBuffer(i));
+    }
+
+    if (!EmitBody(func, names, params)) {
+        func->eraseFromParent();
+        return nullptr;
+    }
+    return func;
+}
+
+// double(double | double *, int64_t ...) as registered for a host function
+llvm::FunctionType *HostFunctionType(llvm::LLVMContext &context, const std::vector<bool> &buffers) {
+    std::vector<llvm::Type *> types;
+    for (bool buffer : buffers) {
+        if (buffer) {
+            types.push_back(llvm::PointerType::getUnqual(context));
+            types.push_back(llvm::Type::getInt64Ty(context));
+        } else {
+            types.push_back(llvm::Type::getDoubleTy(context));
+        }
+    }
+    return llvm::FunctionType::get(llvm::Type::getDoubleTy(context), types, false);
+}
+
+// the bitcode of host function `name`, nullptr unless it defines name with the registered signature
+// and nothing else outside itself
+std::unique_ptr<llvm::Module> ParseHostBitcode(const std::string &name, const HostFunction &host,
+                                               llvm::LLVMContext &context) {
+    auto module = llvm::parseBitcodeFile(llvm::MemoryBufferRef(host.bitcode, name), context);
+    if (!module) {
+        Log("bitcode of host function " + name + ": " + llvm::toString(module.takeError()));
+        return nullptr;
+    }
+    llvm::Function *func = (*module)->getFunction(name);
+    if (!func || func->isDeclaration() || func->getFunctionType() != HostFunctionType(context, host.buffers)) {
+        Log("bitcode of host function " + name + " does not define it with the registered params");
         return nullptr;
     }
+    // the whole module is linked into each caller's, anything else it exports would be defined twice
+    for (llvm::GlobalValue &gv : (*module)->global_values()) {
+        if (&gv == func || gv.isDeclaration() || gv.hasLocalLinkage()) continue;
+        Log("bitcode of host function " + name + " also defines " + gv.getName().str() + ", make it internal");
+        return nullptr;
+    }
+    return std::move(*module);
+}
+
+// Calls to host functions registered with bitcode get the body linked in from it and inlined. The
+// function itself is left a declaration, a call that could not be inlined still goes to the host.
+void InlineHostCalls(llvm::Function *func) {
+    std::vector<llvm::CallInst *> calls;
+    std::set<std::string> helpers;
+    for (auto &block : *func)
+        for (auto &inst : block) {
+            auto *call = llvm::dyn_cast<llvm::CallInst>(&inst);
+            llvm::Function *callee = call ? call->getCalledFunction() : nullptr;
+            if (!callee) continue;
+            auto host = g_HostFunctions.find(callee->getName().str());
+            if (host == g_HostFunctions.end() || host->second.bitcode.empty()) continue;
+            calls.push_back(call);
+            helpers.insert(host->first);
+        }
+    if (calls.empty()) return;
+
+    llvm::Module &module = *func->getParent();
+    for (auto &name : helpers) {
+        std::unique_ptr<llvm::Module> helper = ParseHostBitcode(name, g_HostFunctions[name], module.getContext());
+        if (!helper) continue;
+        helper->setDataLayout(module.getDataLayout());
+        helper->setTargetTriple(module.getTargetTriple());
+        if (llvm::Linker::linkModules(module, std::move(helper))) Log("linking host function " + name + " failed");
+    }
+    for (llvm::CallInst *call : calls) {
+        // the body replaces the call, there is no call left to guarantee as a tail call
+        call->setTailCallKind(llvm::CallInst::TCK_None);
+        llvm::InlineFunctionInfo info;
+        llvm::InlineFunction(*call, info);
+    }
+    for (auto &name : helpers)
+        if (llvm::Function *helper = module.getFunction(name))
+            if (!helper->isDeclaration()) helper->deleteBody();
+}
+
+// bitcode of a copy of func's module that defines func alone
+std::string FunctionBitcode(llvm::Function *func) {
+    llvm::ValueToValueMapTy vmap;
+    std::unique_ptr<llvm::Module> copy =
+            llvm::CloneModule(*func->getParent(), vmap, [func](const llvm::GlobalValue *gv) { return gv == func; });
+    std::string bitcode;
+    llvm::raw_string_ostream os(bitcode);
+    llvm::WriteBitcodeToFile(*copy, os);
+    os.flush();
+    return bitcode;
+}
+
+void OptimizeFunction(llvm::Function *func) {
+    BERNARD_TIME_SCOPE("stage.optimize");
+    CapturedFunction captured;
+    bool capture = g_Capture.Matches(func->getName().str());
+    if (capture) {
+        captured.name = func->getName().str();
+        captured.bitcode = FunctionBitcode(func);
+    }
+    InlineHostCalls(func);
+    g_FuncPassM->run(*func, *g_FuncAnalyM);
+    if (capture) {
+        captured.optimizedBitcode = FunctionBitcode(func);
+        g_Capture.Add(std::move(captured));
+    }
+}
+
+void SetFastMath(bool enable) { g_FastMath = enable; }
+
+void SetFunctionFastMath(const std::string &name, bool enable) { g_FunctionFastMath[name] = enable; }
+
+bool IsFastMath(const std::string &funcName) {
+    auto it = g_FunctionFastMath.find(funcName);
+    return it != g_FunctionFastMath.end() ? it->second : g_FastMath;
+}
+
+llvm::Value *FunctionDefAst::EmitBody(llvm::Function *func, const std::vector<std::string> &names,
+                                      const std::vector<llvm::Value *> &params) {
+    // every FP instruction the builder creates for this body carries these flags
+    if (IsFastMath(m_name)) {
+        g_Builder->setFastMathFlags(llvm::FastMathFlags::getFast());
+        func->addFnAttr("unsafe-fp-math", "true");
+        func->addFnAttr("no-nans-fp-math", "true");
+        func->addFnAttr("no-infs-fp-math", "true");
+        func->addFnAttr("no-signed-zeros-fp-math", "true");
+        func->addFnAttr("approx-func-fp-math", "true");
+    } else {
+        g_Builder->clearFastMathFlags();
+    }
 
     // Create a new basic block to start insertion into.
     llvm::BasicBlock *BB = llvm::BasicBlock::Create(*g_Context, "entry", func);
     g_Builder->SetInsertPoint(BB);
+    if (g_Profile.counters || g_Profile.weights) g_Profile.next = 1;
+    if (g_Profile.counters) CountEvent(g_Builder->getInt64(0));
+    if (g_Profile.weights && !g_Profile.weights->empty())
+        func->setEntryCount((*g_Profile.weights)[0]);
 
     // Record the function arguments in the NamedValues map.
     g_NameValues.clear();
-    for (auto &Arg : func->args()) {
-        g_NameValues[std::string(Arg.getName())] = &Arg;
+    g_SharedValues.clear();
+    std::vector<VarInfo> argKinds(names.size(), VarInfo{ValueKind::DOUBLE, false});
+    g_VarKinds.clear();
+    for (size_t i = 0; i < names.size(); i++) {
+        llvm::AllocaInst *slot = CreateEntryBlockAlloca(func, names[i], params[i]->getType());
+        g_Builder->CreateStore(params[i], slot);
+        g_NameValues[names[i]] = slot;
+        g_VarKinds[names[i]] = &argKinds[i];
+    }
+
+    llvm::Value *retVal;
+    {
+        BERNARD_TIME_SCOPE("stage.infer");
+        m_body->InferKind();
+        m_body->MarkTailPosition();
+    }
+    g_VarKinds.clear();
+    {
+        BERNARD_TIME_SCOPE("stage.codegen");
+        retVal = m_body->CodeGen();
+    }
+    if (!retVal) return nullptr;
+
+    // a call returned as is with a matching prototype can be a guaranteed tail call
+    llvm::CallInst *call = llvm::dyn_cast<llvm::CallInst>(retVal);
+    if (call && call->isTailCall() && call->getParent() == g_Builder->GetInsertBlock() &&
+        call->getFunctionType() == func->getFunctionType())
+        call->setTailCallKind(llvm::CallInst::TCK_MustTail);
+    g_Builder->CreateRet(ToDouble(retVal));
+    return retVal;
+}
+
+llvm::Function *FunctionDefAst::CodeGen(bool optimize) {
+    std::string funcName = m_decl->Name();
+    bool pure = IsPure();
+    // the cache lives in this process, an executor can't reach it
+    bool memoize = pure && g_Memoize && !g_Executors && m_decl->Arity() > 0;
+    g_FunctionDecls[funcName] = std::make_unique<FunctionDeclAst>(*m_decl);
+    g_UserDefinedFunctions.insert(funcName);
+    llvm::Function *func = getFunction(funcName);
+    if (!func) { 
+        printf("get function %s fail\n", funcName.c_str());
+        return nullptr;
+    }
+
+    // memoized, the body goes into name.impl and recursive calls still go through the cache
+    llvm::Function *body = func;
+    if (memoize) {
+        body = llvm::Function::Create(func->getFunctionType(), llvm::Function::InternalLinkage, funcName + ".impl",
+                                      g_Module.get());
+        for (auto &arg : body->args()) arg.setName(func->getArg(arg.getArgNo())->getName());
+    }
+
+    std::vector<std::string> names;
+    std::vector<llvm::Value *> params;
+    for (auto &arg : body->args()) {
+        names.push_back(std::string(arg.getName()));
+        params.push_back(&arg);
+    }
+    // top-level expressions see the host buffers, the executors can't
+    if (funcName == "__anon_expr__" && !g_Executors) {
+        for (auto &buffer : g_HostBuffers) {
+            names.push_back(buffer.first);
+            params.push_back(HostPointer(buffer.second.first));
+            names.push_back(buffer.first + ".len");
+            params.push_back(g_Builder->getInt64(buffer.second.second));
+        }
+    }
+    g_DefVersions[funcName]++;
+    g_CurrentFunction = funcName;
+    if (g_JIT && !g_AheadOfTime) g_JIT->resetCalls(funcName);
+    // counters go into host memory, an executor can't reach them either
+    std::vector<uint64_t> profile;
+    if (g_ProfileInstrument && !g_Executors && funcName != "__anon_expr__") {
+        g_Profile.counters = new llvm::GlobalVariable(*g_Module, g_Builder->getInt64Ty(), false,
+                                                      llvm::GlobalValue::ExternalLinkage, nullptr,
+                                                      funcName + ".counters");
+    } else if (!g_AheadOfTime) {
+        profile = g_ProfileData.Counts(funcName);
+        if (!profile.empty()) g_Profile.weights = &profile;
+    }
+    llvm::Value *retVal = EmitBody(body, names, params);
+    g_CurrentFunction.clear();
+    if (g_Profile.counters) {
+        if (retVal) {
+            std::atomic<uint64_t> *counters = g_ProfileData.Allocate(funcName, g_Profile.next);
+            g_Profile.counters->replaceAllUsesWith(HostPointer(counters));
+        }
+    } else if (g_Profile.weights && g_Profile.next != profile.size()) {
+        StripProfile(*g_Module);
+    }
+    llvm::GlobalVariable *placeholder = g_Profile.counters;
+    g_Profile = ProfileSite();
+    if (retVal) {
+        if (placeholder) placeholder->eraseFromParent();
+        if (pure)
+            g_PureFunctions.insert(funcName);
+        else
+            g_PureFunctions.erase(funcName);
+
+        if (memoize) {
+            g_MemoCacheStore.push_back(std::make_unique<MemoCache>(func->arg_size(), g_MemoCacheEntries));
+            g_MemoCaches[funcName] = g_MemoCacheStore.back().get();
+            EmitMemoWrapper(func, body, g_MemoCaches[funcName]);
+            if (optimize) OptimizeFunction(body);
+        } else {
+            g_MemoCaches.erase(funcName);
+        }
+
+        if (optimize) OptimizeFunction(func);
+        return func;
+    }
+    printf("function body ir generation fail.\n");
+    // Error reading body, remove function.
+    if (body != func) body->eraseFromParent();
+    func->eraseFromParent();
+    if (placeholder) placeholder->eraseFromParent();
+    return nullptr;
+}
+
+void SetSpecialization(bool enable, size_t maxCloneInstructions, size_t totalInstructions) {
+    g_Specialize = enable;
+    g_SpecializeMaxInstructions = maxCloneInstructions;
+    g_SpecializeBudget = totalInstructions;
+}
+
+size_t SpecializationCount() {
+    size_t count = 0;
+    for (auto &entry : g_Specializations)
+        if (!entry.second.empty()) count++;
+    return count;
+}
+
+// points the stub `name` at `impl` wherever generated code runs
+llvm::Error DefineSymbol(const std::string &name, llvm::orc::ThreadSafeModule module, const std::string &impl) {
+    if (g_Executors) return g_Executors->Define(name, std::move(module), impl);
+    return g_JIT->define(name, std::move(module), impl);
+}
+
+// Codegen state for a module compiled on the side, e.g. while the caller's module is half built.
+// Swap parks the caller's state and installs this one, swapping again brings the caller's back and
+// leaves the finished module here.
+struct SideCompilation {
+    std::unique_ptr<llvm::LLVMContext> context = std::make_unique<llvm::LLVMContext>();
+    std::unique_ptr<llvm::Module> module;
+    std::unique_ptr<llvm::IRBuilder<>> builder = std::make_unique<llvm::IRBuilder<>>(*context);
+    std::map<std::string, llvm::AllocaInst *> nameValues;
+    std::string currentFunction;
+    ProfileSite profile;
+    // the caller's shared values point into its own blocks, the side module's die with it
+    std::unordered_map<size_t, SharedValue> sharedValues;
+    uint64_t bindingEpoch = 0;
+
+    SideCompilation(const std::string &moduleName, const std::string &function)
+            : module(CreateModule(moduleName, *context)), currentFunction(function) {
+        Swap();
+    }
+
+    void Swap() {
+        std::swap(g_Context, context);
+        std::swap(g_Module, module);
+        std::swap(g_Builder, builder);
+        std::swap(g_NameValues, nameValues);
+        std::swap(g_CurrentFunction, currentFunction);
+        std::swap(g_Profile, profile);
+        std::swap(g_SharedValues, sharedValues);
+        std::swap(g_BindingEpoch, bindingEpoch);
+    }
+};
+
+// Compiles the current definition of `callee` with `bound` folded in as cloneName.vN and points the
+// stub cloneName at it. Returns the clone's instruction count, 0 when it was not published.
+size_t CompileSpecialization(const std::string &callee, const std::string &cloneName,
+                             const std::vector<const NumberNode *> &bound, size_t maxInstructions) {
+    BERNARD_TIME_SCOPE("stage.specialize");
+    std::string impl = cloneName + ".v" + std::to_string(g_DefVersions[callee]);
+
+    SideCompilation side("bernard spec", callee);
+    g_SpecializeDepth++;
+
+    size_t size = 0;
+    llvm::Function *clone = g_FunctionDefs[callee]->CodeGenSpecialization(impl, bound);
+    if (clone) {
+        OptimizeFunction(clone);
+        g_FuncAnalyM->clear();
+        size = clone->getInstructionCount();
+    }
+
+    g_SpecializeDepth--;
+    side.Swap();
+
+    if (!clone || size > maxInstructions) return 0;
+    if (llvm::Error defined = DefineSymbol(
+                cloneName, llvm::orc::ThreadSafeModule(std::move(side.module), std::move(side.context)), impl)) {
+        Log("specialization " + impl + " failed: " + llvm::toString(std::move(defined)));
+        return 0;
+    }
+    return size;
+}
+
+// Returns the clone of `callee` for the literal arguments in `bound`, compiling it into its own
+// module on first use. nullptr means call the generic definition.
+llvm::Function *Specialize(const std::string &callee, const std::vector<const NumberNode *> &bound) {
+    // clones fold in scalars only, a buffer can't be a literal
+    if (!g_Specialize || !g_FunctionDefs.count(callee) || callee == g_CurrentFunction ||
+        g_MemoCaches.count(callee) || g_SpecializeDepth >= 2 || g_FunctionDecls[callee]->HasBuffers())
+        return nullptr;
+
+    std::string key = callee;
+    for (auto *constant : bound) {
+        if (constant) {
+            uint64_t bits;
+            std::memcpy(&bits, &constant->m_number, sizeof(bits));
+            key += ":" + std::to_string(bits);
+        } else {
+            key += ":_";
+        }
+    }
+
+    auto cached = g_Specializations.find(key);
+    if (cached == g_Specializations.end()) {
+        if (!g_SpecializeBudget) return nullptr;
+        std::string name = callee + ".spec." + std::to_string(g_Specializations.size());
+        size_t size = CompileSpecialization(callee, name, bound,
+                                            std::min(g_SpecializeMaxInstructions, g_SpecializeBudget));
+        if (size) {
+            g_SpecializeBudget -= size;
+            SpecializedClone &rebuild = g_SpecializedClones[name];
+            rebuild.callee = callee;
+            for (auto *constant : bound)
+                rebuild.bound.push_back(constant ? std::make_unique<NumberNode>(*constant) : nullptr);
+            BERNARD_COUNT("specialize.clones", 1);
+        } else {
+            name.clear();
+            BERNARD_COUNT("specialize.rejected", 1);
+        }
+        cached = g_Specializations.emplace(key, name).first;
+    }
+    if (cached->second.empty()) return nullptr;
+
+    if (llvm::Function *func = g_Module->getFunction(cached->second)) return func;
+    std::vector<llvm::Type *> argTypes;
+    for (auto *constant : bound)
+        if (!constant) argTypes.push_back(llvm::Type::getDoubleTy(*g_Context));
+    llvm::FunctionType *type = llvm::FunctionType::get(llvm::Type::getDoubleTy(*g_Context), argTypes, false);
+    return llvm::Function::Create(type, llvm::Function::ExternalLinkage, cached->second, g_Module.get());
+}
+
+// Callers reach clones through their stubs, so a redefinition rebuilds every clone against the new
+// body instead of dropping it. Clones rejected for the old body get another chance.
+void Respecialize(const std::string &callee) {
+    for (auto it = g_Specializations.begin(); it != g_Specializations.end();) {
+        if (it->second.empty() && it->first.compare(0, callee.size() + 1, callee + ":") == 0)
+            it = g_Specializations.erase(it);
+        else
+            ++it;
+    }
+    for (auto &entry : g_SpecializedClones) {
+        if (entry.second.callee != callee) continue;
+        std::vector<const NumberNode *> bound;
+        for (auto &constant : entry.second.bound) bound.push_back(constant.get());
+        // a clone that no longer builds keeps running the previous body
+        if (!CompileSpecialization(callee, entry.first, bound, SIZE_MAX))
+            Log("could not respecialize " + entry.first);
+    }
+}
+
+// call graph for speculative compilation, the JIT ignores callees it did not define
+void RecordCall(llvm::Function *callee) {
+    if (g_JIT && !g_AheadOfTime && !g_CurrentFunction.empty()) g_JIT->recordCall(g_CurrentFunction, callee->getName());
+}
+
+// Recompiles def `name` without counters, with the counts collected for it as branch weights and
+// entry count. false when there is nothing to go on.
+bool Reoptimize(const std::string &name) {
+    BERNARD_TIME_SCOPE("stage.reoptimize");
+    auto def = g_FunctionDefs.find(name);
+    std::vector<uint64_t> counts = g_ProfileData.Counts(name);
+    // the memo wrapper is only built by a full definition
+    if (def == g_FunctionDefs.end() || counts.empty() || g_MemoCaches.count(name)) return false;
+    g_ProfileData.Freeze(name);
+    std::string impl = name + ".v" + std::to_string(++g_DefVersions[name]);
+
+    SideCompilation side("bernard pgo", name);
+    g_Profile.weights = &counts;
+    if (g_JIT) g_JIT->resetCalls(name);
+    std::vector<const NumberNode *> unbound(g_FunctionDecls[name]->Arity(), nullptr);
+    llvm::Function *func = def->second->CodeGenSpecialization(impl, unbound);
+    if (func) {
+        if (g_Profile.next != counts.size()) StripProfile(*g_Module);
+        OptimizeFunction(func);
+        g_FuncAnalyM->clear();
+    }
+    side.Swap();
+
+    if (!func) return false;
+    if (llvm::Error defined = DefineSymbol(
+                name, llvm::orc::ThreadSafeModule(std::move(side.module), std::move(side.context)), impl)) {
+        Log("reoptimize " + impl + " failed: " + llvm::toString(std::move(defined)));
+        return false;
+    }
+    return true;
+}
+
+llvm::Value *FunctionCallNode::CodeGen() { return CodeGenCall(m_isTail); }
+
+llvm::Value *FunctionCallNode::CodeGenCall(bool tail) {
+    if (IsLength()) {
+        const std::string &name = static_cast<VariableNode *>(m_args[0].get())->Name();
+        llvm::AllocaInst *ptr, *len;
+        if (!FindBuffer(name, &ptr, &len)) {
+            Log("len expects a buffer, " + name + " is not one");
+            return nullptr;
+        }
+        return g_Builder->CreateLoad(len->getAllocatedType(), len, name + ".len");
     }
 
-    llvm::Value *retVal = m_body->CodeGen();
-    if (retVal) {
-        g_Builder->CreateRet(retVal);
-
-        g_FuncPassM->run(*func, *g_FuncAnalyM);
-        return func;
+    if (const MathBuiltin *builtin = FindMathBuiltin(m_callee)) {
+        if (builtin->arity != m_args.size()) {
+            Log("Incorrect # arguments passed to " + m_callee);
+            return nullptr;
+        }
+        std::vector<llvm::Value *> args;
+        for (auto &arg : m_args) {
+            llvm::Value *val = arg->CodeGen();
+            if (!val) return nullptr;
+            args.push_back(ToDouble(val));
+        }
+        return g_Builder->CreateIntrinsic(builtin->id, {llvm::Type::getDoubleTy(*g_Context)}, args, nullptr,
+                                          "calltmp");
     }
-    printf("function body ir generation fail.\n");
-    // Error reading body, remove function.
-    func->eraseFromParent();
-    return nullptr;
-}
 
-llvm::Value *FunctionCallNode::CodeGen() {
-    // Look up the name in the global module table.
-    llvm::Function *CalleeF = g_Module->getFunction(m_callee);
+    // Look up the name in the current module, or declare it from a prototype seen earlier.
+    llvm::Function *CalleeF = getFunction(m_callee);
     if (!CalleeF) {
-        printf("Unknown function %s referenced\n", m_callee.c_str());
+        Log("Unknown function " + m_callee + " referenced");
         return nullptr;
     }
 
-    // If argument mismatch error.
-    if (CalleeF->arg_size() != m_args.size()) {
-        printf("Incorrect # arguments passed\n");
+    // a buffer param takes two arguments, count what was declared
+    auto declIt = g_FunctionDecls.find(m_callee);
+    const FunctionDeclAst *decl = declIt != g_FunctionDecls.end() ? declIt->second.get() : nullptr;
+    if ((decl ? decl->Arity() : CalleeF->arg_size()) != m_args.size()) {
+        Log("Incorrect # arguments passed to " + m_callee);
         return nullptr;
     }
 
+    if (g_Specialize) {
+        std::vector<const NumberNode *> bound;
+        bool anyBound = false;
+        for (auto &arg : m_args) {
+            bound.push_back(dynamic_cast<const NumberNode *>(arg.get()));
+            anyBound |= bound.back() != nullptr;
+        }
+        if (llvm::Function *clone = anyBound ? Specialize(m_callee, bound) : nullptr) {
+            std::vector<llvm::Value *> args;
+            for (size_t i = 0; i < m_args.size(); i++) {
+                if (bound[i]) continue;
+                llvm::Value *arg = m_args[i]->CodeGen();
+                if (!arg) return nullptr;
+                args.push_back(ToDouble(arg));
+            }
+            RecordCall(clone);
+            llvm::CallInst *call = g_Builder->CreateCall(clone, args, "spectmp");
+            if (tail) call->setTailCall(true);
+            return call;
+        }
+    }
+
     std::vector<llvm::Value *> ArgsV;
+    std::set<std::string> buffers;
     for (unsigned i = 0, e = m_args.size(); i != e; ++i) {
-        ArgsV.push_back(m_args[i]->CodeGen());
-        if (!ArgsV.back()) return nullptr;
+        if (decl && decl->IsBuffer(i)) {
+            // buffer params are noalias, so one buffer can't be passed twice
+            auto *var = dynamic_cast<VariableNode *>(m_args[i].get());
+            llvm::AllocaInst *ptr, *len;
+            if (!var || !FindBuffer(var->Name(), &ptr, &len) || !buffers.insert(var->Name()).second) {
+                Log("argument " + std::to_string(i + 1) + " of " + m_callee + " must be a buffer not passed yet");
+                return nullptr;
+            }
+            ArgsV.push_back(g_Builder->CreateLoad(ptr->getAllocatedType(), ptr, var->Name()));
+            ArgsV.push_back(g_Builder->CreateLoad(len->getAllocatedType(), len, var->Name() + ".len"));
+            continue;
+        }
+        llvm::Value *arg = m_args[i]->CodeGen();
+        if (!arg) return nullptr;
+        ArgsV.push_back(ConvertTo(arg, CalleeF->getArg(ArgsV.size())->getType()));
     }
 
-    return g_Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+    RecordCall(CalleeF);
+    llvm::CallInst *call = g_Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+    // locals never escape, so no call can see the caller's frame and every call in tail position may be tail
+    if (tail) call->setTailCall(true);
+    return call;
+}
+
+bool IsPureCallee(const std::string &name) { return FindMathBuiltin(name) || g_PureFunctions.count(name); }
+
+llvm::Value *SharedNode::CodeGen() {
+    if (m_isTail)
+        if (auto *call = dynamic_cast<FunctionCallNode *>(m_node.get())) return call->CodeGenCall(true);
+
+    // the callees were pure when this was parsed, a stored AST may outlive that
+    std::vector<std::string> callees;
+    m_node->CollectCallees(callees);
+    bool reusable = std::all_of(callees.begin(), callees.end(), IsPureCallee);
+    auto cached = g_SharedValues.find(m_id);
+    if (reusable && cached != g_SharedValues.end() && cached->second.block == g_Builder->GetInsertBlock() &&
+        cached->second.epoch == g_BindingEpoch) {
+        g_SharingStats.reused++;
+        BERNARD_COUNT("hashcons.reused", 1);
+        return cached->second.value;
+    }
+    llvm::Value *val = m_node->CodeGen();
+    if (val && reusable) g_SharedValues[m_id] = SharedValue{val, g_Builder->GetInsertBlock(), g_BindingEpoch};
+    return val;
 }
 
 template <typename T>
@@ -349,6 +1816,70 @@ int Calc(ExprTree *root) {
     return Sum(val1, val2, root->m_val[0]);
 }
 
+// structure of a child for hash-consing, leaves by value and shared nodes by id, empty when it can't be shared
+std::string InternKey(const ExprNode &node) {
+    if (auto *shared = dynamic_cast<const SharedNode *>(&node)) return "#" + std::to_string(shared->Id());
+    if (auto *number = dynamic_cast<const NumberNode *>(&node)) {
+        uint64_t bits;
+        std::memcpy(&bits, &number->m_number, sizeof(bits));
+        return (number->m_isInt ? "i" : "d") + std::to_string(bits);
+    }
+    if (auto *var = dynamic_cast<const VariableNode *>(&node)) return "v" + var->Name();
+    return "";
+}
+
+// Returns a SharedNode for node, the one built for an equal node earlier in the compilation unit if
+// there is one. Only binary operations and calls to pure functions over leaves and shared nodes are
+// shared, anything else is returned as is.
+std::unique_ptr<ExprNode> Intern(std::unique_ptr<ExprNode> node) {
+    if (!node || !g_HashCons) return node;
+    std::string key;
+    if (auto *op = dynamic_cast<BinaryOpNode *>(node.get())) {
+        std::string lhs = InternKey(*op->mp_lhs), rhs = InternKey(*op->mp_rhs);
+        if (op->m_op == '=' || lhs.empty() || rhs.empty()) return node;
+        key = std::string(1, op->m_op) + "(" + lhs + "," + rhs + ")";
+    } else if (auto *call = dynamic_cast<FunctionCallNode *>(node.get())) {
+        if (!IsPureCallee(call->Callee())) return node;
+        key = "c" + call->Callee() + "(";
+        for (auto &arg : call->Args()) {
+            std::string argKey = InternKey(*arg);
+            if (argKey.empty()) return node;
+            key += argKey + ",";
+        }
+        key += ")";
+    } else {
+        return node;
+    }
+
+    auto interned = g_Interned.find(key);
+    if (interned != g_Interned.end()) {
+        g_SharingStats.shared++;
+        BERNARD_COUNT("hashcons.shared", 1);
+        return std::make_unique<SharedNode>(interned->second);
+    }
+    g_SharingStats.nodes++;
+    BERNARD_COUNT("hashcons.nodes", 1);
+    interned = g_Interned.emplace(key, SharedNode(std::shared_ptr<ExprNode>(std::move(node)), g_NextInternId++)).first;
+    return std::make_unique<SharedNode>(interned->second);
+}
+
+// a copy of a child of a shared node, those are leaves or shared nodes themselves
+std::unique_ptr<ExprNode> CopySharedChild(const ExprNode &child) {
+    if (auto *shared = dynamic_cast<const SharedNode *>(&child)) return std::make_unique<SharedNode>(*shared);
+    if (auto *number = dynamic_cast<const NumberNode *>(&child)) return std::make_unique<NumberNode>(*number);
+    return std::make_unique<VariableNode>(static_cast<const VariableNode &>(child).Name());
+}
+
+// a script compiles as one unit, subexpressions are shared within it
+void BeginCompilationUnit() { g_Interned.clear(); }
+
+void SetHashConsing(bool enable) {
+    g_HashCons = enable;
+    g_Interned.clear();
+}
+
+const SharingStats &GetSharingStats() { return g_SharingStats; }
+
 std::unique_ptr<ExprNode> ParsePrimary(const Scanner &scanner);
 std::unique_ptr<ExprNode> term2(std::unique_ptr<ExprNode> &left, const Scanner &scan);
 
@@ -369,18 +1900,20 @@ std::unique_ptr<ExprNode> term2(std::unique_ptr<ExprNode> &left, const Scanner &
     std::unique_ptr<ExprNode> right = ParsePrimary(scan);
     op2 = scan.CurToken();
     if (op2.m_type == TokenType::Eof || Precedence(op1.m_val[0]) >= Precedence(op2.m_val[0])) {
-        std::unique_ptr<ExprNode> node = std::make_unique<BinaryOpNode>(BinaryOpNode(op1.m_val[0], left, right));
+        std::unique_ptr<ExprNode> node = Intern(std::make_unique<BinaryOpNode>(BinaryOpNode(op1.m_val[0], left, right)));
         return term2(node, scan);
     } else {
         right = term2(right, scan);
-        return std::make_unique<BinaryOpNode>(op1.m_val[0], left, right);
+        return Intern(std::make_unique<BinaryOpNode>(op1.m_val[0], left, right));
     }
 }
 
 std::unique_ptr<NumberNode> ParseNumber(const Scanner &scanner) {
     Token word = scanner.CurToken();
     scanner.NextToken();
-    return std::unique_ptr<NumberNode>(new NumberNode(std::stod(word.m_val)));
+    double num = std::stod(word.m_val);
+    bool isInt = word.m_val.find('.') == std::string::npos && num <= 9007199254740992.0;
+    return std::unique_ptr<NumberNode>(new NumberNode(num, isInt));
 }
 
 
@@ -411,7 +1944,7 @@ std::unique_ptr<ConditionNode> ParseIf(const Scanner &scanner) {
     return std::make_unique<ConditionNode>(cond, then, elsePart);
 }
 
-std::unique_ptr<ExprNode> ParseForLoop(const Scanner &scan) {
+std::unique_ptr<ExprNode> ParseForLoop(const Scanner &scan, bool parallel = false) {
     scan.NextToken();
 
     if (scan.CurToken().m_type != TokenType::VAR) {
@@ -457,7 +1990,64 @@ std::unique_ptr<ExprNode> ParseForLoop(const Scanner &scan) {
     std::unique_ptr<ExprNode> body = ParseExpression(scan);
     if (!body) return nullptr;
 
-    return std::make_unique<ForLoopNode>(varName, std::move(start), std::move(end), std::move(step), std::move(body));
+    if (!parallel)
+        return std::make_unique<ForLoopNode>(varName, std::move(start), std::move(end), std::move(step),
+                                             std::move(body));
+
+    // the trip count has to be known up front, so the end condition must be var < bound
+    auto *shared = dynamic_cast<SharedNode *>(end.get());
+    auto *cond = dynamic_cast<BinaryOpNode *>(shared ? shared->Node() : end.get());
+    auto *var = cond ? dynamic_cast<VariableNode *>(cond->mp_lhs.get()) : nullptr;
+    if (!var || cond->m_op != gLess || var->Name() != varName) {
+        Log("parallel for expects " + varName + " < bound");
+        return nullptr;
+    }
+    // a shared condition has other uses, its bound is copied rather than taken
+    std::unique_ptr<ExprNode> bound = shared ? CopySharedChild(*cond->mp_rhs) : std::move(cond->mp_rhs);
+    return std::make_unique<ParallelForNode>(varName, std::move(start), std::move(bound), std::move(step),
+                                             std::move(body));
+}
+
+std::unique_ptr<ExprNode> ParseVarExpr(const Scanner &scan) {
+    scan.NextToken();
+
+    std::vector<std::pair<std::string, std::unique_ptr<ExprNode>>> vars;
+    if (scan.CurToken().m_type != TokenType::VAR) {
+        Log("Expect variable name after var");
+        return nullptr;
+    }
+
+    while (true) {
+        std::string name = scan.CurToken().m_val;
+        scan.NextToken();
+
+        std::unique_ptr<ExprNode> init;
+        if (scan.CurToken().m_val == "=") {
+            scan.NextToken();
+            init = ParseExpression(scan);
+            if (!init) return nullptr;
+        }
+        vars.push_back(std::make_pair(name, std::move(init)));
+
+        if (scan.CurToken().m_val != ",") break;
+        scan.NextToken();
+
+        if (scan.CurToken().m_type != TokenType::VAR) {
+            Log("Expect variable name list after var");
+            return nullptr;
+        }
+    }
+
+    if (scan.CurToken().m_type != TokenType::IN) {
+        Log("Expect in after var.");
+        return nullptr;
+    }
+    scan.NextToken();
+
+    std::unique_ptr<ExprNode> body = ParseExpression(scan);
+    if (!body) return nullptr;
+
+    return std::make_unique<VarExprNode>(std::move(vars), std::move(body));
 }
 
 std::unique_ptr<ExprNode> ParseParentheses(const Scanner &scanner) {
@@ -478,6 +2068,18 @@ std::unique_ptr<ExprNode> ParseIdentifier(const Scanner &scanner) {
     scanner.NextToken();
     word = scanner.CurToken();
 
+    if (word.m_type == TokenType::LEFT_BRACKET) {
+        scanner.NextToken();
+        std::unique_ptr<ExprNode> index = ParseExpression(scanner);
+        if (!index) return nullptr;
+        if (scanner.CurToken().m_type != TokenType::RIGHT_BRACKET) {
+            Log("Expect ] after index");
+            return nullptr;
+        }
+        scanner.NextToken();
+        return std::make_unique<IndexNode>(name, std::move(index));
+    }
+
     // not function call
     if (word.m_type != TokenType::LEFT_PARENT) return std::make_unique<VariableNode>(name);
 
@@ -504,7 +2106,7 @@ std::unique_ptr<ExprNode> ParseIdentifier(const Scanner &scanner) {
     }
 
     scanner.NextToken();
-    return std::make_unique<FunctionCallNode>(name, std::move(args));
+    return Intern(std::make_unique<FunctionCallNode>(name, std::move(args)));
 }
 
 std::unique_ptr<ExprNode> ParsePrimary(const Scanner &scanner) {
@@ -517,8 +2119,16 @@ std::unique_ptr<ExprNode> ParsePrimary(const Scanner &scanner) {
             return ParseParentheses(scanner);
         case TokenType::FOR:
             return ParseForLoop(scanner);
+        case TokenType::PARALLEL:
+            if (scanner.NextToken().m_type != TokenType::FOR) {
+                Log("Expect for after parallel");
+                return nullptr;
+            }
+            return ParseForLoop(scanner, true);
         case TokenType::IF:
             return ParseIf(scanner);
+        case TokenType::VAR_DECL:
+            return ParseVarExpr(scanner);
         default:
             Log("unknown token");
             return nullptr;
@@ -538,11 +2148,20 @@ std::unique_ptr<FunctionDeclAst> ParseFunctionDecl(const Scanner &scanner) {
         return nullptr;
     }
     std::vector<std::string> argNames;
+    std::vector<bool> buffers;
 
     auto tok = scanner.NextToken();
     while (tok.m_type == TokenType::VAR) {
         argNames.push_back(tok.m_val);
         tok = scanner.NextToken();
+        buffers.push_back(tok.m_type == TokenType::LEFT_BRACKET);
+        if (buffers.back()) {
+            if (scanner.NextToken().m_type != TokenType::RIGHT_BRACKET) {
+                Log("Expect ] in buffer param.");
+                return nullptr;
+            }
+            tok = scanner.NextToken();
+        }
     }
 
     if (tok.m_type != TokenType::RIGHT_PARENT) {
@@ -551,7 +2170,7 @@ std::unique_ptr<FunctionDeclAst> ParseFunctionDecl(const Scanner &scanner) {
     }
 
     scanner.NextToken();
-    return std::make_unique<FunctionDeclAst>(fnName, argNames);
+    return std::make_unique<FunctionDeclAst>(fnName, argNames, buffers);
 }
 
 std::unique_ptr<FunctionDefAst> ParseFunctionDef(const Scanner &scanner) {
@@ -579,60 +2198,368 @@ std::unique_ptr<FunctionDefAst> ParseTopLevelExpr(const Scanner &scanner) {
     return std::make_unique<FunctionDefAst>(std::move(anonymous), expr);
 }
 
-void HandleExtern(const Scanner &scanner) {
-    if (std::unique_ptr<FunctionDeclAst> func = ParseExtern(scanner)) {
+bool HandleExtern(const Scanner &scanner) {
+    BERNARD_TIME_SCOPE("handle.extern");
+    std::unique_ptr<FunctionDeclAst> func;
+    {
+        BERNARD_TIME_SCOPE("stage.parse");
+        func = ParseExtern(scanner);
+    }
+    if (func) {
+        auto host = g_HostFunctions.find(func->Name());
+        if (host != g_HostFunctions.end() && host->second.buffers != func->Buffers()) {
+            Log("extern " + func->Name() + " does not match the params of the registered host function");
+            return false;
+        }
+        // only inlined calls reach it from an executor, a call left in the code could not be linked
+        if (host != g_HostFunctions.end() && g_Executors && !host->second.runtime && host->second.bitcode.empty()) {
+            Log("extern " + func->Name() + " is a host function without bitcode, executors can't call it");
+            return false;
+        }
         llvm::Function *ir = func->CodeGen();
         if (!ir) {
-            return;
+            return false;
         }
-        ir->print(llvm::errs());
+        if (!g_Quiet) ir->print(llvm::errs());
         g_FunctionDecls[func->Name()] = std::move(func);
-    } else
-        scanner.NextToken();
+        return true;
+    }
+    scanner.NextToken();
+    return false;
 }
 
-void HandleFunctionDef(const Scanner &scanner) {
-    std::unique_ptr<FunctionDefAst> funcDef = ParseFunctionDef(scanner);
-    if (funcDef) {
-        llvm::Function *funcDefIR = funcDef->CodeGen();
-        if (!funcDefIR) {
-            printf("func definition IR generate error.\n");
-            return;
+// a def compiles to the same code as long as its AST and the settings it is compiled under are the same
+uint64_t DefFingerprint(const FunctionDefAst &funcDef) {
+    return llvm::hash_combine(funcDef.Fingerprint(), IsFastMath(funcDef.Name()), g_Memoize, g_MemoCacheEntries,
+                              g_Specialize, g_ProfileInstrument);
+}
+
+// what callers of `name` were compiled against besides its stub: which params are buffers, one flag per
+// param, and, for memoization, purity
+std::pair<std::vector<bool>, bool> DefSignature(const std::string &name) {
+    auto decl = g_FunctionDecls.find(name);
+    return {decl != g_FunctionDecls.end() ? decl->second->Buffers() : std::vector<bool>(),
+            g_PureFunctions.count(name) > 0};
+}
+
+// compiles funcDef, points its stub at the new code and records its fingerprint and callees
+bool DefineFunction(FunctionDefAst &funcDef) {
+    llvm::Function *funcDefIR = funcDef.CodeGen();
+    if (!funcDefIR) {
+        printf("func definition IR generate error.\n");
+        return false;
+    }
+    // callers go through the stub `name`, this version's code is name.vN under its own tracker
+    std::string name = funcDef.Name();
+    std::string impl = name + ".v" + std::to_string(g_DefVersions[name]);
+    funcDefIR->setName(impl);
+    if (!g_Quiet) funcDefIR->print(llvm::errs());
+    llvm::Error defined = llvm::Error::success();
+    {
+        BERNARD_TIME_SCOPE("stage.add_module");
+        defined = DefineSymbol(name, llvm::orc::ThreadSafeModule(std::move(g_Module), std::move(g_Context)), impl);
+    }
+    InitLLVMOpt();
+    if (defined) {
+        Log("define " + name + " failed: " + llvm::toString(std::move(defined)));
+        return false;
+    }
+
+    g_DefFingerprints[name] = DefFingerprint(funcDef);
+    std::vector<std::string> callees;
+    funcDef.CollectCallees(callees);
+    for (auto &callee : g_Callees[name]) g_Callers[callee].erase(name);
+    g_Callees[name] = std::set<std::string>(callees.begin(), callees.end());
+    for (auto &callee : g_Callees[name]) g_Callers[callee].insert(name);
+    return true;
+}
+
+// Defs to rebuild while reloading a script. fresh holds the ones compiled since generated code last
+// ran, their memo caches can't hold anything stale yet.
+struct Reload {
+    std::set<std::string> dirty;
+    std::set<std::string> fresh;
+    size_t compiled = 0;
+};
+
+// Marks the callers that depend on more than the stub of `name`: all of them when the signature they
+// were compiled against changed, otherwise the memoized ones, their caches hold results of the old body.
+void InvalidateCallers(const std::string &name, bool signatureChanged, Reload &reload) {
+    for (auto &caller : g_Callers[name]) {
+        if (caller == name || !g_FunctionDefs.count(caller)) continue;
+        if (signatureChanged || (g_MemoCaches.count(caller) && !reload.fresh.count(caller)))
+            reload.dirty.insert(caller);
+    }
+}
+
+// bookkeeping after `name` was compiled during a reload, signature is the one it had before
+void Reloaded(const std::string &name, const std::pair<std::vector<bool>, bool> &signature, Reload &reload) {
+    Respecialize(name);
+    reload.compiled++;
+    reload.dirty.erase(name);
+    reload.fresh.insert(name);
+    InvalidateCallers(name, DefSignature(name) != signature, reload);
+}
+
+// rebuilds the dirty defs from their stored ASTs, and whatever that invalidates in turn
+void RebuildDependents(Reload &reload) {
+    BERNARD_TIME_SCOPE("stage.rebuild_dependents");
+    while (!reload.dirty.empty()) {
+        std::string name = *reload.dirty.begin();
+        reload.dirty.erase(reload.dirty.begin());
+        std::pair<std::vector<bool>, bool> signature = DefSignature(name);
+        if (!DefineFunction(*g_FunctionDefs[name])) {
+            // keeps running the previous version, compiled against the old callee
+            Log("could not rebuild " + name + " against its changed callees");
+            continue;
         }
-        funcDefIR->print(llvm::errs());
-        err(g_JIT->addModule(llvm::orc::ThreadSafeModule(std::move(g_Module), std::move(g_Context))));
-        InitLLVMOpt();
-    } else
+        Reloaded(name, signature, reload);
+    }
+}
+
+// A caller compiled against other params would pass its arguments the old way, a redefinition that
+// changes them is only taken while no def calls it.
+bool ParamsChangeUnderCallers(const FunctionDefAst &funcDef) {
+    auto known = g_FunctionDecls.find(funcDef.Name());
+    if (known == g_FunctionDecls.end() || known->second->Buffers() == funcDef.Decl().Buffers()) return false;
+    for (auto &caller : g_Callers[funcDef.Name()]) {
+        if (caller == funcDef.Name() || !g_FunctionDefs.count(caller)) continue;
+        Log("redefinition of " + funcDef.Name() + " changes its params, " + caller + " calls it with the old ones");
+        return true;
+    }
+    return false;
+}
+
+bool HandleFunctionDef(const Scanner &scanner) {
+    BERNARD_TIME_SCOPE("handle.function_def");
+    std::unique_ptr<FunctionDefAst> funcDef;
+    {
+        BERNARD_TIME_SCOPE("stage.parse");
+        funcDef = ParseFunctionDef(scanner);
+    }
+    if (funcDef) {
+        if (ParamsChangeUnderCallers(*funcDef)) return false;
+        std::string name = funcDef->Name();
+        std::pair<std::vector<bool>, bool> signature = DefSignature(name);
+        if (!DefineFunction(*funcDef)) return false;
+        g_FunctionDefs[name] = std::move(funcDef);
+        // memoized callers cache results of the old body, callers of a def that changed its purity
+        // were compiled for the old one
+        Reload reload;
+        Reloaded(name, signature, reload);
+        RebuildDependents(reload);
+        return true;
+    }
+    scanner.NextToken();
+    return false;
+}
+
+void ReloadFunctionDef(const Scanner &scanner, Reload &reload) {
+    BERNARD_TIME_SCOPE("handle.reload_def");
+    std::unique_ptr<FunctionDefAst> funcDef;
+    {
+        BERNARD_TIME_SCOPE("stage.parse");
+        funcDef = ParseFunctionDef(scanner);
+    }
+    if (!funcDef) {
         scanner.NextToken();
+        return;
+    }
+    std::string name = funcDef->Name();
+    auto known = g_DefFingerprints.find(name);
+    if (known != g_DefFingerprints.end() && known->second == DefFingerprint(*funcDef)) {
+        BERNARD_COUNT("reload.unchanged", 1);
+        return;
+    }
+    std::pair<std::vector<bool>, bool> signature = DefSignature(name);
+    if (!DefineFunction(*funcDef)) return;
+    g_FunctionDefs[name] = std::move(funcDef);
+    Reloaded(name, signature, reload);
 }
 
-void HandleTopLevelExpr(const Scanner &scanner) {
-    std::unique_ptr<FunctionDefAst> fn = ParseTopLevelExpr(scanner);
+bool HandleTopLevelExpr(const Scanner &scanner) {
+    BERNARD_TIME_SCOPE("handle.top_level_expr");
+    std::unique_ptr<FunctionDefAst> fn;
+    {
+        BERNARD_TIME_SCOPE("stage.parse");
+        fn = ParseTopLevelExpr(scanner);
+    }
     if (fn) {
         llvm::Function *funcIR = fn->CodeGen();
-        if (!funcIR) return;
+        if (!funcIR) return false;
+        // the module is gone once the JIT has compiled it, print it while we still own it
+        if (!g_Quiet) {
+            funcIR->print(llvm::errs());
+            fprintf(stderr, "\n");
+        }
+
+        if (g_Executors) {
+            auto thrSafeModule = llvm::orc::ThreadSafeModule(std::move(g_Module), std::move(g_Context));
+            InitLLVMOpt();
+            llvm::Expected<double> result = g_Executors->Run(std::move(thrSafeModule), "__anon_expr__");
+            if (!result) {
+                Log("evaluation failed: " + llvm::toString(result.takeError()));
+                return false;
+            }
+            if (!g_Quiet) fprintf(stderr, "Evaluated to %f\n", *result);
+            g_LastResult = *result;
+            return true;
+        }
+
         auto tracker = g_JIT->getMainJITDylib().createResourceTracker();
         auto thrSafeModule = llvm::orc::ThreadSafeModule(std::move(g_Module), std::move(g_Context));
-        err(g_JIT->addModule(std::move(thrSafeModule), tracker));
+        llvm::Error added = llvm::Error::success();
+        {
+            BERNARD_TIME_SCOPE("stage.add_module");
+            added = g_JIT->addModule(std::move(thrSafeModule), tracker);
+        }
 
         InitLLVMOpt();
+        if (added) {
+            Log("evaluation failed: " + llvm::toString(std::move(added)));
+            return false;
+        }
 
-        auto ExprSymbol = err(g_JIT->lookup("__anon_expr"));
+        // the callees may compile in the background while the expression itself does
+        g_JIT->speculateCallees("__anon_expr__");
+        g_JIT->noteUse("__anon_expr__");
+
+        // materialization happens here, addModule only registers the module
+        llvm::Expected<llvm::orc::ExecutorSymbolDef> ExprSymbol = [] {
+            BERNARD_TIME_SCOPE("stage.lookup");
+            return g_JIT->lookup("__anon_expr__");
+        }();
+        // a call to an extern nobody defines fails here, that must not take the process down
+        if (!ExprSymbol) {
+            Log("evaluation failed: " + llvm::toString(ExprSymbol.takeError()));
+            err(tracker->remove());
+            return false;
+        }
 
         // Get the symbol's address and cast it to the right type (takes no
         // arguments, returns a double) so we can call it as a native function.
-        double (*FP)() = ExprSymbol.getAddress().toPtr<double (*)()>();
-        fprintf(stderr, "Evaluated to %f\n", FP());
-
-        funcIR->print(llvm::errs());
-        fprintf(stderr, "\n");
+        double (*FP)() = ExprSymbol->getAddress().toPtr<double (*)()>();
+        double result;
+        {
+            BERNARD_TIME_SCOPE("stage.execute");
+            g_JIT->enterCall();
+            result = FP();
+            err(g_JIT->exitCall());
+        }
+        if (!g_Quiet) fprintf(stderr, "Evaluated to %f\n", result);
+        g_LastResult = result;
 
         err(tracker->remove());
-    } else
+        if (g_ProfileWarmup)
+            for (auto &name : g_ProfileData.Warm(g_ProfileWarmup)) Reoptimize(name);
+        return true;
+    }
+    scanner.NextToken();
+    return false;
+}
+
+ExprBatch::~ExprBatch() {
+    for (auto &tracker : m_trackers) err(tracker->remove());
+}
+
+double ExprBatch::Run(size_t i) const {
+    BERNARD_TIME_SCOPE("stage.execute");
+    g_JIT->enterCall();
+    double result = m_entries[i]();
+    err(g_JIT->exitCall());
+    return result;
+}
+
+// Compiles the expressions `which` of sources into one module under a tracker of their own and
+// looks them up. Returns the ones that compiled but could not be looked up, every lookup fails
+// when the module fails to materialize.
+std::vector<size_t> CompileBatchModule(const std::vector<std::string> &sources, const std::vector<size_t> &which,
+                                       const std::string &prefix, ExprBatch &batch) {
+    BeginCompilationUnit();
+    std::vector<size_t> compiled;
+    for (size_t i : which) {
+        Scanner scanner(sources[i]);
         scanner.NextToken();
+        std::unique_ptr<FunctionDefAst> expr = ParseTopLevelExpr(scanner);
+        while (scanner.CurToken().m_type == TokenType::SEMICOLON) scanner.NextToken();
+        // unknown characters also scan as Eof, but with a value
+        if (!expr || scanner.CurToken().m_type != TokenType::Eof || !scanner.CurToken().m_val.empty()) {
+            batch.m_errors[i] = "expected one expression";
+            continue;
+        }
+        llvm::Function *func = expr->CodeGen();
+        if (!func) {
+            batch.m_errors[i] = "codegen failed";
+            continue;
+        }
+        g_JIT->noteUse("__anon_expr__");
+        // every expression comes out as __anon_expr__, give it a name of its own in the shared module
+        func->setName(prefix + std::to_string(i));
+        compiled.push_back(i);
+    }
+
+    llvm::orc::ResourceTrackerSP tracker = g_JIT->getMainJITDylib().createResourceTracker();
+    llvm::Error added = llvm::Error::success();
+    {
+        BERNARD_TIME_SCOPE("stage.add_module");
+        added = g_JIT->addModule(llvm::orc::ThreadSafeModule(std::move(g_Module), std::move(g_Context)), tracker);
+    }
+    InitLLVMOpt();
+    if (added) {
+        std::string message = llvm::toString(std::move(added));
+        for (size_t i : compiled) batch.m_errors[i] = message;
+        return {};
+    }
+    batch.m_trackers.push_back(tracker);
+
+    // the first lookup materializes the whole module, the rest only read the symbol table
+    BERNARD_TIME_SCOPE("stage.lookup");
+    std::vector<size_t> failed;
+    for (size_t i : compiled) {
+        llvm::Expected<llvm::orc::ExecutorSymbolDef> sym = g_JIT->lookup(prefix + std::to_string(i));
+        if (sym) {
+            batch.m_entries[i] = sym->getAddress().toPtr<double (*)()>();
+        } else {
+            batch.m_errors[i] = llvm::toString(sym.takeError());
+            failed.push_back(i);
+        }
+    }
+    return failed;
+}
+
+std::unique_ptr<ExprBatch> CompileBatch(const std::vector<std::string> &sources) {
+    BERNARD_TIME_SCOPE("handle.batch");
+    if (g_Executors) {
+        Log("batches run in process only");
+        return nullptr;
+    }
+    std::string prefix = "__batch." + std::to_string(g_Batches++) + ".";
+    std::unique_ptr<ExprBatch> batch(new ExprBatch());
+    batch->m_entries.resize(sources.size());
+    batch->m_errors.resize(sources.size());
+    std::vector<size_t> all(sources.size());
+    for (size_t i = 0; i < sources.size(); i++) all[i] = i;
+    std::vector<size_t> failed = CompileBatchModule(sources, all, prefix, *batch);
+    if (failed.empty() || sources.size() == 1) return batch;
+
+    // One expression that can't link, calling an extern nobody defined say, fails the whole module.
+    // Drop it and give every expression that compiled a module of its own, so only the culprits fail.
+    err(batch->m_trackers.back()->remove());
+    batch->m_trackers.pop_back();
+    std::vector<size_t> retry;
+    for (size_t i = 0; i < sources.size(); i++) {
+        if (batch->m_entries[i] || std::find(failed.begin(), failed.end(), i) != failed.end()) {
+            batch->m_entries[i] = nullptr;
+            batch->m_errors[i].clear();
+            retry.push_back(i);
+        }
+    }
+    for (size_t i : retry) CompileBatchModule(sources, {i}, prefix + "alone.", *batch);
+    return batch;
 }
 
 double Calc(ExprNode *root) {
+    if (auto *shared = dynamic_cast<SharedNode *>(root)) return Calc(shared->Node());
     if (dynamic_cast<BinaryOpNode *>(root)) {
         BinaryOpNode *pb = dynamic_cast<BinaryOpNode *>(root);
         double left = Calc(pb->mp_lhs.get());
@@ -645,31 +2572,431 @@ double Calc(ExprNode *root) {
     }
 }
 
-void MainLoop(const Scanner &scanner) {
+void InitJIT() {
     llvm::InitializeNativeTarget();
     llvm::InitializeAllAsmPrinters();
     llvm::InitializeAllAsmParsers();
 
-    g_JIT = err(llvm::orc::BernardJIT::Create());
+    const char *quiet = std::getenv("BERNARD_QUIET");
+    if (quiet && *quiet && std::string(quiet) != "0") g_Quiet = true;
+
+    g_Executors.reset();
+    // a new JIT has none of the defs compiled so far
+    g_DefFingerprints.clear();
+    g_Callees.clear();
+    g_Callers.clear();
+    llvm::orc::BernardJITOptions options = llvm::orc::BernardJITOptions::fromEnvironment();
+    options.LazyCompile |= g_LazyCompile;
+    options.SpeculationThreads = std::max<unsigned>(options.SpeculationThreads, g_SpeculationThreads);
+    if (g_MemoryQuota) options.MemoryQuota = g_MemoryQuota;
+    g_JIT = err(llvm::orc::BernardJIT::Create(options));
+    // the runtime is linked into the engine, not necessarily exported from it
+    g_HostFunctions.emplace("putchard", HostFunction{reinterpret_cast<void *>(&putchard), {false}, "", true});
+    std::vector<std::pair<std::string, void *>> hostSymbols = {
+            {"bernard_parallel_for", reinterpret_cast<void *>(&bernard_parallel_for)},
+            {"bernard_ping", reinterpret_cast<void *>(&bernard_ping)}};
+    for (auto &host : g_HostFunctions) hostSymbols.emplace_back(host.first, host.second.address);
+    err(g_JIT->defineHostSymbols(hostSymbols));
+    g_TargetMachine = err(err(llvm::orc::JITTargetMachineBuilder::detectHost()).createTargetMachine());
     InitLLVMOpt();
+}
+
+// exports are the name and the buffer flag of each param
+void WriteHeader(std::ostream &os, const std::vector<std::pair<std::string, std::vector<bool>>> &exports,
+                 const std::string &entry) {
+    os << "// generated by bernardc, do not edit\n";
+    os << "// the object needs libbernard_runtime.a, -lstdc++ and -lpthread when linked by hand,\n";
+    os << "// bernardc -shared output already contains them\n#pragma once\n\n#include <stdint.h>\n\n";
+    os << "#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n";
+    for (auto &exported : exports) {
+        os << "double " << exported.first << "(";
+        for (size_t i = 0; i < exported.second.size(); i++) {
+            if (i) os << ", ";
+            os << (exported.second[i] ? "double *, int64_t" : "double");
+        }
+        os << (exported.second.empty() ? "void);\n" : ");\n");
+    }
+    os << "\n// evaluates the script's top-level expressions in order, returns the last one\n";
+    os << "double " << entry << "(void);\n\n#ifdef __cplusplus\n}\n#endif\n";
+}
+
+bool EmitObject(llvm::Module &module, const std::string &objectPath) {
+    std::error_code ec;
+    llvm::raw_fd_ostream dest(objectPath, ec, llvm::sys::fs::OF_None);
+    if (ec) {
+        Log("could not open " + objectPath + ": " + ec.message());
+        return false;
+    }
+    llvm::legacy::PassManager codegenPM;
+    if (g_TargetMachine->addPassesToEmitFile(codegenPM, dest, nullptr, llvm::CodeGenFileType::ObjectFile)) {
+        Log("target can't emit an object file");
+        return false;
+    }
+    codegenPM.run(module);
+    dest.flush();
+    return true;
+}
+
+// Everything a script compiled ahead of time must neither see nor leave behind: the JIT's target
+// machine, the defs it holds and what it knows about their purity and memo caches, swapped out for
+// a PIC target machine and empty tables until the script is done, whichever way it ends. The JIT's
+// module in progress is dropped on the way in, the JIT gets a fresh one on the way out.
+struct ScriptCompilation {
+    std::unique_ptr<llvm::TargetMachine> targetMachine;
+    std::map<std::string, std::unique_ptr<FunctionDeclAst>> functionDecls;
+    std::map<std::string, std::unique_ptr<FunctionDefAst>> functionDefs;
+    std::set<std::string> userDefinedFunctions;
+    std::map<std::string, unsigned> defVersions;
+    std::set<std::string> pureFunctions;
+    std::map<std::string, MemoCache *> memoCaches;
+    std::map<std::string, std::pair<double *, size_t>> hostBuffers;
+    // all of them would bake host addresses or JIT symbols into the object
+    bool memoize = false, specialize = false, instrument = false;
+    bool aheadOfTime = true;
+
+    explicit ScriptCompilation(std::unique_ptr<llvm::TargetMachine> pic) : targetMachine(std::move(pic)) {
+        Swap();
+        InitLLVMOpt();
+    }
+
+    ~ScriptCompilation() {
+        Swap();
+        InitLLVMOpt();
+    }
+
+    void Swap() {
+        std::swap(g_TargetMachine, targetMachine);
+        std::swap(g_FunctionDecls, functionDecls);
+        std::swap(g_FunctionDefs, functionDefs);
+        std::swap(g_UserDefinedFunctions, userDefinedFunctions);
+        std::swap(g_DefVersions, defVersions);
+        std::swap(g_PureFunctions, pureFunctions);
+        std::swap(g_MemoCaches, memoCaches);
+        std::swap(g_HostBuffers, hostBuffers);
+        std::swap(g_Memoize, memoize);
+        std::swap(g_Specialize, specialize);
+        std::swap(g_ProfileInstrument, instrument);
+        std::swap(g_AheadOfTime, aheadOfTime);
+    }
+};
+
+bool CompileScript(const Scanner &scanner, const std::string &objectPath, const std::string &headerPath,
+                   const std::string &entry) {
+    BERNARD_TIME_SCOPE("handle.compile_script");
+    BeginCompilationUnit();
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+
+    auto jtmb = err(llvm::orc::JITTargetMachineBuilder::detectHost());
+    jtmb.setRelocationModel(llvm::Reloc::PIC_);
+    ScriptCompilation script(err(jtmb.createTargetMachine()));
+
+    std::vector<std::pair<std::string, std::vector<bool>>> exports;
+    std::vector<llvm::Function *> topLevel;
+    bool ok = true;
+    scanner.NextToken();
+    while (ok && scanner.CurToken().m_type != TokenType::Eof) {
+        switch (scanner.CurToken().m_type) {
+            case TokenType::SEMICOLON:
+                scanner.NextToken();
+                break;
+            case TokenType::DEF: {
+                std::unique_ptr<FunctionDefAst> funcDef = ParseFunctionDef(scanner);
+                if (!funcDef) {
+                    ok = false;
+                    break;
+                }
+                // one module for the whole script, a second body for the same name can't go in it
+                llvm::Function *existing = g_Module->getFunction(funcDef->Name());
+                if (existing && !existing->empty()) {
+                    Log("redefinition of " + funcDef->Name() + " is not supported ahead of time");
+                    ok = false;
+                    break;
+                }
+                llvm::Function *func = funcDef->CodeGen();
+                if (!func) {
+                    ok = false;
+                    break;
+                }
+                exports.emplace_back(funcDef->Name(), g_FunctionDecls[funcDef->Name()]->Buffers());
+                g_FunctionDefs[funcDef->Name()] = std::move(funcDef);
+                break;
+            }
+            case TokenType::EXTERN: {
+                std::unique_ptr<FunctionDeclAst> decl = ParseExtern(scanner);
+                if (!decl) {
+                    ok = false;
+                    break;
+                }
+                if (!g_Module->getFunction(decl->Name())) decl->CodeGen();
+                g_FunctionDecls[decl->Name()] = std::move(decl);
+                break;
+            }
+            default: {
+                std::unique_ptr<FunctionDefAst> expr = ParseTopLevelExpr(scanner);
+                llvm::Function *func = expr ? expr->CodeGen() : nullptr;
+                if (!func) {
+                    ok = false;
+                    break;
+                }
+                func->setName("__anon_expr." + std::to_string(topLevel.size()));
+                func->setLinkage(llvm::Function::InternalLinkage);
+                topLevel.push_back(func);
+                break;
+            }
+        }
+    }
+    if (!ok) {
+        Log("compile " + objectPath + " failed");
+        return false;
+    }
+
+    llvm::FunctionType *entryType = llvm::FunctionType::get(llvm::Type::getDoubleTy(*g_Context), false);
+    llvm::Function *entryFunc =
+            llvm::Function::Create(entryType, llvm::Function::ExternalLinkage, entry, g_Module.get());
+    g_Builder->SetInsertPoint(llvm::BasicBlock::Create(*g_Context, "entry", entryFunc));
+    llvm::Value *result = llvm::ConstantFP::get(*g_Context, llvm::APFloat(0.0));
+    for (llvm::Function *func : topLevel) result = g_Builder->CreateCall(func, {}, "exprtmp");
+    g_Builder->CreateRet(result);
+
+    {
+        BERNARD_TIME_SCOPE("stage.emit_object");
+        if (!EmitObject(*g_Module, objectPath)) return false;
+    }
+    if (!headerPath.empty()) {
+        std::ofstream header(headerPath);
+        if (!header) {
+            Log("could not open " + headerPath);
+            return false;
+        }
+        WriteHeader(header, exports, entry);
+    }
+    return true;
+}
+
+bool InitRemoteJIT(const std::string &executorPath, size_t executors, unsigned timeoutMs) {
+    InitJIT();
+    auto pool = std::make_unique<ExecutorPool>(executorPath, executors, std::chrono::milliseconds(timeoutMs));
+    if (llvm::Error started = pool->Start()) {
+        Log("could not start executors: " + llvm::toString(std::move(started)));
+        return false;
+    }
+    g_Executors = std::move(pool);
+    return true;
+}
+
+void SetProfiling(bool instrument, uint64_t warmupCalls) {
+    g_ProfileInstrument = instrument;
+    g_ProfileWarmup = instrument ? warmupCalls : 0;
+}
+
+size_t ReoptimizeWithProfile() {
+    size_t count = 0;
+    for (auto &name : g_ProfileData.Warm(0)) count += Reoptimize(name);
+    return count;
+}
+
+bool SaveProfile(const std::string &path) { return g_ProfileData.Save(path); }
+
+bool LoadProfile(const std::string &path) { return g_ProfileData.Load(path); }
+
+const ProfileData &GetProfile() { return g_ProfileData; }
+
+void SetLazyCompile(bool enable, unsigned speculationThreads) {
+    g_LazyCompile = enable;
+    g_SpeculationThreads = enable ? speculationThreads : 0;
+}
+
+void SetMemoryQuota(size_t quotaBytes) { g_MemoryQuota = quotaBytes; }
+
+MemoryUsage GetMemoryUsage() {
+    MemoryUsage usage;
+    usage.decls = g_FunctionDecls.size();
+    usage.storedDefs = g_FunctionDefs.size();
+    if (!g_JIT) return usage;
+    llvm::orc::JITMemoryUsage jit = g_JIT->getMemoryUsage();
+    usage.codeBytes = jit.CodeBytes;
+    usage.dataBytes = jit.DataBytes;
+    usage.objectBytes = jit.ObjectBytes;
+    usage.bitcodeBytes = jit.BitcodeBytes;
+    usage.pendingDefs = jit.PendingDefinitions;
+    usage.evictedDefs = jit.EvictedDefinitions;
+    usage.evictions = jit.Evictions;
+    usage.recompiles = jit.Recompiles;
+    return usage;
+}
+
+bool RegisterHostFunction(const std::string &name, void *address, const std::vector<bool> &buffers,
+                          const std::string &bitcode) {
+    auto known = g_HostFunctions.find(name);
+    if (!address || (known != g_HostFunctions.end() && known->second.address != address)) {
+        Log("host function " + name + " is registered already or has no address");
+        return false;
+    }
+    if (g_Executors && bitcode.empty()) {
+        Log("host function " + name + " needs bitcode, executors can't call into this process");
+        return false;
+    }
+    HostFunction host{address, buffers, bitcode};
+    if (!bitcode.empty()) {
+        llvm::LLVMContext context;
+        if (!ParseHostBitcode(name, host, context)) return false;
+    }
+    // the live JIT has it already when it was registered before
+    if (g_JIT && known == g_HostFunctions.end()) {
+        if (llvm::Error defined = g_JIT->defineHostSymbol(name, address)) {
+            Log("host function " + name + ": " + llvm::toString(std::move(defined)));
+            return false;
+        }
+    }
+    g_HostFunctions[name] = std::move(host);
+    return true;
+}
+
+void SetQuiet(bool enable) {
+    // read where IR and results are printed, the module being built is left alone
+    g_Quiet = enable;
+}
+
+void SetCapture(const std::string &filter, size_t capacity) { g_Capture.Configure(filter, capacity); }
+
+// prints function `name` from captured bitcode, followed by its assembly when assembly is set
+void PrintCaptured(llvm::raw_ostream &os, const std::string &bitcode, const std::string &name, bool assembly,
+                   llvm::TargetMachine *targetMachine) {
+    llvm::LLVMContext context;
+    auto module = llvm::parseBitcodeFile(llvm::MemoryBufferRef(bitcode, name), context);
+    if (!module) {
+        os << "; unreadable capture: " << llvm::toString(module.takeError()) << "\n";
+        return;
+    }
+    if (llvm::Function *func = (*module)->getFunction(name)) func->print(os);
+    if (!assembly) return;
+    os << "; assembly\n";
+    llvm::SmallVector<char, 0> text;
+    llvm::raw_svector_ostream asmOS(text);
+    llvm::legacy::PassManager codegenPM;
+    if (!targetMachine || targetMachine->addPassesToEmitFile(codegenPM, asmOS, nullptr,
+                                                             llvm::CodeGenFileType::AssemblyFile)) {
+        os << "; target can't emit assembly\n";
+        return;
+    }
+    codegenPM.run(**module);
+    os << text;
+}
+
+std::string DumpCapture(const std::string &name) {
+    std::vector<CapturedFunction> captured = g_Capture.Find(name);
+    if (captured.empty()) return "";
+    // a target machine of its own, the engine may be compiling on another thread meanwhile
+    std::unique_ptr<llvm::TargetMachine> targetMachine;
+    if (auto builder = llvm::orc::JITTargetMachineBuilder::detectHost()) {
+        if (auto created = builder->createTargetMachine())
+            targetMachine = std::move(*created);
+        else
+            llvm::consumeError(created.takeError());
+    } else {
+        llvm::consumeError(builder.takeError());
+    }
+
+    std::string out;
+    llvm::raw_string_ostream os(out);
+    for (auto &function : captured) {
+        os << "; " << function.name << " #" << function.sequence << " ir\n";
+        PrintCaptured(os, function.bitcode, function.name, false, nullptr);
+        os << "; " << function.name << " #" << function.sequence << " optimized ir\n";
+        PrintCaptured(os, function.optimizedBitcode, function.name, true, targetMachine.get());
+    }
+    os.flush();
+    return out;
+}
+
+llvm::orc::BernardJIT *GetJIT() { return g_JIT.get(); }
+
+void BindBuffer(const std::string &name, double *data, size_t len) {
+    if (data)
+        g_HostBuffers[name] = {data, len};
+    else
+        g_HostBuffers.erase(name);
+}
+
+void *FunctionAddress(const std::string &name) {
+    if (!g_JIT || g_Executors || !g_FunctionDefs.count(name)) return nullptr;
+    llvm::Expected<llvm::orc::ExecutorSymbolDef> sym = g_JIT->lookup(name);
+    if (!sym) {
+        llvm::consumeError(sym.takeError());
+        return nullptr;
+    }
+    return sym->getAddress().toPtr<void *>();
+}
+
+ExecutorPool *GetExecutorPool() { return g_Executors.get(); }
+
+double LastResult() { return g_LastResult; }
+
+void MainLoop(const Scanner &scanner) {
+    InitJIT();
+    RunScript(scanner);
+}
+
+size_t ReloadScript(const Scanner &scanner) {
+    BERNARD_TIME_SCOPE("handle.reload");
+    BeginCompilationUnit();
+    Reload reload;
     scanner.NextToken();
     while (true) {
         const Token &word = scanner.CurToken();
         switch (word.m_type) {
             case TokenType::Eof:
-                return;
+                RebuildDependents(reload);
+                return reload.compiled;
             case TokenType::SEMICOLON:
                 scanner.NextToken();
                 break;
             case TokenType::DEF:
-                HandleFunctionDef(scanner);
+                ReloadFunctionDef(scanner, reload);
                 break;
             case TokenType::EXTERN:
                 HandleExtern(scanner);
                 break;
             default:
+                // the expression may call anything, nothing stale may be left to run
+                RebuildDependents(reload);
+                reload.fresh.clear();
                 HandleTopLevelExpr(scanner);
                 break;
         }
     }
 }
+
+bool RunScript(const Scanner &scanner, std::string *error) {
+    BERNARD_TIME_SCOPE("handle.main_loop");
+    BeginCompilationUnit();
+    std::string message;
+    g_LogSink = error ? &message : nullptr;
+    bool ok = true;
+    scanner.NextToken();
+    while (scanner.CurToken().m_type != TokenType::Eof) {
+        switch (scanner.CurToken().m_type) {
+            case TokenType::SEMICOLON:
+                scanner.NextToken();
+                break;
+            case TokenType::DEF:
+                ok &= HandleFunctionDef(scanner);
+                break;
+            case TokenType::EXTERN:
+                ok &= HandleExtern(scanner);
+                break;
+            default:
+                ok &= HandleTopLevelExpr(scanner);
+                break;
+        }
+    }
+    // unknown characters also scan as Eof, but with a value
+    if (!scanner.CurToken().m_val.empty()) {
+        Log("unknown token " + scanner.CurToken().m_val);
+        ok = false;
+    }
+    g_LogSink = nullptr;
+    if (error) *error = ok ? "" : message.empty() ? "compile failed" : message;
+    return ok;
+}
@@ -1,29 +1,72 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
 #include <memory>
 #include <string>
 #include <utility>
 #include <vector>
+#include <Memo.h>
+#include <Profile.h>
+#include <Runtime.h>
 #include <Scanner.h>
+#include <llvm/ADT/IntrusiveRefCntPtr.h>
 #include <llvm/IR/Type.h>
 #include <llvm/IR/Value.h>
 
+namespace llvm {
+namespace orc {
+class BernardJIT;
+class ResourceTracker;
+}
+}
+class ExecutorPool;
+
+// what type inference can prove about a value, joining two kinds takes the larger one. INT values
+// are integers small enough that i64 code computes what double code would: literals, len, loop
+// counters with a bounded trip and locals holding only those. Arithmetic results are DOUBLE.
+enum class ValueKind {
+    BOOL,
+    INT,
+    DOUBLE,
+};
+
 class ExprNode {
 public:
     ExprNode() = default;
 
     virtual llvm::Value *CodeGen() = 0;
 
+    // walks the subtree with the variable kinds currently in scope, binding nodes remember what they decided
+    virtual ValueKind InferKind() = 0;
+
+    // called on a function body, the node's value is what the function returns
+    virtual void MarkTailPosition() {}
+
+    // names of every function called in the subtree, in evaluation order
+    virtual void CollectCallees(std::vector<std::string> &callees) const = 0;
+
+    // structural hash of the subtree, subtrees that parse the same hash the same
+    virtual uint64_t Fingerprint() const = 0;
+
     virtual ~ExprNode() = default;
 };
 
 class NumberNode : public ExprNode {
 public:
-    explicit NumberNode(const double &num) : m_number(num) {}
+    explicit NumberNode(const double &num, bool isInt = false) : m_number(num), m_isInt(isInt) {}
 
     llvm::Value *CodeGen();
 
+    ValueKind InferKind() override;
+
+    void CollectCallees(std::vector<std::string> &) const override {}
+
+    uint64_t Fingerprint() const override;
+
     double m_number;
+    // written without a fraction and exactly representable, emitted as i64
+    bool m_isInt;
 };
 
 class VariableNode : public ExprNode {
@@ -32,10 +75,42 @@ public:
 
     llvm::Value *CodeGen() override;
 
+    ValueKind InferKind() override;
+
+    void CollectCallees(std::vector<std::string> &) const override {}
+
+    uint64_t Fingerprint() const override;
+
+    const std::string &Name() const { return m_name; }
+
 private:
     std::string m_name;
 };
 
+// a[i], an element of buffer a. Buffers hold doubles and are not bounds checked, len(a) is their
+// length. A for loop runs its body before the first check, so it covers a buffer with
+// for i = 0, i < len(a) - 1, parallel for checks first and takes i < len(a).
+class IndexNode : public ExprNode {
+public:
+    IndexNode(const std::string &buffer, std::unique_ptr<ExprNode> index)
+            : m_buffer(buffer), mp_index(std::move(index)) {}
+
+    llvm::Value *CodeGen() override;
+
+    ValueKind InferKind() override;
+
+    void CollectCallees(std::vector<std::string> &callees) const override { mp_index->CollectCallees(callees); }
+
+    uint64_t Fingerprint() const override;
+
+    // pointer to the element, nullptr when no buffer of that name is in scope
+    llvm::Value *Address();
+
+private:
+    std::string m_buffer;
+    std::unique_ptr<ExprNode> mp_index;
+};
+
 class BinaryOpNode : public ExprNode {
 public:
     BinaryOpNode(char op, std::unique_ptr<ExprNode> &lhs, std::unique_ptr<ExprNode> &rhs)
@@ -43,6 +118,12 @@ public:
 
     virtual llvm::Value *CodeGen() override;
 
+    ValueKind InferKind() override;
+
+    void CollectCallees(std::vector<std::string> &callees) const override;
+
+    uint64_t Fingerprint() const override;
+
     char m_op;
     std::unique_ptr<ExprNode> mp_lhs;
     std::unique_ptr<ExprNode> mp_rhs;
@@ -55,6 +136,14 @@ public:
 
     llvm::Value *CodeGen() override;
 
+    ValueKind InferKind() override;
+
+    void MarkTailPosition() override;
+
+    void CollectCallees(std::vector<std::string> &callees) const override;
+
+    uint64_t Fingerprint() const override;
+
 private:
     std::unique_ptr<ExprNode> m_cond;
     std::unique_ptr<ExprNode> m_then;
@@ -71,36 +160,128 @@ public:
 
     llvm::Value *CodeGen() override;
 
+    ValueKind InferKind() override;
+
+    void CollectCallees(std::vector<std::string> &callees) const override;
+
+    uint64_t Fingerprint() const override;
+
 private:
     std::string m_valName;
     std::unique_ptr<ExprNode> mp_start;
     std::unique_ptr<ExprNode> mp_end;
     std::unique_ptr<ExprNode> mp_step;
     std::unique_ptr<ExprNode> mp_body;
+    ValueKind m_kind = ValueKind::DOUBLE;
+};
+
+// parallel for i = start, i < bound [, step] in body
+// Runs the iterations with i < bound on the thread pool and evaluates to the sum of the body
+// values. The body is outlined, it sees outer variables as private copies taken at loop entry.
+class ParallelForNode : public ExprNode {
+public:
+    ParallelForNode(const std::string &varName, std::unique_ptr<ExprNode> start, std::unique_ptr<ExprNode> bound,
+                    std::unique_ptr<ExprNode> step, std::unique_ptr<ExprNode> body)
+            : m_valName(varName), mp_start(std::move(start)), mp_bound(std::move(bound)), mp_step(std::move(step)),
+              mp_body(std::move(body)) {}
+
+    llvm::Value *CodeGen() override;
+
+    ValueKind InferKind() override;
+
+    void CollectCallees(std::vector<std::string> &callees) const override;
+
+    uint64_t Fingerprint() const override;
+
+private:
+    std::string m_valName;
+    std::unique_ptr<ExprNode> mp_start;
+    std::unique_ptr<ExprNode> mp_bound;
+    std::unique_ptr<ExprNode> mp_step;
+    std::unique_ptr<ExprNode> mp_body;
+    ValueKind m_kind = ValueKind::DOUBLE;
 };
 
+// var a = 1, b in body
+class VarExprNode : public ExprNode {
+public:
+    VarExprNode(std::vector<std::pair<std::string, std::unique_ptr<ExprNode>>> vars, std::unique_ptr<ExprNode> body)
+            : m_vars(std::move(vars)), mp_body(std::move(body)) {}
+
+    llvm::Value *CodeGen() override;
+
+    ValueKind InferKind() override;
+
+    void MarkTailPosition() override { mp_body->MarkTailPosition(); }
+
+    void CollectCallees(std::vector<std::string> &callees) const override;
+
+    uint64_t Fingerprint() const override;
+
+private:
+    std::vector<std::pair<std::string, std::unique_ptr<ExprNode>>> m_vars;
+    std::unique_ptr<ExprNode> mp_body;
+    std::vector<ValueKind> m_kinds;
+};
+
+// A param declared as a[] is a buffer: the caller passes one of its own buffers, the function gets
+// a noalias double *a and an int64_t a.len in its place.
 class FunctionDeclAst {
 public:
-    FunctionDeclAst(const std::string &name, const std::vector<std::string> &args) : m_name(name), m_args(args) {}
+    FunctionDeclAst(const std::string &name, const std::vector<std::string> &args,
+                    const std::vector<bool> &buffers = {})
+            : m_name(name), m_args(args), m_buffers(buffers) {
+        m_buffers.resize(m_args.size(), false);
+    }
 
     llvm::Function *CodeGen();
     std::string Name() const { return m_name; }
+    size_t Arity() const { return m_args.size(); }
+    const std::vector<std::string> &Args() const { return m_args; }
+    const std::vector<bool> &Buffers() const { return m_buffers; }
+    bool IsBuffer(size_t i) const { return m_buffers[i]; }
+    bool HasBuffers() const { return std::find(m_buffers.begin(), m_buffers.end(), true) != m_buffers.end(); }
 private:
     std::string m_name;
     std::vector<std::string> m_args;
+    std::vector<bool> m_buffers;
 };
 
 class FunctionDefAst {
 public:
     FunctionDefAst(std::unique_ptr<FunctionDeclAst> decl, std::unique_ptr<ExprNode> &body) : m_decl(std::move(decl)),
-                                                                                             m_body(std::move(body)) {
+                                                                                             m_body(std::move(body)),
+                                                                                             m_name(m_decl->Name()) {
     }
 
-    llvm::Function *CodeGen();
+    // may run again on the same AST, e.g. to rebuild a def against a changed callee
+    llvm::Function *CodeGen(bool optimize = true);
+
+    // true when the body only calls pure defs, itself and math builtins
+    bool IsPure() const;
+
+    void CollectCallees(std::vector<std::string> &callees) const { m_body->CollectCallees(callees); }
+
+    // hashes the name, the parameters and the body
+    uint64_t Fingerprint() const;
+
+    const std::string &Name() const { return m_name; }
+
+    const FunctionDeclAst &Decl() const { return *m_decl; }
+
+    // emits a clone named `name` into the current module, args with a value in `bound`
+    // become constants and are dropped from the signature. Only valid after CodeGen.
+    llvm::Function *CodeGenSpecialization(const std::string &name, const std::vector<const NumberNode *> &bound);
 
 private:
+    // emits m_body into `func`, params[i] is the initial value of names[i], a buffer comes as its
+    // pointer under its name and its length under name.len
+    llvm::Value *EmitBody(llvm::Function *func, const std::vector<std::string> &names,
+                          const std::vector<llvm::Value *> &params);
+
     std::unique_ptr<FunctionDeclAst> m_decl;
     std::unique_ptr<ExprNode> m_body;
+    std::string m_name;
 };
 
 class FunctionCallNode : public ExprNode {
@@ -111,11 +292,72 @@ public:
 
     llvm::Value *CodeGen() override;
 
+    ValueKind InferKind() override;
+
+    void MarkTailPosition() override { m_isTail = true; }
+
+    void CollectCallees(std::vector<std::string> &callees) const override;
+
+    uint64_t Fingerprint() const override;
+
+    // tail marks the call for tail call elimination, CodeGen passes m_isTail
+    llvm::Value *CodeGenCall(bool tail);
+
+    const std::string &Callee() const { return m_callee; }
+    const std::vector<std::unique_ptr<ExprNode>> &Args() const { return m_args; }
+
 private:
+    // len(a) on a buffer, unless something called len was declared
+    bool IsLength() const;
+
     std::string m_callee;
     std::vector<std::unique_ptr<ExprNode>> m_args;
+    bool m_isTail = false;
+};
+
+// A use of a subexpression the parser hash-consed. Within a compilation unit equal binary operations
+// and calls to pure functions are built once, keyed by operator or callee and their children, and
+// every occurrence refers to that node. Codegen reuses the value of an earlier occurrence in the same
+// block as long as no variable was assigned or bound in between.
+class SharedNode : public ExprNode {
+public:
+    SharedNode(std::shared_ptr<ExprNode> node, size_t id) : m_node(std::move(node)), m_id(id) {}
+
+    llvm::Value *CodeGen() override;
+
+    ValueKind InferKind() override { return m_node->InferKind(); }
+
+    // the node has other uses, only this one is in tail position
+    void MarkTailPosition() override { m_isTail = true; }
+
+    void CollectCallees(std::vector<std::string> &callees) const override { m_node->CollectCallees(callees); }
+
+    uint64_t Fingerprint() const override { return m_node->Fingerprint(); }
+
+    ExprNode *Node() const { return m_node.get(); }
+
+    size_t Id() const { return m_id; }
+
+private:
+    std::shared_ptr<ExprNode> m_node;
+    size_t m_id;
+    bool m_isTail = false;
+};
+
+struct SharingStats {
+    // distinct subexpressions hash-consed
+    uint64_t nodes = 0;
+    // parsed subexpressions that were equal to one of them
+    uint64_t shared = 0;
+    // occurrences whose value codegen took from an earlier one
+    uint64_t reused = 0;
 };
 
+// hash-consing of subexpressions by the parser, on by default
+void SetHashConsing(bool enable);
+
+const SharingStats &GetSharingStats();
+
 struct ExprTree {
     ExprTree(ExprTree *lhs, ExprTree *rhs, const std::string &val) :
             mp_left(lhs), mp_right(rhs), m_val(val) {}
@@ -137,5 +379,192 @@ double Calc(ExprNode *binaryOp);
 
 std::unique_ptr<ExprNode> ParseExpression(const Scanner &scan);
 
+std::unique_ptr<FunctionDefAst> ParseFunctionDef(const Scanner &scanner);
+
+std::unique_ptr<FunctionDefAst> ParseTopLevelExpr(const Scanner &scanner);
+
+// resets the per-module codegen state and the function pass pipeline
+void InitLLVMOpt();
+
+void OptimizeFunction(llvm::Function *func);
+
+// relaxed FP semantics (reassociation, FMA contraction) for functions compiled afterwards, off by default
+void SetFastMath(bool enable);
+
+// per function override of SetFastMath, applies the next time `name` is compiled
+void SetFunctionFastMath(const std::string &name, bool enable);
+
+// vector variants of the math builtins for the loop vectorizer: none, libmvec or svml on x86-64,
+// sleef on AArch64. Loads the library defining them, false if it is missing or built for another
+// architecture.
+bool SetVectorMathLibrary(const std::string &name);
+
+// opt-in: pure defs compiled afterwards get a fixed size cache from argument bits to result
+void SetMemoize(bool enable, size_t cacheEntries = 4096);
+
+// cache of the current definition of `name`, nullptr when it is not memoized
+const MemoCache *GetMemoCache(const std::string &name);
+
+// Profile-guided optimization. Defs compiled while instrument is on count their entries and the
+// outcomes of their if and loop branches. ReoptimizeWithProfile recompiles them without counters
+// and with the counts as branch weights and entry counts, with warmupCalls set a def is recompiled
+// once it was entered that often (checked after every top-level expression). A def compiled while
+// not instrumenting picks up a collected or loaded profile for its name right away.
+void SetProfiling(bool instrument, uint64_t warmupCalls = 0);
+
+// recompiles every instrumented def with its profile, returns how many
+size_t ReoptimizeWithProfile();
+
+bool SaveProfile(const std::string &path);
+
+// profiles from an earlier run, used by defs compiled afterwards
+bool LoadProfile(const std::string &path);
+
+const ProfileData &GetProfile();
+
+// opt-in: calls with literal arguments go to clones of the callee compiled with those arguments
+// folded in, a clone is dropped when it optimizes to more than maxCloneInstructions and no
+// clones are made after totalInstructions
+void SetSpecialization(bool enable, size_t maxCloneInstructions = 512, size_t totalInstructions = 65536);
+
+// number of clones compiled so far
+size_t SpecializationCount();
+
+// Ahead-of-time mode: compiles the whole script through the same codegen and pass pipeline into one
+// PIC object file. Every def is exported with the C signature double name(double, ...), a buffer
+// param taking a double * and an int64_t length, top-level expressions run in order from
+// `double entry(void)`. When headerPath is set a C header declaring the exports is written next to
+// it. Memoization, specialization and host buffers need the JIT and are off here. Calls into the
+// runtime (putchard, parallel for) are left to bernard_runtime, link it with the object.
+bool CompileScript(const Scanner &scanner, const std::string &objectPath, const std::string &headerPath = "",
+                   const std::string &entry = "bernard_main");
+
+// Lazy mode for JITs created afterwards: a def is compiled on its first call rather than when it is
+// defined, with speculationThreads compiling the callees of whatever was just compiled or is about
+// to run ahead of their first call. BERNARD_LAZY and BERNARD_SPECULATE=<threads> turn it on too.
+void SetLazyCompile(bool enable, unsigned speculationThreads = 0);
+
+// Caps the machine code and data of defs in JITs created afterwards at quotaBytes, 0 for no limit. Past
+// it the defs used longest ago by top-level expressions lose their code, which is compiled again from
+// bitcode kept for them on their next call. BERNARD_MEMORY_QUOTA=<bytes> sets it too. In process only.
+void SetMemoryQuota(size_t quotaBytes);
+
+struct MemoryUsage {
+    // sections of the objects the JIT has loaded now, and the object files they came from
+    uint64_t codeBytes = 0;
+    uint64_t dataBytes = 0;
+    uint64_t objectBytes = 0;
+    // bitcode kept to compile evicted defs again
+    uint64_t bitcodeBytes = 0;
+    // defs whose IR waits for a first call in lazy mode, and defs evicted since their last call
+    size_t pendingDefs = 0;
+    size_t evictedDefs = 0;
+    uint64_t evictions = 0;
+    uint64_t recompiles = 0;
+    // decls and def ASTs the front end keeps for calls, reloads and re-optimization
+    size_t decls = 0;
+    size_t storedDefs = 0;
+};
+
+// memory held by the JIT created by InitJIT and by the front end
+MemoryUsage GetMemoryUsage();
+
+// Makes the host function at address callable from scripts as `name`, once an extern declares it
+// with the same params. It returns a double and takes a double per scalar param and a double *
+// followed by an int64_t length per buffer param, buffers[i] telling which param i is. It is found
+// as an absolute symbol, it need not be exported from the process. With bitcode, a module defining
+// `name` with that signature, calls to it are inlined into the generated code rather than leaving it.
+// Defined in the JIT created by InitJIT and in every one created afterwards. Generated code running
+// in executors only has the inlined ones, after InitRemoteJIT a function without bitcode is rejected
+// and so is an extern for one registered before. Returns false on a bad signature or bitcode, or
+// when another function is registered as name.
+bool RegisterHostFunction(const std::string &name, void *address, const std::vector<bool> &buffers,
+                          const std::string &bitcode = "");
+
+// Production mode: nothing is printed per definition or expression, no IR or results.
+// BERNARD_QUIET turns it on too.
+void SetQuiet(bool enable);
+
+// Keeps the IR of the functions filter selects, as it is compiled from now on, before and after
+// optimization in a ring of the last `capacity` ones. filter is a comma separated list of names, a
+// name ending in * selects a prefix, "" turns capturing off. Functions it does not select cost a
+// name check, the ones it does a copy as bitcode, nothing is formatted until DumpCapture.
+void SetCapture(const std::string &filter, size_t capacity = 64);
+
+// IR, optimized IR and assembly of the captures of function `name`, all captures when it is empty,
+// oldest first. The assembly is generated here from the captured optimized IR.
+std::string DumpCapture(const std::string &name = "");
+
+// creates the JIT, MainLoop does this on every call
+void InitJIT();
+
+// Like InitJIT, but generated code runs in `executors` bernard_executor child processes started from
+// executorPath: a crash or a call running past timeoutMs (0 for no limit) only takes down one
+// executor, which is replaced with the current definitions. The engine keeps compiling in process.
+// Memoization needs the engine's address space and is off in this mode.
+bool InitRemoteJIT(const std::string &executorPath, size_t executors = 1, unsigned timeoutMs = 0);
+
+// the JIT created by InitJIT, nullptr before that
+llvm::orc::BernardJIT *GetJIT();
+
+// the executors started by InitRemoteJIT, nullptr when code runs in process
+ExecutorPool *GetExecutorPool();
+
+// value of the last top-level expression RunScript evaluated
+double LastResult();
+
+// Makes len doubles at data buffer `name` for the top-level expressions compiled afterwards, which
+// index it and pass it to defs in place, without a copy. nullptr data unbinds the name. Host buffers
+// live in this process, top-level expressions don't see them after InitRemoteJIT.
+void BindBuffer(const std::string &name, double *data, size_t len);
+
+// Address of def `name`, to call it from the host without a script: a scalar param is a double, a
+// buffer param a double * followed by its int64_t length, the result a double. It is the address
+// of the stub, so it follows redefinitions, which must not happen while a call through it runs.
+// nullptr when there is no such def or code runs in executors.
+void *FunctionAddress(const std::string &name);
+
+// top-level expressions compiled into one module by CompileBatch, unloaded again with the batch
+class ExprBatch {
+public:
+    ~ExprBatch();
+
+    size_t Size() const { return m_errors.size(); }
+
+    // why expression i did not compile, empty when it did
+    const std::string &Error(size_t i) const { return m_errors[i]; }
+
+    // evaluates expression i, any number of threads may run expressions of live batches at once
+    double Run(size_t i) const;
+
+private:
+    friend std::unique_ptr<ExprBatch> CompileBatch(const std::vector<std::string> &sources);
+    friend std::vector<size_t> CompileBatchModule(const std::vector<std::string> &sources,
+                                                  const std::vector<size_t> &which, const std::string &prefix,
+                                                  ExprBatch &batch);
+
+    std::vector<double (*)()> m_entries;
+    std::vector<std::string> m_errors;
+    // one for the shared module, or one per expression after it failed to link
+    std::vector<llvm::IntrusiveRefCntPtr<llvm::orc::ResourceTracker>> m_trackers;
+};
+
+// Compiles sources, one top-level expression each, into a single module that is materialized at
+// once, so a batch pays for one JIT link instead of one per expression. When that module fails to
+// link each expression is compiled again on its own, and the ones that still fail report why through
+// Error. Needs the in-process JIT, returns nullptr after InitRemoteJIT.
+std::unique_ptr<ExprBatch> CompileBatch(const std::vector<std::string> &sources);
+
+// Runs a script against the JIT created by InitJIT. False when part of it failed to parse, compile
+// or run, the rest still runs. error, when given, receives the first message logged about it.
+bool RunScript(const Scanner &scanner, std::string *error = nullptr);
+
+// Like RunScript for a script library that was edited since it last ran. A def whose AST and compile
+// settings match the ones its current version was compiled from is not compiled again. Callers of a
+// def that changed its arity or purity are rebuilt from their stored ASTs, and so are memoized callers
+// of any def that changed, before the next top-level expression runs. Returns the number of defs
+// compiled. Defs missing from the script keep their current version.
+size_t ReloadScript(const Scanner &scanner);
+
 void MainLoop(const Scanner &scanner);
 
@@ -1,6 +1,17 @@
+#include <atomic>
+#include <fstream>
 #include <iostream>
+#include <sstream>
+#include <thread>
+#include <BernardJIT.h>
+#include <ExecutorPool.h>
 #include <Parser.h>
+#include <cmath>
+#include <cstdlib>
+#include <dlfcn.h>
 #include <gtest/gtest.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/IRBuilder.h>
 
 TEST(ast, case1) {
     Scanner scan("2 * 3 * 20");
@@ -59,6 +70,536 @@ TEST(ast, forLoop) {
     MainLoop(scan);
 }
 
+TEST(ast, varAccumulator) {
+    std::string src("def sum(n) var acc = 0 in (for i = 1, i < n in acc = acc + i) + acc; sum(10);");
+    Scanner scan(src);
+    MainLoop(scan);
+}
+
+TEST(ast, reinitWithLiveModule) {
+    InitJIT();
+    // the extern leaves a declaration in the module being built when the JIT is replaced
+    Scanner pending("extern cos(x);");
+    RunScript(pending);
+    InitJIT();
+    Scanner after("def reinit(x) x + 1; reinit(2);");
+    RunScript(after);
+    EXPECT_EQ(LastResult(), 3);
+}
+
+TEST(ast, intInference) {
+    Scanner literal("42");
+    literal.NextToken();
+    std::unique_ptr<ExprNode> root = ParseExpression(literal);
+    EXPECT_EQ(root->InferKind(), ValueKind::INT);
+
+    // a product of integers can leave the i64 range, it stays double
+    Scanner scanner("2 + 3 * 4");
+    scanner.NextToken();
+    root = ParseExpression(scanner);
+    EXPECT_EQ(root->InferKind(), ValueKind::DOUBLE);
+
+    Scanner mixed("2 + 3.5 < 4");
+    mixed.NextToken();
+    root = ParseExpression(mixed);
+    EXPECT_EQ(root->InferKind(), ValueKind::BOOL);
+
+    Scanner div("6 / 3");
+    div.NextToken();
+    root = ParseExpression(div);
+    EXPECT_EQ(root->InferKind(), ValueKind::DOUBLE);
+}
+
+TEST(ast, intLoopCounter) {
+    std::string src("def count(n) var c = 0 in (for i = 0, i < n in c = c + 1) + c; count(5);");
+    Scanner scan(src);
+    MainLoop(scan);
+}
+
+TEST(ast, intOverflow) {
+    std::string src("3037000500 * 3037000500;");
+    Scanner scan(src);
+    MainLoop(scan);
+    EXPECT_EQ(LastResult(), 3037000500.0 * 3037000500.0);
+
+    // the loop runs its body 71 times, far past 2^63
+    std::string doubling("var a = 1 in (for i = 0, i < 70 in a = a * 2) + a;");
+    Scanner loop(doubling);
+    MainLoop(loop);
+    EXPECT_EQ(LastResult(), std::ldexp(1.0, 71));
+}
+
+TEST(ast, mathBuiltins) {
+    std::string src("extern sin(x); def hyp(a b) sqrt(a * a + b * b); hyp(3, 4) + sin(0) + fma(2, 3, 1);");
+    Scanner scan(src);
+    MainLoop(scan);
+}
+
+TEST(ast, tailRecursion) {
+    // ten million frames would overflow the stack if the recursion were not turned into a loop
+    std::string src("def sumto(n acc) if n < 1 then acc else sumto(n - 1, acc + n); sumto(10000000, 0);");
+    Scanner scan(src);
+    MainLoop(scan);
+}
+
+TEST(ast, memoize) {
+    SetMemoize(true, 1024);
+    std::string src("extern putchard(x); \
+        def fib(x) if x < 3 then 1 else fib(x - 1) + fib(x - 2); \
+        def noisy(x) putchard(x) + x; \
+        fib(40);");
+    Scanner scan(src);
+    MainLoop(scan);
+    SetMemoize(false);
+
+    const MemoCache *cache = GetMemoCache("fib");
+    ASSERT_NE(cache, nullptr);
+    EXPECT_GT(cache->Stats().hits, 0);
+    EXPECT_EQ(GetMemoCache("noisy"), nullptr);
+}
+
+TEST(ast, specialize) {
+    SetSpecialization(true);
+    std::string src("def power(x n) var r = 1 in (for i = 0, i < n in r = r * x) + r; \
+        def cube(x) power(x, 3); \
+        cube(2) + power(2, 10) + power(2, 10);");
+    Scanner scan(src);
+    MainLoop(scan);
+    SetSpecialization(false);
+
+    // power(_, 3) from cube, cube(2) and power(2, 10) once
+    EXPECT_EQ(SpecializationCount(), 3);
+}
+
+TEST(ast, aheadOfTime) {
+    // a script compiles next to a JIT with a module in progress
+    InitJIT();
+    Scanner pending("extern cos(x);");
+    RunScript(pending);
+    std::string src("extern putchard(x); def sq(x) x * x; def hyp(a b) sqrt(sq(a) + sq(b)); \
+        def zero() putchard(10) * 0; hyp(3, 4);");
+    Scanner scan(src);
+    ASSERT_TRUE(CompileScript(scan, "/tmp/bernard_aot_test.o", "/tmp/bernard_aot_test.h"));
+
+    // the test binary doesn't export putchard, the library has to bring it from the runtime
+    std::string link = std::string("cc -shared -o /tmp/bernard_aot_test.so /tmp/bernard_aot_test.o ") +
+                       BERNARD_RUNTIME_LIB + " -lstdc++ -lpthread -lm";
+    ASSERT_EQ(std::system(link.c_str()), 0);
+    void *library = dlopen("/tmp/bernard_aot_test.so", RTLD_NOW | RTLD_LOCAL);
+    ASSERT_NE(library, nullptr) << dlerror();
+    auto hyp = reinterpret_cast<double (*)(double, double)>(dlsym(library, "hyp"));
+    auto zero = reinterpret_cast<double (*)()>(dlsym(library, "zero"));
+    ASSERT_NE(hyp, nullptr);
+    ASSERT_NE(zero, nullptr);
+    EXPECT_EQ(hyp(3, 4), 5);
+    EXPECT_EQ(zero(), 0);
+    dlclose(library);
+
+    // the JIT gets its own target machine and module back
+    std::string jit("def afterScript(x) x + 1; afterScript(1);");
+    Scanner after(jit);
+    MainLoop(after);
+    EXPECT_EQ(LastResult(), 2);
+    std::ifstream headerFile("/tmp/bernard_aot_test.h");
+    std::stringstream header;
+    header << headerFile.rdbuf();
+    EXPECT_NE(header.str().find("double sq(double);"), std::string::npos);
+    EXPECT_NE(header.str().find("double hyp(double, double);"), std::string::npos);
+    EXPECT_NE(header.str().find("double zero(void);"), std::string::npos);
+    EXPECT_NE(header.str().find("double bernard_main(void);"), std::string::npos);
+    EXPECT_EQ(header.str().find("putchard"), std::string::npos);
+}
+
+TEST(ast, aheadOfTimeLeavesTheJIT) {
+    SetMemoize(true, 64);
+    InitJIT();
+    Scanner jit("extern putchard(x); def aotm(x) x * 2; def aotp(x) putchard(x) * 0 + x; aotm(1);");
+    RunScript(jit);
+    ASSERT_NE(GetMemoCache("aotm"), nullptr);
+
+    // pure and unmemoized in the script, neither may leak into the JIT
+    Scanner script("def aotm(x) x * 3; def aotp(x) x;");
+    ASSERT_TRUE(CompileScript(script, "/tmp/bernard_aot_leave.o"));
+    EXPECT_NE(GetMemoCache("aotm"), nullptr);
+    Scanner caller("def aotq(x) aotp(x) + 1; aotq(2);");
+    RunScript(caller);
+    EXPECT_EQ(LastResult(), 3);
+    EXPECT_EQ(GetMemoCache("aotq"), nullptr);
+    SetMemoize(false);
+}
+
+TEST(ast, redefinition) {
+    InitJIT();
+    Scanner defs("def scale(x) x * 2; def twice(x) scale(x) + scale(x); twice(1);");
+    RunScript(defs);
+    EXPECT_EQ(LastResult(), 4);
+    size_t live = GetJIT()->getDefinitionCount();
+
+    // callers compiled against the first version follow the stub to the latest one
+    for (int i = 3; i < 200; i++) {
+        Scanner redef("def scale(x) x * " + std::to_string(i) + "; twice(1);");
+        RunScript(redef);
+        ASSERT_EQ(LastResult(), 2 * i);
+    }
+    EXPECT_EQ(GetJIT()->getDefinitionCount(), live);
+    EXPECT_EQ(GetJIT()->getRetiredCount(), 0);
+}
+
+TEST(ast, redefinitionRebuildsCallers) {
+    SetMemoize(true, 64);
+    InitJIT();
+    Scanner defs("def rg(x) x; def rf(x) rg(x) + 1; rf(1);");
+    RunScript(defs);
+    EXPECT_EQ(LastResult(), 2);
+    ASSERT_NE(GetMemoCache("rf"), nullptr);
+    // rf's cache holds rf(1) of the old rg
+    Scanner redef("def rg(x) x * 2; rf(1);");
+    RunScript(redef);
+    EXPECT_EQ(LastResult(), 3);
+    SetMemoize(false);
+
+    // rf would pass a double where rg now takes a buffer
+    Scanner buffer("def rg(a[]) len(a);");
+    EXPECT_FALSE(RunScript(buffer));
+    Scanner still("rf(2);");
+    RunScript(still);
+    EXPECT_EQ(LastResult(), 5);
+}
+
+TEST(ast, parallelFor) {
+    SetParallelism(4, 16);
+    InitJIT();
+    Scanner sum("def psum(n k) parallel for i = 0, i < n in i * k; psum(1000, 2);");
+    RunScript(sum);
+    EXPECT_EQ(LastResult(), 999000);
+
+    Scanner stepped("parallel for i = 1, i < 10, 2 in i;");
+    RunScript(stepped);
+    EXPECT_EQ(LastResult(), 25);
+
+    // nested loops run the inner one inline on the worker
+    Scanner nested("def inner(j) parallel for i = 0, i < j in 1; parallel for j = 0, j < 100 in inner(j);");
+    RunScript(nested);
+    EXPECT_EQ(LastResult(), 4950);
+
+    Scanner empty("parallel for i = 5, i < 0 in 1;");
+    RunScript(empty);
+    EXPECT_EQ(LastResult(), 0);
+    SetParallelism(0);
+}
+
+TEST(ast, lazySpeculation) {
+    SetLazyCompile(true, 1);
+    InitJIT();
+    Scanner defs("def leaf(x) x * 2; def caller(x) if x < 0 then leaf(x) else x; caller(3);");
+    RunScript(defs);
+    EXPECT_EQ(LastResult(), 3);
+    // caller's first call queued leaf, which it did not reach
+    GetJIT()->waitForSpeculation();
+    Scanner first("caller(-4);");
+    RunScript(first);
+    EXPECT_EQ(LastResult(), -8);
+
+    llvm::orc::SpeculationStats stats = GetJIT()->getSpeculationStats();
+    EXPECT_EQ(stats.FirstCalls, 2);
+    EXPECT_GE(stats.Hits, 1);
+    EXPECT_GE(stats.SpeculativeCompiles, 1);
+
+    // a redefinition starts out lazy again
+    Scanner redef("def leaf(x) x * 3; caller(-4);");
+    RunScript(redef);
+    EXPECT_EQ(LastResult(), -12);
+
+    SetLazyCompile(false);
+    InitJIT();
+}
+
+TEST(ast, profileGuided) {
+    InitJIT();
+    SetProfiling(true);
+    Scanner defs("def clamp(x) if x < 10 then x else 10; def count(n) for i = 0, i < n in clamp(i);");
+    RunScript(defs);
+    for (int i = 0; i < 20; i++) {
+        Scanner call("clamp(" + std::to_string(i) + ");");
+        RunScript(call);
+    }
+    Scanner loop("count(5);");
+    RunScript(loop);
+
+    // entries, then the taken and not taken edge of each branch
+    EXPECT_EQ(GetProfile().Counts("clamp"), (std::vector<uint64_t>{26, 16, 10}));
+    EXPECT_EQ(GetProfile().Counts("count"), (std::vector<uint64_t>{1, 5, 1}));
+
+    const char *path = "/tmp/bernard_pgo_test.profile";
+    ASSERT_TRUE(SaveProfile(path));
+    EXPECT_EQ(ReoptimizeWithProfile(), 2);
+    Scanner after("clamp(3) + clamp(30);");
+    RunScript(after);
+    EXPECT_EQ(LastResult(), 13);
+    // the recompiled code has no counters
+    EXPECT_EQ(GetProfile().Counts("clamp")[0], 26);
+
+    // warm-up recompiles by itself
+    SetProfiling(true, 3);
+    Scanner warm("def twice(x) x * 2; twice(1); twice(2); twice(3); twice(4);");
+    RunScript(warm);
+    EXPECT_EQ(LastResult(), 8);
+    EXPECT_EQ(GetProfile().Counts("twice"), std::vector<uint64_t>{3});
+
+    SetProfiling(false);
+    EXPECT_TRUE(LoadProfile(path));
+    std::remove(path);
+}
+
+TEST(ast, incrementalReload) {
+    InitJIT();
+    std::string lib("def sq(x) x * x; def quad(x) sq(x) * sq(x); def inc(x) x + 1; def use(x) inc(quad(x));");
+    Scanner first(lib + " use(2);");
+    EXPECT_EQ(ReloadScript(first), 4);
+    EXPECT_EQ(LastResult(), 17);
+    Scanner same(lib + " use(2);");
+    EXPECT_EQ(ReloadScript(same), 0);
+
+    // only the edited def, layout does not count
+    Scanner edited("def sq(x) x*x; def quad(x) sq(x) * sq(x); def inc(x) x + 2; def use(x) inc(quad(x)); use(2);");
+    EXPECT_EQ(ReloadScript(edited), 1);
+    EXPECT_EQ(LastResult(), 18);
+
+    // a memoized caller of an edited def drops the results it cached
+    SetMemoize(true, 64);
+    Scanner memo("def base(x) x * 3; def cached(x) base(x) + 1; cached(2);");
+    EXPECT_EQ(ReloadScript(memo), 2);
+    EXPECT_EQ(LastResult(), 7);
+    Scanner rebased("def base(x) x * 5; def cached(x) base(x) + 1; cached(2);");
+    EXPECT_EQ(ReloadScript(rebased), 2);
+    EXPECT_EQ(LastResult(), 11);
+    SetMemoize(false);
+}
+
+TEST(ast, buffers) {
+    InitJIT();
+    std::vector<double> xs = {1, 2, 3, 4, 5};
+    BindBuffer("xs", xs.data(), xs.size());
+    Scanner defs("def total(a[]) var s = 0 in (for i = 0, i < len(a) - 1 in s = s + a[i]) + s; \
+        def scale(a[] k) for i = 0, i < len(a) - 1 in a[i] = a[i] * k; \
+        total(xs);");
+    RunScript(defs);
+    EXPECT_EQ(LastResult(), 15);
+
+    // the script writes the host's memory
+    Scanner scaled("scale(xs, 2); xs[4] + total(xs);");
+    RunScript(scaled);
+    EXPECT_EQ(xs[0], 2);
+    EXPECT_EQ(LastResult(), 40);
+    BindBuffer("xs", nullptr, 0);
+
+    auto total = reinterpret_cast<double (*)(double *, int64_t)>(FunctionAddress("total"));
+    ASSERT_NE(total, nullptr);
+    std::vector<double> ys(1000, 0.5);
+    EXPECT_EQ(total(ys.data(), ys.size()), 500);
+    EXPECT_EQ(FunctionAddress("missing"), nullptr);
+}
+
+TEST(ast, hashConsing) {
+    InitJIT();
+    SharingStats before = GetSharingStats();
+    Scanner defs("def csef(x y) (x * y + 1) * (x * y + 1); \
+        def cseg(x y) x * y + 1 + sqrt(x * y) + sqrt(x * y); \
+        csef(2, 3) + cseg(4, 4);");
+    RunScript(defs);
+    EXPECT_EQ(LastResult(), 74);
+    EXPECT_GE(GetSharingStats().shared - before.shared, 6);
+    EXPECT_GE(GetSharingStats().reused - before.reused, 1);
+
+    // an assignment between two equal subexpressions makes them differ
+    Scanner assigned("def h(x) var y = x in (y + 1) * ((y = y * 2) + (y + 1)); h(3);");
+    RunScript(assigned);
+    EXPECT_EQ(LastResult(), 52);
+
+    SetHashConsing(false);
+    before = GetSharingStats();
+    Scanner off("def csek(x y) (x * y + 1) * (x * y + 1); csek(2, 3);");
+    RunScript(off);
+    EXPECT_EQ(LastResult(), 49);
+    EXPECT_EQ(GetSharingStats().shared, before.shared);
+    SetHashConsing(true);
+}
+
+TEST(ast, memoryQuota) {
+    // every def is over a quota of one byte as soon as it is compiled
+    SetMemoryQuota(1);
+    InitJIT();
+    Scanner defs("def mqf(x) x * 3; def mqg(x) mqf(x) + 1; mqg(2);");
+    RunScript(defs);
+    EXPECT_EQ(LastResult(), 7);
+    MemoryUsage usage = GetMemoryUsage();
+    EXPECT_EQ(usage.evictedDefs, 2);
+    EXPECT_GE(usage.evictions, 2);
+    EXPECT_GT(usage.bitcodeBytes, 0);
+    EXPECT_GE(usage.storedDefs, 2);
+
+    Scanner again("mqg(5);");
+    RunScript(again);
+    EXPECT_EQ(LastResult(), 16);
+    EXPECT_GE(GetMemoryUsage().recompiles, 2);
+
+    SetMemoryQuota(0);
+    InitJIT();
+    Scanner unlimited("def mqf(x) x * 3; mqf(2);");
+    RunScript(unlimited);
+    usage = GetMemoryUsage();
+    EXPECT_GT(usage.codeBytes, 0);
+    EXPECT_EQ(usage.evictions, 0);
+    EXPECT_EQ(usage.bitcodeBytes, 0);
+}
+
+TEST(ast, memoryQuotaConcurrentCalls) {
+    SetMemoryQuota(1);
+    InitJIT();
+    Scanner defs("def mqc(x) x * 2; def mqd(x) mqc(x) + 1;");
+    RunScript(defs);
+    std::unique_ptr<ExprBatch> batch = CompileBatch({"mqd(1)", "mqc(4)"});
+    ASSERT_TRUE(batch->Error(0).empty());
+    ASSERT_TRUE(batch->Error(1).empty());
+
+    // every call that leaves last evicts, the others must never run freed code
+    std::atomic<int> wrong{0};
+    std::vector<std::thread> callers;
+    for (int t = 0; t < 4; t++)
+        callers.emplace_back([&] {
+            for (int i = 0; i < 2000; i++)
+                if (batch->Run(0) != 3 || batch->Run(1) != 8) wrong++;
+        });
+    // defs compiled meanwhile push the quota from this thread too
+    for (int i = 0; i < 50; i++) {
+        Scanner redef("def mqe(x) x + " + std::to_string(i) + ";");
+        RunScript(redef);
+    }
+    for (auto &caller : callers) caller.join();
+    EXPECT_EQ(wrong, 0);
+    EXPECT_GT(GetMemoryUsage().evictions, 0);
+    batch.reset();
+    SetMemoryQuota(0);
+}
+
+TEST(ast, quietCapture) {
+    InitJIT();
+    SetQuiet(true);
+    SetCapture("capf, capk*", 8);
+    testing::internal::CaptureStderr();
+    Scanner script("def capf(x) x * 2 + 1; def capg(x) x + 3; capf(4) + capg(1);");
+    RunScript(script);
+    EXPECT_EQ(testing::internal::GetCapturedStderr(), "");
+    EXPECT_EQ(LastResult(), 13);
+
+    std::string dump = DumpCapture("capf");
+    EXPECT_NE(dump.find("; capf #"), std::string::npos);
+    EXPECT_NE(dump.find("optimized ir"), std::string::npos);
+    EXPECT_NE(dump.find("define double @capf"), std::string::npos);
+    EXPECT_NE(dump.find("; assembly"), std::string::npos);
+    EXPECT_EQ(DumpCapture("capg"), "");
+
+    SetCapture("");
+    SetQuiet(false);
+}
+
+// not exported, only reachable through RegisterHostFunction
+static double HostTriple(double x) { return 3 * x; }
+
+static double HostSum(double *data, int64_t len) {
+    double sum = 0;
+    for (int64_t i = 0; i < len; i++) sum += data[i];
+    return sum;
+}
+
+// the host version differs from the bitcode one, so results tell which of them ran
+static double HostIncrement(double x) { return x + 100; }
+
+// bitcode defining double name(double x) { return x + 1; }, and the same under `extra` with extraLinkage
+static std::string IncrementBitcode(const std::string &name, const std::string &extra = "",
+                                    llvm::GlobalValue::LinkageTypes extraLinkage = llvm::GlobalValue::ExternalLinkage) {
+    llvm::LLVMContext context;
+    llvm::Module module("helper", context);
+    llvm::IRBuilder<> builder(context);
+    auto *type = llvm::FunctionType::get(builder.getDoubleTy(), {builder.getDoubleTy()}, false);
+    for (auto &fn : {name, extra}) {
+        if (fn.empty()) continue;
+        auto linkage = fn == name ? llvm::GlobalValue::ExternalLinkage : extraLinkage;
+        auto *func = llvm::Function::Create(type, linkage, fn, module);
+        builder.SetInsertPoint(llvm::BasicBlock::Create(context, "entry", func));
+        builder.CreateRet(builder.CreateFAdd(func->getArg(0), llvm::ConstantFP::get(builder.getDoubleTy(), 1.0)));
+    }
+    std::string bitcode;
+    llvm::raw_string_ostream os(bitcode);
+    llvm::WriteBitcodeToFile(module, os);
+    os.flush();
+    return bitcode;
+}
+
+TEST(ast, hostFunctions) {
+    InitJIT();
+    ASSERT_TRUE(RegisterHostFunction("hosttriple", reinterpret_cast<void *>(&HostTriple), {false}));
+    ASSERT_TRUE(RegisterHostFunction("hostsum", reinterpret_cast<void *>(&HostSum), {true}));
+    EXPECT_FALSE(RegisterHostFunction("hosttriple", reinterpret_cast<void *>(&HostSum), {true}));
+    std::vector<double> xs = {1, 2, 3};
+    BindBuffer("hostxs", xs.data(), xs.size());
+    Scanner calls("extern hosttriple(x); extern hostsum(a[]); hosttriple(2) + hostsum(hostxs);");
+    RunScript(calls);
+    EXPECT_EQ(LastResult(), 12);
+    BindBuffer("hostxs", nullptr, 0);
+
+    // an extern with other params than the host function is rejected
+    Scanner mismatched("extern hostsum(x); hostsum(1);");
+    RunScript(mismatched);
+    EXPECT_EQ(LastResult(), 12);
+
+    EXPECT_FALSE(RegisterHostFunction("hostinc", reinterpret_cast<void *>(&HostIncrement), {false, false},
+                                      IncrementBitcode("hostinc")));
+    EXPECT_FALSE(RegisterHostFunction("hostinc", reinterpret_cast<void *>(&HostIncrement), {false},
+                                      IncrementBitcode("other")));
+    // each def's module links the bitcode in, a second exported symbol would clash between them
+    EXPECT_FALSE(RegisterHostFunction("hostinc", reinterpret_cast<void *>(&HostIncrement), {false},
+                                      IncrementBitcode("hostinc", "incextra")));
+    ASSERT_TRUE(RegisterHostFunction("hostinc", reinterpret_cast<void *>(&HostIncrement), {false},
+                                     IncrementBitcode("hostinc", "incextra", llvm::GlobalValue::InternalLinkage)));
+    Scanner inlined("extern hostinc(x); def useinc(x) hostinc(x) * 2; useinc(1) + hostinc(2);");
+    RunScript(inlined);
+    EXPECT_EQ(LastResult(), 7);
+
+    // a new JIT has the registered functions too
+    InitJIT();
+    Scanner again("extern hosttriple(x); hosttriple(5);");
+    RunScript(again);
+    EXPECT_EQ(LastResult(), 15);
+}
+
+TEST(ast, remoteExecutor) {
+    ASSERT_TRUE(RegisterHostFunction("hostlocal", reinterpret_cast<void *>(&HostTriple), {false}));
+    ASSERT_TRUE(InitRemoteJIT(BERNARD_EXECUTOR_PATH, 2));
+    Scanner defs("def scale(x) x * 3; def twice(x) scale(x) + scale(x); twice(7);");
+    RunScript(defs);
+    EXPECT_EQ(LastResult(), 42);
+
+    // host functions live in this process, only inlined ones reach an executor
+    EXPECT_FALSE(RegisterHostFunction("hostremote", reinterpret_cast<void *>(&HostTriple), {false}));
+    Scanner local("extern hostlocal(x);");
+    EXPECT_FALSE(RunScript(local));
+    Scanner runtime("extern putchard(x);");
+    EXPECT_TRUE(RunScript(runtime));
+    EXPECT_EQ(*GetExecutorPool()->Ping(5), 5);
+
+    // the crash only takes down the executor, its replacement has the same defs
+    Scanner crash("extern abort(); abort();");
+    RunScript(crash);
+    EXPECT_GT(GetExecutorPool()->Restarts(), 0);
+    for (int i = 0; i < 4; i++) {
+        Scanner again("def scale(x) x * " + std::to_string(i) + "; twice(5);");
+        RunScript(again);
+        ASSERT_EQ(LastResult(), 10 * i);
+    }
+    InitJIT();
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
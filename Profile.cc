@@ -0,0 +1,95 @@
+#include <Profile.h>
+
+#include <fstream>
+#include <sstream>
+
+std::atomic<uint64_t> *ProfileData::Allocate(const std::string &name, size_t counters) {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_arrays.emplace_back(new std::atomic<uint64_t>[counters]);
+    std::atomic<uint64_t> *array = m_arrays.back().get();
+    for (size_t i = 0; i < counters; i++) array[i].store(0, std::memory_order_relaxed);
+    Entry &entry = m_entries[name];
+    entry.live = array;
+    entry.size = counters;
+    entry.frozen.clear();
+    return array;
+}
+
+std::vector<uint64_t> ProfileData::Counts(const std::string &name) const {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto it = m_entries.find(name);
+    if (it == m_entries.end()) return {};
+    if (!it->second.live) return it->second.frozen;
+    std::vector<uint64_t> counts(it->second.size);
+    for (size_t i = 0; i < counts.size(); i++) counts[i] = it->second.live[i].load(std::memory_order_relaxed);
+    return counts;
+}
+
+void ProfileData::Freeze(const std::string &name) {
+    std::vector<uint64_t> counts = Counts(name);
+    std::lock_guard<std::mutex> guard(m_mutex);
+    auto it = m_entries.find(name);
+    if (it == m_entries.end()) return;
+    it->second.live = nullptr;
+    it->second.frozen = std::move(counts);
+}
+
+std::vector<std::string> ProfileData::Warm(uint64_t minEntries) const {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    std::vector<std::string> names;
+    for (auto &entry : m_entries)
+        if (entry.second.live && entry.second.size && entry.second.live[0].load(std::memory_order_relaxed) >= minEntries)
+            names.push_back(entry.first);
+    return names;
+}
+
+bool ProfileData::Save(const std::string &path) const {
+    std::vector<std::pair<std::string, std::vector<uint64_t>>> profiles;
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        for (auto &entry : m_entries) profiles.emplace_back(entry.first, std::vector<uint64_t>());
+    }
+    for (auto &profile : profiles) profile.second = Counts(profile.first);
+
+    std::ofstream out(path);
+    if (!out) return false;
+    out << "# bernard profile v1\n";
+    for (auto &profile : profiles) {
+        out << profile.first << " " << profile.second.size();
+        for (uint64_t count : profile.second) out << " " << count;
+        out << "\n";
+    }
+    return bool(out);
+}
+
+bool ProfileData::Load(const std::string &path) {
+    std::ifstream in(path);
+    if (!in) return false;
+    std::map<std::string, std::vector<uint64_t>> profiles;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        std::istringstream fields(line);
+        std::string name;
+        size_t size;
+        if (!(fields >> name >> size)) return false;
+        std::vector<uint64_t> counts(size);
+        for (auto &count : counts)
+            if (!(fields >> count)) return false;
+        profiles[name] = std::move(counts);
+    }
+
+    std::lock_guard<std::mutex> guard(m_mutex);
+    for (auto &profile : profiles) {
+        Entry &entry = m_entries[profile.first];
+        entry.live = nullptr;
+        entry.size = profile.second.size();
+        entry.frozen = std::move(profile.second);
+    }
+    return true;
+}
+
+size_t ProfileData::Size() const {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_entries.size();
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Execution counts per def for profile-guided optimization. Counter 0 counts entries, then every
+// if and loop branch gets two, for the taken and the not taken edge, in codegen order. Instrumented
+// code bumps the live counters of its def, a frozen profile is a snapshot that no code updates.
+class ProfileData {
+public:
+    // Zeroed counters for a newly instrumented version of name, they replace whatever was
+    // collected for it. Arrays handed out before stay valid, older versions may still run.
+    std::atomic<uint64_t> *Allocate(const std::string &name, size_t counters);
+
+    // counts of name, live or frozen, empty when there are none
+    std::vector<uint64_t> Counts(const std::string &name) const;
+
+    // live counters of name stop being read, the counts collected so far become its profile
+    void Freeze(const std::string &name);
+
+    // names with live counters entered at least minEntries times
+    std::vector<std::string> Warm(uint64_t minEntries) const;
+
+    // "name count c0 c1 ..." per line
+    bool Save(const std::string &path) const;
+
+    // adds the profiles in path as frozen ones, replacing those of the same names
+    bool Load(const std::string &path);
+
+    size_t Size() const;
+
+private:
+    struct Entry {
+        std::atomic<uint64_t> *live = nullptr;
+        size_t size = 0;
+        std::vector<uint64_t> frozen;
+    };
+
+    mutable std::mutex m_mutex;
+    std::map<std::string, Entry> m_entries;
+    // every array ever handed out, JIT'd code holds raw pointers to them
+    std::vector<std::unique_ptr<std::atomic<uint64_t>[]>> m_arrays;
+};
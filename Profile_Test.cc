@@ -0,0 +1,50 @@
+#include <gtest/gtest.h>
+#include <Profile.h>
+
+#include <cstdio>
+
+TEST(Profile, liveAndFrozen) {
+    ProfileData profile;
+    std::atomic<uint64_t> *counters = profile.Allocate("f", 3);
+    counters[0] += 5;
+    counters[1] += 4;
+    counters[2] += 1;
+    EXPECT_EQ(profile.Counts("f"), (std::vector<uint64_t>{5, 4, 1}));
+    EXPECT_EQ(profile.Warm(5), std::vector<std::string>{"f"});
+    EXPECT_TRUE(profile.Warm(6).empty());
+
+    // code still running the old version can't change a frozen profile
+    profile.Freeze("f");
+    counters[0] += 100;
+    EXPECT_EQ(profile.Counts("f"), (std::vector<uint64_t>{5, 4, 1}));
+    EXPECT_TRUE(profile.Warm(0).empty());
+    EXPECT_TRUE(profile.Counts("g").empty());
+
+    // a new instrumented version starts over
+    profile.Allocate("f", 1);
+    EXPECT_EQ(profile.Counts("f"), std::vector<uint64_t>{0});
+}
+
+TEST(Profile, saveAndLoad) {
+    const char *path = "/tmp/bernard_profile_test.txt";
+    ProfileData profile;
+    std::atomic<uint64_t> *f = profile.Allocate("f", 3);
+    f[0] = 7;
+    f[2] = 3;
+    profile.Allocate("g", 1)[0] = 9;
+    ASSERT_TRUE(profile.Save(path));
+
+    ProfileData loaded;
+    ASSERT_TRUE(loaded.Load(path));
+    EXPECT_EQ(loaded.Size(), 2);
+    EXPECT_EQ(loaded.Counts("f"), (std::vector<uint64_t>{7, 0, 3}));
+    EXPECT_EQ(loaded.Counts("g"), std::vector<uint64_t>{9});
+    EXPECT_TRUE(loaded.Warm(0).empty());
+    EXPECT_FALSE(loaded.Load("/nonexistent/profile"));
+    std::remove(path);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
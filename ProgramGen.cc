@@ -0,0 +1,67 @@
+#include <ProgramGen.h>
+
+uint64_t ProgramGen::Next() {
+    // xorshift64*, fixed so the generated programs never depend on the standard library
+    m_state ^= m_state >> 12;
+    m_state ^= m_state << 25;
+    m_state ^= m_state >> 27;
+    return m_state * 0x2545F4914F6CDD1DULL;
+}
+
+std::string ProgramGen::Operand(const std::string &var) {
+    if (!var.empty() && Next() % 2) return var;
+    return std::to_string(Next() % 100 + 1);
+}
+
+char ProgramGen::Operator() {
+    static const char ops[] = {'+', '-', '*', '+'};
+    return ops[Next() % sizeof(ops)];
+}
+
+std::string ProgramGen::DeepExpression(int depth, const std::string &var) {
+    std::string expr = var;
+    for (int i = 0; i < depth; i++) expr = "(" + expr + " " + Operator() + " " + Operand("") + ")";
+    return expr;
+}
+
+std::string ProgramGen::WideExpression(int terms, const std::string &var) {
+    std::string expr = Operand(var);
+    for (int i = 1; i < terms; i++) {
+        expr += " ";
+        expr += Operator();
+        expr += " " + Operand(var);
+    }
+    return expr;
+}
+
+std::string ProgramGen::FunctionDef(const std::string &name, int args, int terms) {
+    std::string def = "def " + name + "(";
+    for (int i = 0; i < args; i++) def += (i ? " a" : "a") + std::to_string(i);
+    def += ") ";
+    std::string expr = Operand("a0");
+    for (int i = 1; i < terms; i++) {
+        expr += " ";
+        expr += Operator();
+        expr += " " + Operand("a" + std::to_string(Next() % args));
+    }
+    return def + expr + ";";
+}
+
+std::string ProgramGen::FunctionCall(const std::string &name, int args) {
+    std::string call = name + "(";
+    for (int i = 0; i < args; i++) call += (i ? ", " : "") + Operand("");
+    return call + ");";
+}
+
+std::string ProgramGen::LoopKernel(const std::string &name) {
+    return "def " + name + "step(x) x * x + 1; def " + name + "(n) for i = 0, i < n, 1 in " + name + "step(i);";
+}
+
+std::string ProgramGen::Program(const std::string &prefix, int defs, int terms) {
+    std::string src;
+    for (int i = 0; i < defs; i++) {
+        std::string name = prefix + std::to_string(i);
+        src += FunctionDef(name, 2, terms) + " " + FunctionCall(name, 2) + " ";
+    }
+    return src;
+}
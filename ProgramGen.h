@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Deterministic synthetic program generator for the benchmarks. The same seed yields
+// the same source on every platform, so numbers are comparable across commits.
+class ProgramGen {
+public:
+    explicit ProgramGen(uint64_t seed = 0x5eed) : m_state(seed) {}
+
+    // ((((x + 1) * 2) - 3) ...) nested `depth` levels deep
+    std::string DeepExpression(int depth, const std::string &var = "x");
+
+    // x + 1 * x - 2 ... with `terms` operands
+    std::string WideExpression(int terms, const std::string &var = "x");
+
+    // def name(a0 a1 ...) <wide expression over the args>
+    std::string FunctionDef(const std::string &name, int args, int terms);
+
+    // call of a function defined by FunctionDef with literal arguments
+    std::string FunctionCall(const std::string &name, int args);
+
+    // def name(n) for i = 0, i < n, 1 in step(i) plus its helper `step`
+    std::string LoopKernel(const std::string &name);
+
+    // a mix of defs and top-level calls, `defs` functions each called once
+    std::string Program(const std::string &prefix, int defs, int terms);
+
+private:
+    uint64_t Next();
+
+    std::string Operand(const std::string &var);
+
+    char Operator();
+
+    uint64_t m_state;
+};
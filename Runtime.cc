@@ -0,0 +1,59 @@
+#include <Runtime.h>
+#include <Stats.h>
+#include <ThreadPool.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+// pool behind parallel for, created on first use. Every parallel for holds its own reference, a
+// reconfiguration only drops the pool once the loops running on it are done.
+std::mutex g_ThreadPoolMutex;
+std::shared_ptr<ThreadPool> g_ThreadPool;
+size_t g_ParallelThreads = 0;
+int64_t g_ParallelGrain = 0;
+
+}
+
+void SetParallelism(size_t threads, int64_t grain) {
+    std::lock_guard<std::mutex> guard(g_ThreadPoolMutex);
+    g_ParallelThreads = threads;
+    g_ParallelGrain = grain;
+    // the next parallel for starts a pool with the new thread count
+    g_ThreadPool = nullptr;
+}
+
+double bernard_parallel_for(double (*chunk)(void *, int64_t, int64_t), void *env, int64_t n) {
+    BERNARD_TIME_SCOPE("runtime.parallel_for");
+    std::shared_ptr<ThreadPool> pool;
+    int64_t grain;
+    {
+        std::lock_guard<std::mutex> guard(g_ThreadPoolMutex);
+        if (!g_ThreadPool) g_ThreadPool = std::make_shared<ThreadPool>(g_ParallelThreads);
+        pool = g_ThreadPool;
+        grain = g_ParallelGrain;
+    }
+    if (n <= 0) return 0;
+    if (grain <= 0) grain = std::max<int64_t>(1, n / int64_t(pool->Concurrency() * 8));
+
+    // one partial sum per fixed chunk, added up in order so the result does not depend on scheduling
+    int64_t chunks = (n + grain - 1) / grain;
+    std::vector<double> partial(chunks);
+    pool->ParallelFor(chunks, 1, [&](int64_t lo, int64_t hi) {
+        for (int64_t i = lo; i < hi; i++) partial[i] = chunk(env, i * grain, std::min(n, (i + 1) * grain));
+    });
+    double sum = 0;
+    for (double val : partial) sum += val;
+    return sum;
+}
+
+double putchard(double X) {
+    fputc((char)X, stderr);
+    return 0;
+}
+
+int32_t bernard_ping(int32_t x) { return x; }
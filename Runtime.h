@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Functions JIT'd code calls into. They are linked into every process that runs generated code:
+// the engine itself, bernard_executor and hosts loading bernardc output.
+
+// threads for parallel for, the caller included, 0 means one per hardware thread. grain is the
+// number of iterations per chunk, 0 picks about eight chunks per thread.
+void SetParallelism(size_t threads, int64_t grain = 0);
+
+extern "C" {
+
+// prints the character with code X to stderr
+double putchard(double X);
+
+// runtime entry of parallel for: sums chunk(env, lo, hi) over chunks covering [0, n)
+double bernard_parallel_for(double (*chunk)(void *, int64_t, int64_t), void *env, int64_t n);
+
+// returns x, a call with no work in it to measure the cost of reaching an executor
+int32_t bernard_ping(int32_t x);
+}
@@ -1,4 +1,5 @@
 #include <Scanner.h>
+#include <Stats.h>
 
 #include <cctype>
 #include <set>
@@ -9,6 +10,8 @@ const char gSemicolon = ';';
 const char gDot = '.';
 const char gLeftParentheses = '(';
 const char gRightParentheses = ')';
+const char gLeftBracket = '[';
+const char gRightBracket = ']';
 const std::set<std::string> gKeyWords = {
     "double",
 };
@@ -22,6 +25,7 @@ Scanner::Scanner(const std::string &src) : m_src(src), m_idx(0) {}
 Scanner::~Scanner() {}
 
 Token Scanner::NextToken() const {
+    BERNARD_TIME_SCOPE("scanner.next_token");
     char ch = 0;
     m_peek.Reset();
     if (m_idx == m_src.length()) return m_peek;
@@ -49,6 +53,12 @@ Token Scanner::NextToken() const {
             } else if (ch == gRightParentheses) {
                 m_peek.m_type = TokenType::RIGHT_PARENT;
                 return m_peek;
+            } else if (ch == gLeftBracket) {
+                m_peek.m_type = TokenType::LEFT_BRACKET;
+                return m_peek;
+            } else if (ch == gRightBracket) {
+                m_peek.m_type = TokenType::RIGHT_BRACKET;
+                return m_peek;
             } else if (ch == gSemicolon) {
                 m_peek.m_type = TokenType::SEMICOLON;
                 return m_peek;
@@ -76,6 +86,10 @@ Token Scanner::NextToken() const {
                     m_peek.m_type = TokenType::FOR;
                 else if (m_peek.m_val == "in")
                     m_peek.m_type = TokenType::IN;
+                else if (m_peek.m_val == "var")
+                    m_peek.m_type = TokenType::VAR_DECL;
+                else if (m_peek.m_val == "parallel")
+                    m_peek.m_type = TokenType::PARALLEL;
                 if (ch != gSpace) m_idx--;
                 return m_peek;
             }
@@ -10,6 +10,8 @@ enum class TokenType {
     SEMICOLON,
     LEFT_PARENT,
     RIGHT_PARENT,
+    LEFT_BRACKET,
+    RIGHT_BRACKET,
     EXTERN,
     DEF,
     IF,
@@ -17,6 +19,8 @@ enum class TokenType {
     ELSE,
     FOR,
     IN,
+    VAR_DECL,
+    PARALLEL,
     Eof,
 };
 
@@ -93,6 +93,51 @@ TEST(Scanner, keyword) {
     EXPECT_EQ(tokens[3].m_val, ";");
 }
 
+TEST(Scanner, varDecl) {
+    const std::string src("var x = 1 in x = x + 2;");
+
+    Scanner sc(src);
+    std::vector<Token> tokens;
+    Token tok = sc.NextToken();
+    while (tok.m_type != TokenType::Eof) {
+        tokens.push_back(sc.CurToken());
+        tok = sc.NextToken();
+    }
+
+    EXPECT_EQ(tokens.size(), 11);
+
+    EXPECT_EQ(tokens[0].m_type, TokenType::VAR_DECL);
+    EXPECT_EQ(tokens[1].m_type, TokenType::VAR);
+    EXPECT_EQ(tokens[2].m_val, "=");
+    EXPECT_EQ(tokens[4].m_type, TokenType::IN);
+    EXPECT_EQ(tokens[6].m_type, TokenType::OPERATOR);
+    EXPECT_EQ(tokens[6].m_val, "=");
+}
+
+TEST(Scanner, parallelFor) {
+    Scanner sc("parallel for parallelism");
+    EXPECT_EQ(sc.NextToken().m_type, TokenType::PARALLEL);
+    EXPECT_EQ(sc.NextToken().m_type, TokenType::FOR);
+    Token tok = sc.NextToken();
+    EXPECT_EQ(tok.m_type, TokenType::VAR);
+    EXPECT_EQ(tok.m_val, "parallelism");
+}
+
+TEST(Scanner, brackets) {
+    Scanner sc("a[] xs[i+1]");
+    EXPECT_EQ(sc.NextToken().m_type, TokenType::VAR);
+    EXPECT_EQ(sc.NextToken().m_type, TokenType::LEFT_BRACKET);
+    EXPECT_EQ(sc.NextToken().m_type, TokenType::RIGHT_BRACKET);
+    Token tok = sc.NextToken();
+    EXPECT_EQ(tok.m_type, TokenType::VAR);
+    EXPECT_EQ(tok.m_val, "xs");
+    EXPECT_EQ(sc.NextToken().m_type, TokenType::LEFT_BRACKET);
+    EXPECT_EQ(sc.NextToken().m_val, "i");
+    EXPECT_EQ(sc.NextToken().m_val, "+");
+    EXPECT_EQ(sc.NextToken().m_val, "1");
+    EXPECT_EQ(sc.NextToken().m_type, TokenType::RIGHT_BRACKET);
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
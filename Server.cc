@@ -0,0 +1,319 @@
+#include <Server.h>
+#include <Scanner.h>
+#include <Stats.h>
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+// fills addr with the Unix-domain socket at path, or localhost:port when path is empty
+socklen_t MakeAddress(const std::string &path, int port, sockaddr_storage *addr) {
+    memset(addr, 0, sizeof(*addr));
+    if (!path.empty()) {
+        auto *un = reinterpret_cast<sockaddr_un *>(addr);
+        if (path.size() >= sizeof(un->sun_path)) return 0;
+        un->sun_family = AF_UNIX;
+        memcpy(un->sun_path, path.c_str(), path.size() + 1);
+        return sizeof(sockaddr_un);
+    }
+    auto *in = reinterpret_cast<sockaddr_in *>(addr);
+    in->sin_family = AF_INET;
+    in->sin_port = htons(port);
+    in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return sizeof(sockaddr_in);
+}
+
+// replies are small and latency bound, don't let Nagle hold them back
+void NoDelay(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+bool AtEnd(const Scanner &scanner) {
+    // unknown characters also scan as Eof, but with a value
+    return scanner.CurToken().m_type == TokenType::Eof && scanner.CurToken().m_val.empty();
+}
+
+// a single expression can share a module with others, anything else goes through RunScript
+bool IsExpression(const std::string &script) {
+    Scanner scanner(script);
+    bool separated = false;
+    for (scanner.NextToken(); !AtEnd(scanner); scanner.NextToken()) {
+        TokenType type = scanner.CurToken().m_type;
+        if (type == TokenType::DEF || type == TokenType::EXTERN) return false;
+        if (type == TokenType::SEMICOLON)
+            separated = true;
+        else if (separated)
+            return false;
+    }
+    return true;
+}
+
+std::string Ok(const std::string &id, double value) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.17g", value);
+    return id + " ok " + buf;
+}
+
+// a reply is one line, whatever the message
+std::string Error(const std::string &id, std::string message) {
+    std::replace(message.begin(), message.end(), '\n', ' ');
+    return id + " error " + message;
+}
+
+}
+
+Server::Connection::~Connection() {
+    if (fd >= 0) close(fd);
+}
+
+void Server::Connection::Send(const std::string &line) {
+    std::string msg = line + "\n";
+    std::lock_guard<std::mutex> guard(writeMutex);
+    for (size_t sent = 0; sent < msg.size();) {
+        // the peer may be gone already, that must not raise SIGPIPE
+        ssize_t n = send(fd, msg.data() + sent, msg.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        sent += n;
+    }
+}
+
+Server::Server(const ServerOptions &options) : m_options(options) {
+    if (!m_options.workers) m_options.workers = std::max(1u, std::thread::hardware_concurrency());
+    m_options.maxBatch = std::max<size_t>(m_options.maxBatch, 1);
+}
+
+Server::~Server() { Stop(); }
+
+bool Server::Start() {
+    InitJIT();
+
+    sockaddr_storage addr;
+    socklen_t len = MakeAddress(m_options.socketPath, m_options.port, &addr);
+    if (!len) {
+        fprintf(stderr, "socket path too long: %s\n", m_options.socketPath.c_str());
+        return false;
+    }
+    m_listenFD = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (m_listenFD < 0) {
+        perror("socket");
+        return false;
+    }
+    if (!m_options.socketPath.empty()) {
+        unlink(m_options.socketPath.c_str());
+    } else {
+        int one = 1;
+        setsockopt(m_listenFD, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+    if (bind(m_listenFD, reinterpret_cast<sockaddr *>(&addr), len) || listen(m_listenFD, 128)) {
+        perror("bind");
+        close(m_listenFD);
+        m_listenFD = -1;
+        return false;
+    }
+    if (m_options.socketPath.empty()) {
+        len = sizeof(addr);
+        getsockname(m_listenFD, reinterpret_cast<sockaddr *>(&addr), &len);
+        m_port = ntohs(reinterpret_cast<sockaddr_in *>(&addr)->sin_port);
+    }
+
+    for (size_t i = 0; i < m_options.workers; i++) m_workers.emplace_back(&Server::Evaluate, this);
+    m_compiler = std::thread(&Server::Compile, this);
+    m_acceptor = std::thread(&Server::Accept, this);
+    return true;
+}
+
+void Server::Stop() {
+    if (m_stop.exchange(true)) return;
+    // unblocks accept
+    if (m_listenFD >= 0) shutdown(m_listenFD, SHUT_RDWR);
+    if (m_acceptor.joinable()) m_acceptor.join();
+    if (m_listenFD >= 0) close(m_listenFD);
+    if (!m_options.socketPath.empty()) unlink(m_options.socketPath.c_str());
+
+    {
+        std::lock_guard<std::mutex> guard(m_connMutex);
+        for (auto &conn : m_connections) shutdown(conn->fd, SHUT_RDWR);
+        for (auto &conn : m_connections) conn->reader.join();
+    }
+
+    m_queueReady.notify_all();
+    if (m_compiler.joinable()) m_compiler.join();
+    {
+        std::lock_guard<std::mutex> guard(m_taskMutex);
+        m_stopWorkers = true;
+    }
+    m_taskReady.notify_all();
+    for (auto &worker : m_workers) worker.join();
+    m_workers.clear();
+    m_queue.clear();
+    m_connections.clear();
+}
+
+void Server::Accept() {
+    while (!m_stop) {
+        int fd = accept4(m_listenFD, nullptr, nullptr, SOCK_CLOEXEC);
+        std::lock_guard<std::mutex> guard(m_connMutex);
+        // forget connections whose peer hung up, replies still in flight keep them open
+        for (auto it = m_connections.begin(); it != m_connections.end();) {
+            if ((*it)->done) {
+                (*it)->reader.join();
+                it = m_connections.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        if (fd < 0) {
+            if (m_stop || (errno != EINTR && errno != ECONNABORTED)) return;
+            continue;
+        }
+        if (m_options.socketPath.empty()) NoDelay(fd);
+        auto conn = std::make_shared<Connection>();
+        conn->fd = fd;
+        conn->reader = std::thread(&Server::Read, this, conn);
+        m_connections.push_back(std::move(conn));
+    }
+}
+
+void Server::Read(std::shared_ptr<Connection> conn) {
+    std::string buffer;
+    char chunk[4096];
+    while (true) {
+        ssize_t n = read(conn->fd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        buffer.append(chunk, n);
+
+        // everything that arrived together is queued together
+        std::vector<Request> requests;
+        size_t start = 0, end;
+        while ((end = buffer.find('\n', start)) != std::string::npos) {
+            std::string line = buffer.substr(start, end - start);
+            start = end + 1;
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (line.empty()) continue;
+            size_t space = line.find(' ');
+            if (space == std::string::npos) {
+                conn->Send(line + " error empty request");
+                continue;
+            }
+            std::string script = line.substr(space + 1);
+            bool expression = IsExpression(script);
+            requests.push_back(Request{conn, line.substr(0, space), std::move(script), expression});
+        }
+        buffer.erase(0, start);
+        if (requests.empty()) continue;
+        {
+            std::lock_guard<std::mutex> guard(m_queueMutex);
+            for (auto &request : requests) m_queue.push_back(std::move(request));
+        }
+        m_queueReady.notify_one();
+    }
+    conn->done = true;
+}
+
+void Server::Compile() {
+    while (true) {
+        std::vector<Request> batch;
+        {
+            std::unique_lock<std::mutex> lock(m_queueMutex);
+            m_queueReady.wait(lock, [&] { return m_stop || !m_queue.empty(); });
+            if (m_stop) return;
+            if (!m_queue.front().expression) {
+                Request request = std::move(m_queue.front());
+                m_queue.pop_front();
+                lock.unlock();
+                RunSerial(request);
+                continue;
+            }
+            // whatever queued up behind the previous compilation goes into this one
+            while (!m_queue.empty() && m_queue.front().expression && batch.size() < m_options.maxBatch) {
+                batch.push_back(std::move(m_queue.front()));
+                m_queue.pop_front();
+            }
+        }
+        RunBatch(batch);
+    }
+}
+
+void Server::RunBatch(std::vector<Request> &requests) {
+    BERNARD_TIME_SCOPE("server.batch");
+    std::vector<std::string> sources;
+    for (auto &request : requests) sources.push_back(request.script);
+    std::shared_ptr<ExprBatch> batch = CompileBatch(sources);
+    if (!batch) {
+        for (auto &request : requests) request.conn->Send(request.id + " error engine unavailable");
+        return;
+    }
+    m_batches++;
+    BERNARD_COUNT("server.batched_requests", requests.size());
+
+    size_t queued = 0;
+    {
+        std::lock_guard<std::mutex> guard(m_taskMutex);
+        for (size_t i = 0; i < requests.size(); i++) {
+            if (!batch->Error(i).empty()) continue;
+            Request &request = requests[i];
+            m_tasks.push_back([batch, i, conn = request.conn, id = request.id] { conn->Send(Ok(id, batch->Run(i))); });
+            queued++;
+        }
+        m_running += queued;
+    }
+    if (queued) m_taskReady.notify_all();
+    for (size_t i = 0; i < requests.size(); i++)
+        if (!batch->Error(i).empty()) requests[i].conn->Send(Error(requests[i].id, batch->Error(i)));
+}
+
+void Server::RunSerial(const Request &request) {
+    BERNARD_TIME_SCOPE("server.serial");
+    {
+        std::unique_lock<std::mutex> lock(m_taskMutex);
+        m_drained.wait(lock, [&] { return m_running == 0; });
+    }
+    Scanner scanner(request.script);
+    std::string error;
+    if (RunScript(scanner, &error))
+        request.conn->Send(Ok(request.id, LastResult()));
+    else
+        request.conn->Send(Error(request.id, error));
+}
+
+void Server::Evaluate() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(m_taskMutex);
+            m_taskReady.wait(lock, [&] { return m_stopWorkers || !m_tasks.empty(); });
+            if (m_tasks.empty()) return;
+            task = std::move(m_tasks.front());
+            m_tasks.pop_front();
+        }
+        task();
+        std::lock_guard<std::mutex> guard(m_taskMutex);
+        if (--m_running == 0) m_drained.notify_all();
+    }
+}
+
+int ServerConnect(const std::string &socketPath, int port) {
+    sockaddr_storage addr;
+    socklen_t len = MakeAddress(socketPath, port, &addr);
+    if (!len) return -1;
+    int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, reinterpret_cast<sockaddr *>(&addr), len)) {
+        close(fd);
+        return -1;
+    }
+    if (socketPath.empty()) NoDelay(fd);
+    return fd;
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <Parser.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct ServerOptions {
+    // Unix-domain socket to listen on, localhost TCP on port when empty
+    std::string socketPath;
+    // 0 picks a free port, see Server::Port
+    int port = 0;
+    // threads running evaluations, 0 means one per hardware thread
+    size_t workers = 0;
+    // most top-level expressions compiled into one module
+    size_t maxBatch = 64;
+};
+
+// Evaluation server around a warm engine. The protocol is line based: a request is "<id> <script>",
+// the reply "<id> ok <value>" or "<id> error <message>". A client may pipeline any number of
+// requests on one connection, replies carry the id and come back in completion order.
+//
+// One thread owns the engine and takes requests in arrival order. Requests that are a single
+// expression are batched with the ones queued behind them into one module (CompileBatch) and run on
+// the worker threads. Anything else, defs and externs included, waits for the evaluations in
+// flight and then runs through RunScript, so a request never sees a def that arrived after it. Its
+// reply carries LastResult, or the first error when any part of the script failed.
+class Server {
+public:
+    explicit Server(const ServerOptions &options);
+
+    ~Server();
+
+    // creates the JIT, binds and serves on background threads
+    bool Start();
+
+    // the TCP port bound, 0 on a Unix-domain socket
+    int Port() const { return m_port; }
+
+    void Stop();
+
+    uint64_t Batches() const { return m_batches.load(); }
+
+private:
+    struct Connection {
+        int fd = -1;
+        std::mutex writeMutex;
+        std::thread reader;
+        std::atomic<bool> done{false};
+
+        ~Connection();
+
+        void Send(const std::string &line);
+    };
+
+    struct Request {
+        std::shared_ptr<Connection> conn;
+        std::string id;
+        std::string script;
+        bool expression;
+    };
+
+    void Accept();
+
+    void Read(std::shared_ptr<Connection> conn);
+
+    void Compile();
+
+    void RunBatch(std::vector<Request> &requests);
+
+    void RunSerial(const Request &request);
+
+    void Evaluate();
+
+    ServerOptions m_options;
+    int m_listenFD = -1;
+    int m_port = 0;
+    std::atomic<bool> m_stop{false};
+
+    std::thread m_acceptor;
+    std::mutex m_connMutex;
+    std::list<std::shared_ptr<Connection>> m_connections;
+
+    // requests in arrival order, drained by the compiler thread
+    std::mutex m_queueMutex;
+    std::condition_variable m_queueReady;
+    std::deque<Request> m_queue;
+    std::thread m_compiler;
+
+    // evaluations for the workers, m_running counts the queued ones and the ones in flight
+    std::mutex m_taskMutex;
+    std::condition_variable m_taskReady;
+    std::condition_variable m_drained;
+    std::deque<std::function<void()>> m_tasks;
+    size_t m_running = 0;
+    // set once the compiler thread is gone, workers then finish the queue and exit
+    bool m_stopWorkers = false;
+    std::vector<std::thread> m_workers;
+
+    std::atomic<uint64_t> m_batches{0};
+};
+
+// connects to a server, -1 on failure
+int ServerConnect(const std::string &socketPath, int port);
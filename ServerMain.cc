@@ -0,0 +1,55 @@
+#include <Server.h>
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+// bernard_server: keeps a warm engine and evaluates requests from local clients, see Server.h.
+//   bernard_server [-s socket | -p port] [-w workers] [-b max-batch]
+// Without -s it listens on localhost, port 0 picks one. Runs until SIGINT or SIGTERM.
+
+static int Usage() {
+    fprintf(stderr, "usage: bernard_server [-s socket | -p port] [-w workers] [-b max-batch]\n");
+    return 2;
+}
+
+int main(int argc, char **argv) {
+    ServerOptions options;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-s") && i + 1 < argc)
+            options.socketPath = argv[++i];
+        else if (!strcmp(argv[i], "-p") && i + 1 < argc)
+            options.port = std::atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-w") && i + 1 < argc)
+            options.workers = std::atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-b") && i + 1 < argc)
+            options.maxBatch = std::atoi(argv[++i]);
+        else
+            return Usage();
+    }
+
+    // blocked before any thread starts so only sigwait below sees them
+    sigset_t stop;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop, nullptr);
+
+    // otherwise the codegen formats IR and pass logs for every request
+    if (!std::getenv("BERNARD_VERBOSE")) SetQuiet(true);
+
+    Server server(options);
+    if (!server.Start()) return 1;
+    if (options.socketPath.empty())
+        printf("listening on 127.0.0.1:%d\n", server.Port());
+    else
+        printf("listening on %s\n", options.socketPath.c_str());
+    fflush(stdout);
+
+    int sig;
+    sigwait(&stop, &sig);
+    server.Stop();
+    return 0;
+}
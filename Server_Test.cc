@@ -0,0 +1,116 @@
+#include <gtest/gtest.h>
+#include <Server.h>
+
+#include <map>
+#include <string>
+#include <unistd.h>
+
+// reads n reply lines, keyed by request id
+static std::map<std::string, std::string> ReadReplies(int fd, size_t n) {
+    std::map<std::string, std::string> replies;
+    std::string buffer;
+    char chunk[4096];
+    while (replies.size() < n) {
+        ssize_t got = read(fd, chunk, sizeof(chunk));
+        if (got <= 0) break;
+        buffer.append(chunk, got);
+        size_t start = 0, end;
+        while ((end = buffer.find('\n', start)) != std::string::npos) {
+            std::string line = buffer.substr(start, end - start);
+            size_t space = line.find(' ');
+            replies[line.substr(0, space)] = line.substr(space + 1);
+            start = end + 1;
+        }
+        buffer.erase(0, start);
+    }
+    return replies;
+}
+
+TEST(Server, pipelinedRequests) {
+    ServerOptions options;
+    options.workers = 2;
+    Server server(options);
+    ASSERT_TRUE(server.Start());
+    int fd = ServerConnect("", server.Port());
+    ASSERT_GE(fd, 0);
+
+    // the def is ahead of the expressions using it, they must see it
+    std::string requests = "d def sq(x) x * x\n";
+    for (int i = 0; i < 100; i++) requests += std::to_string(i) + " sq(" + std::to_string(i) + ")\n";
+    requests += "bad 1 +\n";
+    ASSERT_EQ(write(fd, requests.data(), requests.size()), ssize_t(requests.size()));
+
+    auto replies = ReadReplies(fd, 102);
+    ASSERT_EQ(replies.size(), 102);
+    for (int i = 0; i < 100; i++) EXPECT_EQ(replies[std::to_string(i)], "ok " + std::to_string(i * i));
+    EXPECT_EQ(replies["bad"].rfind("error", 0), 0);
+    // expressions that queued up together share compilations
+    EXPECT_LT(server.Batches(), 100);
+    close(fd);
+}
+
+TEST(Server, unresolvedExtern) {
+    ServerOptions options;
+    Server server(options);
+    ASSERT_TRUE(server.Start());
+    int fd = ServerConnect("", server.Port());
+    ASSERT_GE(fd, 0);
+
+    // the call to nosuch can't link, the expressions queued with it must still run
+    std::string requests = "e extern nosuch()\n";
+    for (int i = 0; i < 20; i++) requests += std::to_string(i) + " " + std::to_string(i) + " + 1\n";
+    requests += "n nosuch()\n";
+    for (int i = 20; i < 40; i++) requests += std::to_string(i) + " " + std::to_string(i) + " + 1\n";
+    ASSERT_EQ(write(fd, requests.data(), requests.size()), ssize_t(requests.size()));
+
+    auto replies = ReadReplies(fd, 42);
+    ASSERT_EQ(replies.size(), 42);
+    EXPECT_EQ(replies["n"].rfind("error", 0), 0);
+    for (int i = 0; i < 40; i++) EXPECT_EQ(replies[std::to_string(i)], "ok " + std::to_string(i + 1));
+
+    // and the server is still there
+    std::string again = "a 6 * 7\n";
+    ASSERT_EQ(write(fd, again.data(), again.size()), ssize_t(again.size()));
+    EXPECT_EQ(ReadReplies(fd, 1)["a"], "ok 42");
+    close(fd);
+}
+
+TEST(Server, badDef) {
+    ServerOptions options;
+    Server server(options);
+    ASSERT_TRUE(server.Start());
+    int fd = ServerConnect("", server.Port());
+    ASSERT_GE(fd, 0);
+
+    std::string requests = "v 5 + 5\nd def broken(x) x +\nu def usesMissing(x) missing(x)\ne extern\ng def fine(x) x\n";
+    ASSERT_EQ(write(fd, requests.data(), requests.size()), ssize_t(requests.size()));
+    auto replies = ReadReplies(fd, 5);
+    EXPECT_EQ(replies["v"], "ok 10");
+    // not the value of the expression before them
+    EXPECT_EQ(replies["d"].rfind("error", 0), 0);
+    EXPECT_EQ(replies["e"].rfind("error", 0), 0);
+    EXPECT_EQ(replies["u"], "error Unknown function missing referenced");
+    EXPECT_EQ(replies["g"].rfind("ok", 0), 0);
+    close(fd);
+}
+
+TEST(Server, unixSocket) {
+    ServerOptions options;
+    options.socketPath = "/tmp/bernard_server_test.sock";
+    Server server(options);
+    ASSERT_TRUE(server.Start());
+    int fd = ServerConnect(options.socketPath, 0);
+    ASSERT_GE(fd, 0);
+    std::string requests = "a def k() 7\nb k() * 6\n";
+    ASSERT_EQ(write(fd, requests.data(), requests.size()), ssize_t(requests.size()));
+    auto replies = ReadReplies(fd, 2);
+    EXPECT_EQ(replies["b"], "ok 42");
+    close(fd);
+    server.Stop();
+    EXPECT_NE(access(options.socketPath.c_str(), F_OK), 0);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,123 @@
+#include <Stats.h>
+
+#include <limits>
+
+namespace {
+
+int BucketOf(uint64_t ns) {
+    int bucket = 0;
+    while (ns > 1 && bucket < Histogram::kBuckets - 1) {
+        ns >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+void WriteJsonString(std::ostream &os, const std::string &str) {
+    os << '"';
+    for (char ch : str) {
+        if (ch == '"' || ch == '\\') os << '\\';
+        os << ch;
+    }
+    os << '"';
+}
+
+}
+
+Histogram::Histogram() { Reset(); }
+
+void Histogram::Record(uint64_t ns) {
+    m_buckets[BucketOf(ns)].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sum.fetch_add(ns, std::memory_order_relaxed);
+
+    uint64_t cur = m_min.load(std::memory_order_relaxed);
+    while (ns < cur && !m_min.compare_exchange_weak(cur, ns, std::memory_order_relaxed)) {}
+    cur = m_max.load(std::memory_order_relaxed);
+    while (ns > cur && !m_max.compare_exchange_weak(cur, ns, std::memory_order_relaxed)) {}
+}
+
+void Histogram::Reset() {
+    for (auto &bucket : m_buckets) bucket.store(0, std::memory_order_relaxed);
+    m_count.store(0, std::memory_order_relaxed);
+    m_sum.store(0, std::memory_order_relaxed);
+    m_min.store(std::numeric_limits<uint64_t>::max(), std::memory_order_relaxed);
+    m_max.store(0, std::memory_order_relaxed);
+}
+
+uint64_t Histogram::Min() const { return Count() ? m_min.load(std::memory_order_relaxed) : 0; }
+
+uint64_t Histogram::Percentile(double p) const {
+    uint64_t total = Count();
+    if (!total) return 0;
+    uint64_t rank = static_cast<uint64_t>(p / 100.0 * total);
+    if (rank >= total) rank = total - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; i++) {
+        seen += m_buckets[i].load(std::memory_order_relaxed);
+        if (seen > rank) return i == kBuckets - 1 ? Max() : (uint64_t(2) << i) - 1;
+    }
+    return Max();
+}
+
+StatsRegistry &StatsRegistry::Instance() {
+    static StatsRegistry registry;
+    return registry;
+}
+
+Histogram &StatsRegistry::GetHistogram(const std::string &name) {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    std::unique_ptr<Histogram> &hist = m_histograms[name];
+    if (!hist) hist = std::make_unique<Histogram>();
+    return *hist;
+}
+
+std::atomic<uint64_t> &StatsRegistry::GetCounter(const std::string &name) {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    std::unique_ptr<std::atomic<uint64_t>> &counter = m_counters[name];
+    if (!counter) counter = std::make_unique<std::atomic<uint64_t>>(0);
+    return *counter;
+}
+
+void StatsRegistry::DumpText(std::ostream &os) const {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    for (auto &entry : m_histograms) {
+        const Histogram &hist = *entry.second;
+        if (!hist.Count()) continue;
+        os << entry.first << ": count " << hist.Count() << " sum " << hist.Sum() << "ns min " << hist.Min()
+           << "ns p50 " << hist.Percentile(50) << "ns p99 " << hist.Percentile(99) << "ns max " << hist.Max()
+           << "ns" << std::endl;
+    }
+    for (auto &entry : m_counters)
+        os << entry.first << ": " << entry.second->load(std::memory_order_relaxed) << std::endl;
+}
+
+void StatsRegistry::DumpJson(std::ostream &os) const {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    os << "{\"histograms\":{";
+    bool first = true;
+    for (auto &entry : m_histograms) {
+        const Histogram &hist = *entry.second;
+        if (!first) os << ',';
+        first = false;
+        WriteJsonString(os, entry.first);
+        os << ":{\"count\":" << hist.Count() << ",\"sum_ns\":" << hist.Sum() << ",\"min_ns\":" << hist.Min()
+           << ",\"p50_ns\":" << hist.Percentile(50) << ",\"p99_ns\":" << hist.Percentile(99)
+           << ",\"max_ns\":" << hist.Max() << "}";
+    }
+    os << "},\"counters\":{";
+    first = true;
+    for (auto &entry : m_counters) {
+        if (!first) os << ',';
+        first = false;
+        WriteJsonString(os, entry.first);
+        os << ':' << entry.second->load(std::memory_order_relaxed);
+    }
+    os << "}}" << std::endl;
+}
+
+void StatsRegistry::Reset() {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    for (auto &entry : m_histograms) entry.second->Reset();
+    for (auto &entry : m_counters) entry.second->store(0, std::memory_order_relaxed);
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+// log2-bucketed latency histogram, values are nanoseconds.
+class Histogram {
+public:
+    static const int kBuckets = 64;
+
+    Histogram();
+
+    void Record(uint64_t ns);
+
+    void Reset();
+
+    uint64_t Count() const { return m_count.load(std::memory_order_relaxed); }
+    uint64_t Sum() const { return m_sum.load(std::memory_order_relaxed); }
+    uint64_t Min() const;
+    uint64_t Max() const { return m_max.load(std::memory_order_relaxed); }
+
+    // upper bound of the bucket holding the p-th percentile, p in [0, 100]
+    uint64_t Percentile(double p) const;
+
+private:
+    std::atomic<uint64_t> m_buckets[kBuckets];
+    std::atomic<uint64_t> m_count;
+    std::atomic<uint64_t> m_sum;
+    std::atomic<uint64_t> m_min;
+    std::atomic<uint64_t> m_max;
+};
+
+class StatsRegistry {
+public:
+    static StatsRegistry &Instance();
+
+    // returned references stay valid for the lifetime of the process
+    Histogram &GetHistogram(const std::string &name);
+    std::atomic<uint64_t> &GetCounter(const std::string &name);
+
+    void DumpText(std::ostream &os) const;
+    void DumpJson(std::ostream &os) const;
+
+    void Reset();
+
+private:
+    mutable std::mutex m_mutex;
+    std::map<std::string, std::unique_ptr<Histogram>> m_histograms;
+    std::map<std::string, std::unique_ptr<std::atomic<uint64_t>>> m_counters;
+};
+
+class ScopedTimer {
+public:
+    explicit ScopedTimer(Histogram &hist) : m_hist(hist), m_start(std::chrono::steady_clock::now()) {}
+
+    ~ScopedTimer() {
+        auto elapsed = std::chrono::steady_clock::now() - m_start;
+        m_hist.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+
+private:
+    Histogram &m_hist;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+#define BERNARD_STATS_CONCAT_IMPL(a, b) a##b
+#define BERNARD_STATS_CONCAT(a, b) BERNARD_STATS_CONCAT_IMPL(a, b)
+
+// Instrumentation points, these expand to nothing unless built with BERNARD_STATS.
+#ifdef BERNARD_STATS
+#define BERNARD_TIME_SCOPE(name)                                                                      \
+    static Histogram &BERNARD_STATS_CONCAT(bernardHist, __LINE__) =                                   \
+            StatsRegistry::Instance().GetHistogram(name);                                             \
+    ScopedTimer BERNARD_STATS_CONCAT(bernardTimer, __LINE__)(BERNARD_STATS_CONCAT(bernardHist, __LINE__))
+#define BERNARD_COUNT(name, n)                                                                        \
+    do {                                                                                              \
+        static std::atomic<uint64_t> &bernardCounter = StatsRegistry::Instance().GetCounter(name);   \
+        bernardCounter.fetch_add(n, std::memory_order_relaxed);                                       \
+    } while (0)
+#else
+#define BERNARD_TIME_SCOPE(name) do {} while (0)
+#define BERNARD_COUNT(name, n) do {} while (0)
+#endif
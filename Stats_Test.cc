@@ -0,0 +1,42 @@
+#include <gtest/gtest.h>
+#include <Stats.h>
+
+#include <sstream>
+
+TEST(Stats, histogram) {
+    Histogram hist;
+    for (uint64_t i = 1; i <= 100; i++) hist.Record(i * 1000);
+
+    EXPECT_EQ(hist.Count(), 100);
+    EXPECT_EQ(hist.Sum(), 5050000);
+    EXPECT_EQ(hist.Min(), 1000);
+    EXPECT_EQ(hist.Max(), 100000);
+    EXPECT_GE(hist.Percentile(50), 50000);
+    EXPECT_LE(hist.Percentile(50), 2 * 50000);
+    EXPECT_GE(hist.Percentile(99), 99000);
+
+    hist.Reset();
+    EXPECT_EQ(hist.Count(), 0);
+    EXPECT_EQ(hist.Min(), 0);
+}
+
+TEST(Stats, dump) {
+    StatsRegistry &registry = StatsRegistry::Instance();
+    registry.GetHistogram("test.stage").Record(42);
+    registry.GetCounter("test.counter") += 3;
+
+    std::ostringstream text;
+    registry.DumpText(text);
+    EXPECT_NE(text.str().find("test.stage: count 1"), std::string::npos);
+    EXPECT_NE(text.str().find("test.counter: 3"), std::string::npos);
+
+    std::ostringstream json;
+    registry.DumpJson(json);
+    EXPECT_NE(json.str().find("\"test.stage\":{\"count\":1"), std::string::npos);
+    EXPECT_NE(json.str().find("\"test.counter\":3"), std::string::npos);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
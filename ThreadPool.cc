@@ -0,0 +1,108 @@
+#include <ThreadPool.h>
+
+#include <algorithm>
+
+namespace {
+
+// set on pool threads and on a caller while it runs a loop, nested loops then run inline
+thread_local bool t_inPool = false;
+
+}
+
+ThreadPool::ThreadPool(size_t threads) {
+    if (!threads) threads = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t i = 0; i < threads; i++) m_queues.push_back(std::make_unique<Queue>());
+    // the last queue belongs to whoever calls ParallelFor
+    for (size_t i = 0; i + 1 < threads; i++) m_workers.emplace_back(&ThreadPool::Worker, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> guard(m_wakeMutex);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    for (auto &worker : m_workers) worker.join();
+}
+
+void ThreadPool::ParallelFor(int64_t n, int64_t grain, const std::function<void(int64_t, int64_t)> &body) {
+    if (n <= 0) return;
+    grain = std::max<int64_t>(grain, 1);
+    if (t_inPool || m_workers.empty() || n <= grain) {
+        for (int64_t lo = 0; lo < n; lo += grain) body(lo, std::min(n, lo + grain));
+        return;
+    }
+
+    std::lock_guard<std::mutex> job(m_jobMutex);
+    mp_body = &body;
+    m_grain = grain;
+    size_t self = m_queues.size() - 1;
+    Push(self, Range{0, n});
+    m_remaining.store(n);
+    {
+        std::lock_guard<std::mutex> guard(m_wakeMutex);
+        m_generation++;
+    }
+    m_wake.notify_all();
+
+    t_inPool = true;
+    RunJob(self);
+    t_inPool = false;
+}
+
+void ThreadPool::Worker(size_t self) {
+    t_inPool = true;
+    uint64_t seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(m_wakeMutex);
+            m_wake.wait(lock, [&] { return m_stop || m_generation != seen; });
+            if (m_stop) return;
+            seen = m_generation;
+        }
+        RunJob(self);
+    }
+}
+
+void ThreadPool::RunJob(size_t self) {
+    while (m_remaining.load() > 0) {
+        Range range;
+        if (!Pop(self, &range) && !Steal(self, &range)) {
+            std::this_thread::yield();
+            continue;
+        }
+        while (range.hi - range.lo > m_grain) {
+            int64_t mid = range.lo + (range.hi - range.lo) / 2;
+            Push(self, Range{mid, range.hi});
+            range.hi = mid;
+        }
+        (*mp_body)(range.lo, range.hi);
+        m_remaining.fetch_sub(range.hi - range.lo);
+    }
+}
+
+void ThreadPool::Push(size_t self, const Range &range) {
+    std::lock_guard<std::mutex> guard(m_queues[self]->mutex);
+    m_queues[self]->ranges.push_back(range);
+}
+
+bool ThreadPool::Pop(size_t self, Range *range) {
+    std::lock_guard<std::mutex> guard(m_queues[self]->mutex);
+    if (m_queues[self]->ranges.empty()) return false;
+    *range = m_queues[self]->ranges.back();
+    m_queues[self]->ranges.pop_back();
+    return true;
+}
+
+bool ThreadPool::Steal(size_t self, Range *range) {
+    for (size_t i = 1; i < m_queues.size(); i++) {
+        Queue &victim = *m_queues[(self + i) % m_queues.size()];
+        std::lock_guard<std::mutex> guard(victim.mutex);
+        if (victim.ranges.empty()) continue;
+        // the oldest range is the largest one left
+        *range = victim.ranges.front();
+        victim.ranges.pop_front();
+        return true;
+    }
+    return false;
+}
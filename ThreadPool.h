@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing pool for data parallel loops. Every thread, the caller of ParallelFor included,
+// owns a deque of index ranges: it splits its range in halves down to the grain, keeps working on
+// the front half and leaves the back half to thieves, which take from the opposite end.
+class ThreadPool {
+public:
+    // threads counts the calling thread, 0 means one per hardware thread
+    explicit ThreadPool(size_t threads = 0);
+
+    ~ThreadPool();
+
+    size_t Concurrency() const { return m_queues.size(); }
+
+    // Runs body on disjoint ranges covering [0, n), none longer than grain, and returns when all
+    // of them are done. One loop runs at a time, a nested call runs inline on the calling worker.
+    void ParallelFor(int64_t n, int64_t grain, const std::function<void(int64_t, int64_t)> &body);
+
+private:
+    struct Range {
+        int64_t lo;
+        int64_t hi;
+    };
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Range> ranges;
+    };
+
+    void Worker(size_t self);
+
+    void RunJob(size_t self);
+
+    void Push(size_t self, const Range &range);
+
+    bool Pop(size_t self, Range *range);
+
+    bool Steal(size_t self, Range *range);
+
+    std::vector<std::unique_ptr<Queue>> m_queues;
+    std::vector<std::thread> m_workers;
+
+    std::mutex m_jobMutex;
+    const std::function<void(int64_t, int64_t)> *mp_body = nullptr;
+    int64_t m_grain = 1;
+    std::atomic<int64_t> m_remaining{0};
+
+    std::mutex m_wakeMutex;
+    std::condition_variable m_wake;
+    uint64_t m_generation = 0;
+    bool m_stop = false;
+};
@@ -0,0 +1,55 @@
+#include <gtest/gtest.h>
+#include <ThreadPool.h>
+
+#include <atomic>
+#include <set>
+#include <vector>
+
+TEST(ThreadPool, coversEveryIndexOnce) {
+    ThreadPool pool(4);
+    std::vector<std::atomic<int>> hits(10007);
+    std::atomic<int64_t> longest{0};
+    pool.ParallelFor(hits.size(), 64, [&](int64_t lo, int64_t hi) {
+        for (int64_t i = lo; i < hi; i++) hits[i].fetch_add(1);
+        int64_t len = hi - lo, cur = longest.load();
+        while (len > cur && !longest.compare_exchange_weak(cur, len)) {}
+    });
+    for (auto &hit : hits) ASSERT_EQ(hit.load(), 1);
+    EXPECT_LE(longest.load(), 64);
+}
+
+TEST(ThreadPool, usesWorkers) {
+    ThreadPool pool(4);
+    std::mutex mutex;
+    std::set<std::thread::id> threads;
+    pool.ParallelFor(1 << 16, 1, [&](int64_t, int64_t) {
+        std::lock_guard<std::mutex> guard(mutex);
+        threads.insert(std::this_thread::get_id());
+    });
+    EXPECT_GT(threads.size(), 1);
+}
+
+TEST(ThreadPool, nestedRunsInline) {
+    ThreadPool pool(3);
+    std::atomic<int64_t> sum{0};
+    pool.ParallelFor(8, 1, [&](int64_t lo, int64_t hi) {
+        pool.ParallelFor(100, 10, [&](int64_t innerLo, int64_t innerHi) { sum.fetch_add(innerHi - innerLo); });
+    });
+    EXPECT_EQ(sum.load(), 800);
+}
+
+TEST(ThreadPool, repeatedLoops) {
+    ThreadPool pool(4);
+    for (int round = 0; round < 200; round++) {
+        std::atomic<int64_t> sum{0};
+        pool.ParallelFor(round, 3, [&](int64_t lo, int64_t hi) {
+            for (int64_t i = lo; i < hi; i++) sum.fetch_add(i);
+        });
+        ASSERT_EQ(sum.load(), int64_t(round) * (round - 1) / 2);
+    }
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}